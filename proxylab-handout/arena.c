@@ -0,0 +1,152 @@
+/*
+ * arena.c - size-classed block allocator over a preallocated region
+ *
+ * Used by the cache to hold each entry (item, object, body and tag) in
+ * one block of its shard's arena instead of three heap allocations.
+ * Block layout is the boundary-tag one from the malloc lab, with
+ * 8-byte words: hdr, payload aligned to ARENA_ALIGN, ftr. Free blocks
+ * keep their list links in the payload.
+ */
+#include "arena.h"
+
+#define WSIZE 8
+
+#define PACK(size, alloc)   ((size) | (alloc))
+#define GET(p)              (*(size_t *)(p))
+#define PUT(p, val)         (*(size_t *)(p) = (val))
+#define GET_SIZE(p)         (GET(p) & ~(size_t)(ARENA_ALIGN - 1))
+#define GET_ALLOC(p)        (GET(p) & 0x1)
+
+/* Given block ptr bp, its hdr/ftr and neighbours */
+#define HDRP(bp)            ((char *)(bp) - WSIZE)
+#define FTRP(bp)            ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2 * WSIZE)
+#define NEXT_BLKP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)))
+#define PREV_BLKP(bp)       ((char *)(bp) - GET_SIZE((char *)(bp) - 2 * WSIZE))
+
+/* Free list links in a free block's payload */
+#define NEXT_FREE(bp)       (((char **)(bp))[0])
+#define PREV_FREE(bp)       (((char **)(bp))[1])
+
+static int class_of(size_t size)
+{
+    int c = 63 - __builtin_clzll(size) - 5;
+    return c < ARENA_CLASSES ? c : ARENA_CLASSES - 1;
+}
+
+static void set_block(char *bp, size_t size, int alloc)
+{
+    PUT(HDRP(bp), PACK(size, alloc));
+    PUT(FTRP(bp), PACK(size, alloc));
+}
+
+/* push a free block on its class list; caller holds lock */
+static void list_insert(Arena *a, char *bp)
+{
+    char **head = &a->lists[class_of(GET_SIZE(HDRP(bp)))];
+
+    NEXT_FREE(bp) = *head;
+    PREV_FREE(bp) = NULL;
+    if(*head)
+        PREV_FREE(*head) = bp;
+    *head = bp;
+}
+
+static void list_remove(Arena *a, char *bp)
+{
+    if(PREV_FREE(bp))
+        NEXT_FREE(PREV_FREE(bp)) = NEXT_FREE(bp);
+    else
+        a->lists[class_of(GET_SIZE(HDRP(bp)))] = NEXT_FREE(bp);
+    if(NEXT_FREE(bp))
+        PREV_FREE(NEXT_FREE(bp)) = PREV_FREE(bp);
+}
+
+/*
+ * arena_init - manage size bytes at base as one free block
+ * base must be ARENA_ALIGN aligned.
+ */
+void arena_init(Arena *a, char *base, size_t size)
+{
+    // payloads land on ARENA_ALIGN with the hdr just before them
+    a->start = base + ARENA_ALIGN - WSIZE;
+    a->size = (size - (ARENA_ALIGN - WSIZE)) & ~(size_t)(ARENA_ALIGN - 1);
+    a->end = a->start + a->size;
+    a->used = 0;
+    memset(a->lists, 0, sizeof(a->lists));
+    pthread_mutex_init(&a->lock, NULL);
+    set_block(a->start + WSIZE, a->size, 0);
+    list_insert(a, a->start + WSIZE);
+}
+
+/*
+ * arena_blocksize - bytes a request for n bytes takes, hdrs included
+ */
+size_t arena_blocksize(size_t n)
+{
+    size_t size = (n + 2 * WSIZE + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    return size < ARENA_MIN_BLOCK ? ARENA_MIN_BLOCK : size;
+}
+
+/*
+ * arena_alloc - n bytes aligned to ARENA_ALIGN, or NULL if no free
+ * block is big enough
+ */
+void *arena_alloc(Arena *a, size_t n)
+{
+    size_t size = arena_blocksize(n), bsize;
+    char *bp = NULL;
+
+    pthread_mutex_lock(&a->lock);
+    // first fit in the request's own class; any block of a higher
+    // class is big enough
+    for(int c = class_of(size); c < ARENA_CLASSES && !bp; c++)
+        for(bp = a->lists[c]; bp && GET_SIZE(HDRP(bp)) < size; bp = NEXT_FREE(bp))
+            ;
+    if(bp){
+        list_remove(a, bp);
+        bsize = GET_SIZE(HDRP(bp));
+        // split off the tail if it can stand as a block
+        if(bsize - size >= ARENA_MIN_BLOCK){
+            set_block(bp, size, 1);
+            set_block(NEXT_BLKP(bp), bsize - size, 0);
+            list_insert(a, NEXT_BLKP(bp));
+        }
+        else
+            set_block(bp, size = bsize, 1);
+        __atomic_store_n(&a->used, a->used + size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+}
+
+/*
+ * arena_free - return a block, merging it with free neighbours
+ */
+void arena_free(Arena *a, void *p)
+{
+    char *bp = p, *next, *prev;
+    size_t size;
+
+    pthread_mutex_lock(&a->lock);
+    size = GET_SIZE(HDRP(bp));
+    __atomic_store_n(&a->used, a->used - size, __ATOMIC_RELAXED);
+    next = NEXT_BLKP(bp);
+    if(HDRP(next) < a->end && !GET_ALLOC(HDRP(next))){
+        list_remove(a, next);
+        size += GET_SIZE(HDRP(next));
+    }
+    if(HDRP(bp) > a->start && !GET_ALLOC(HDRP(bp) - WSIZE)){
+        prev = PREV_BLKP(bp);
+        list_remove(a, prev);
+        size += GET_SIZE(HDRP(prev));
+        bp = prev;
+    }
+    set_block(bp, size, 0);
+    list_insert(a, bp);
+    pthread_mutex_unlock(&a->lock);
+}
+
+size_t arena_free_bytes(Arena *a)
+{
+    return a->size - __atomic_load_n(&a->used, __ATOMIC_RELAXED);
+}
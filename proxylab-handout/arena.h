@@ -0,0 +1,34 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+/*
+ * Fixed-size region carved into blocks with a size-classed free list
+ * allocator. Every block carries an 8-byte hdr and ftr holding its size
+ * and alloc bit, so a freed block merges with free neighbours at once;
+ * free blocks are kept on ARENA_CLASSES lists by power-of-two size
+ * class and the first fit from the smallest class that can hold a
+ * request wins. The region is never grown: an allocation either fits
+ * or fails, so the region size bounds the memory used.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK 32      /* hdr, ftr and two free list links */
+#define ARENA_CLASSES 16        /* class i holds blocks of 2^(i+5) bytes up */
+
+typedef struct Arena {
+    char *start;                // first block
+    char *end;                  // past the last block
+    size_t size;                // end - start
+    size_t used;                // in allocated blocks, hdrs included; read atomically
+    char *lists[ARENA_CLASSES]; // free blocks by size class
+    pthread_mutex_t lock;
+} Arena;
+
+void arena_init(Arena *a, char *base, size_t size);
+size_t arena_blocksize(size_t n);
+void *arena_alloc(Arena *a, size_t n);
+void arena_free(Arena *a, void *p);
+size_t arena_free_bytes(Arena *a);
+
+#endif
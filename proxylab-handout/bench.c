@@ -0,0 +1,494 @@
+/*
+ * bench.c - load-testing harness for the proxy
+ *
+ * Starts a local origin that serves /obj/<id> with configurable sizes
+ * and latency, spawns ./proxy in front of it (or uses one already
+ * running), and drives it from many client threads that pick urls
+ * from a Zipf distribution. Closed-loop runs keep a fixed number of
+ * reqs outstanding; open-loop runs send at a fixed rate and time each
+ * req from when it was due, so a stalled proxy cannot hide its queue
+ * (no coordinated omission). Prints throughput, hit ratio, latency
+ * percentiles and, from the proxy's stats page, event-loop syscalls
+ * per req, and appends them to a CSV file if asked.
+ */
+#include <signal.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define USAGE "usage: %s [-c conns] [-r rate] [-d secs] [-u nurls] [-z skew] " \
+              "[-s size | -s min-max] [-l latency_ms] [-a \"proxy args\"] " \
+              "[-x proxyport] [-o file.csv] [-L label]\n"
+
+#define MAX_PROXY_ARGS 16
+#define OBJ_MAX (16 << 20)          /* largest object the origin serves */
+#define PROXY_WAIT_MS 5000          /* for a spawned proxy to listen */
+#define REQ_TIMEOUT_SECS 10         /* a stuck req counts as an error */
+
+/* Run settings */
+static int nconns = 16;             // client threads, one conn each
+static double rate = 0;             // reqs/sec over all threads; 0 is closed-loop
+static int secs = 10;
+static int nurls = 10000;
+static double skew = 0.99;          // Zipf exponent
+static long minsize = 16384, maxsize = 16384;
+static int latency_ms = 0;          // origin think time per req
+static char *label = "";
+
+static char proxyport[8];
+static char originport[8];
+static double *zipf_cdf;
+static volatile int stop = 0;
+static unsigned long origin_reqs;   // updated atomically
+static char *origin_body;
+
+/* One client thread's results */
+typedef struct {
+    int id;
+    unsigned long reqs;
+    unsigned long errors;
+    unsigned long bytes;
+    uint32_t *lat;                  // usecs per completed req
+    size_t nlat, caplat;
+} Client;
+
+static void *origin_listener(void *vargp);
+static void *origin_conn(void *vargp);
+static void *client_thread(void *vargp);
+static pid_t spawn_proxy(char *args);
+static unsigned long proxy_syscalls();
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*; each thread keeps its own state */
+static uint64_t next_rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+/*
+ * zipf_init - cdf[i] is the chance of picking a url ranked i or better
+ */
+static void zipf_init()
+{
+    double sum = 0;
+
+    zipf_cdf = (double *)Malloc(nurls * sizeof(double));
+    for(int i = 0; i < nurls; i++)
+        sum += 1.0 / pow(i + 1, skew);
+    for(int i = 0; i < nurls; i++)
+        zipf_cdf[i] = (i ? zipf_cdf[i - 1] : 0) + 1.0 / pow(i + 1, skew) / sum;
+    zipf_cdf[nurls - 1] = 1.0;
+}
+
+static int zipf_pick(uint64_t *s)
+{
+    double u = (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = nurls - 1, mid;
+
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* object sizes spread over min..max, fixed per id */
+static long obj_size(int id)
+{
+    if(maxsize == minsize)
+        return minsize;
+    return minsize + (id * 2654435761UL) % (maxsize - minsize + 1);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(uint32_t *)a, y = *(uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t pct(uint32_t *v, size_t n, double q)
+{
+    size_t i = (size_t)(q * n);
+    return n ? v[i < n ? i : n - 1] : 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *proxyargs = "", *csv = NULL;
+    int opt, listenfd, fd;
+    pid_t pid = -1;
+    pthread_t tid, *tids;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    Client *clients;
+    unsigned long reqs = 0, errors = 0, bytes = 0, fetched, syscalls;
+    uint32_t *lat;
+    size_t nlat = 0;
+    uint64_t start, elapsed;
+    double tput, hitratio;
+    FILE *fp;
+
+    while((opt = getopt(argc, argv, "c:r:d:u:z:s:l:a:x:o:L:")) != -1){
+        switch(opt){
+        case 'c': nconns = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': secs = atoi(optarg); break;
+        case 'u': nurls = atoi(optarg); break;
+        case 'z': skew = atof(optarg); break;
+        case 's':
+            // one size, or a range spread over the urls
+            if(sscanf(optarg, "%ld-%ld", &minsize, &maxsize) != 2)
+                maxsize = minsize = atol(optarg);
+            break;
+        case 'l': latency_ms = atoi(optarg); break;
+        case 'a': proxyargs = optarg; break;
+        case 'x': snprintf(proxyport, sizeof(proxyport), "%s", optarg); break;
+        case 'o': csv = optarg; break;
+        case 'L': label = optarg; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if(nconns < 1 || secs < 1 || nurls < 1 || rate < 0 || minsize < 0 ||
+       maxsize < minsize || maxsize > OBJ_MAX){
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+    zipf_init();
+
+    // origin on an ephemeral port
+    origin_body = (char *)Malloc(maxsize);
+    memset(origin_body, 'x', maxsize);
+    if((listenfd = open_listenfd("0")) < 0)
+        unix_error("origin listen error");
+    if(getsockname(listenfd, (SA *)&addr, &addrlen) < 0)
+        unix_error("getsockname error");
+    snprintf(originport, sizeof(originport), "%d",
+             ntohs(((struct sockaddr_in *)&addr)->sin_port));
+    Pthread_create(&tid, NULL, origin_listener, (void *)(long)listenfd);
+
+    // proxy under test
+    if(!proxyport[0]){
+        pid = spawn_proxy(proxyargs);
+        for(int waited = 0; (fd = open_clientfd("127.0.0.1", proxyport)) < 0; waited += 20){
+            if(waited >= PROXY_WAIT_MS){
+                fprintf(stderr, "proxy did not start\n");
+                kill(pid, SIGTERM);
+                exit(1);
+            }
+            usleep(20000);
+        }
+        Close(fd);
+    }
+
+    // run
+    clients = (Client *)Calloc(nconns, sizeof(Client));
+    tids = (pthread_t *)Malloc(nconns * sizeof(pthread_t));
+    fetched = __atomic_load_n(&origin_reqs, __ATOMIC_RELAXED);
+    syscalls = proxy_syscalls();
+    start = now_us();
+    for(int i = 0; i < nconns; i++){
+        clients[i].id = i;
+        Pthread_create(&tids[i], NULL, client_thread, &clients[i]);
+    }
+    sleep(secs);
+    stop = 1;
+    for(int i = 0; i < nconns; i++)
+        Pthread_join(tids[i], NULL);
+    elapsed = now_us() - start;
+    fetched = __atomic_load_n(&origin_reqs, __ATOMIC_RELAXED) - fetched;
+    syscalls = proxy_syscalls() - syscalls;
+    if(pid > 0){
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    // merge
+    for(int i = 0; i < nconns; i++)
+        nlat += clients[i].nlat;
+    lat = (uint32_t *)Malloc((nlat + 1) * sizeof(uint32_t));
+    nlat = 0;
+    for(int i = 0; i < nconns; i++){
+        reqs += clients[i].reqs;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        memcpy(lat + nlat, clients[i].lat, clients[i].nlat * sizeof(uint32_t));
+        nlat += clients[i].nlat;
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+    tput = reqs * 1e6 / elapsed;
+    hitratio = reqs ? 1.0 - (double)(fetched < reqs ? fetched : reqs) / reqs : 0;
+
+    printf("%s %d conns, %s, %d urls zipf %.2f, %ld-%ld bytes, origin %d ms\n",
+           rate > 0 ? "open-loop" : "closed-loop", nconns,
+           proxyargs[0] ? proxyargs : "default proxy", nurls, skew,
+           minsize, maxsize, latency_ms);
+    printf("reqs %lu errors %lu in %.2fs: %.0f req/s %.2f MB/s hit ratio %.2f%%\n",
+           reqs, errors, elapsed / 1e6, tput, bytes / (elapsed / 1e6) / 1e6, 100 * hitratio);
+    printf("latency us: p50 %u p99 %u p999 %u max %u\n", pct(lat, nlat, 0.5),
+           pct(lat, nlat, 0.99), pct(lat, nlat, 0.999), nlat ? lat[nlat - 1] : 0);
+    // only event loops count them
+    if(syscalls && reqs)
+        printf("loop syscalls per req: %.2f\n", (double)syscalls / reqs);
+
+    if(csv){
+        if(!(fp = fopen(csv, "a")))
+            unix_error("csv open error");
+        // header on a new file
+        if(ftell(fp) == 0)
+            fprintf(fp, "time,label,mode,proxy_args,conns,rate,secs,urls,skew,"
+                    "min_size,max_size,latency_ms,reqs,errors,req_per_sec,"
+                    "mb_per_sec,hit_ratio,p50_us,p99_us,p999_us,max_us,"
+                    "syscalls_per_req\n");
+        fprintf(fp, "%ld,%s,%s,\"%s\",%d,%.0f,%d,%d,%.2f,%ld,%ld,%d,%lu,%lu,"
+                "%.1f,%.2f,%.4f,%u,%u,%u,%u,%.2f\n",
+                (long)time(NULL), label, rate > 0 ? "open" : "closed", proxyargs,
+                nconns, rate, secs, nurls, skew, minsize, maxsize, latency_ms,
+                reqs, errors, tput, bytes / (elapsed / 1e6) / 1e6, hitratio,
+                pct(lat, nlat, 0.5), pct(lat, nlat, 0.99), pct(lat, nlat, 0.999),
+                nlat ? lat[nlat - 1] : 0, reqs ? (double)syscalls / reqs : 0);
+        fclose(fp);
+    }
+    return errors && !reqs;
+}
+
+/*
+ * proxy_syscalls - the proxy's loop_syscalls counter, or 0
+ */
+static unsigned long proxy_syscalls()
+{
+    char buf[MAXBUF], *p;
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    if((fd = open_clientfd("127.0.0.1", proxyport)) < 0)
+        return 0;
+    n = snprintf(buf, sizeof(buf), "GET /__proxy/stats HTTP/1.0\r\n\r\n");
+    if(rio_writen(fd, buf, n) != n){
+        close(fd);
+        return 0;
+    }
+    // the counters come first on the page
+    while(len < sizeof(buf) - 1 && (n = rio_readn(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    buf[len] = '\0';
+    if(!(p = strstr(buf, "\nloop_syscalls ")))
+        return 0;
+    return strtoul(p + 15, NULL, 10);
+}
+
+/*
+ * spawn_proxy - run ./proxy with args on a free port
+ */
+static pid_t spawn_proxy(char *args)
+{
+    char *argv[MAX_PROXY_ARGS + 3], *copy, *tok;
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int argc = 0, fd;
+    pid_t pid;
+
+    // the kernel picks a port; the proxy binds it right after
+    fd = Socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(fd, (SA *)&sin, sizeof(sin));
+    if(getsockname(fd, (SA *)&sin, &len) < 0)
+        unix_error("getsockname error");
+    snprintf(proxyport, sizeof(proxyport), "%d", ntohs(sin.sin_port));
+    Close(fd);
+
+    argv[argc++] = "./proxy";
+    copy = strdup(args);
+    for(tok = strtok(copy, " "); tok && argc <= MAX_PROXY_ARGS; tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc++] = proxyport;
+    argv[argc] = NULL;
+    if((pid = Fork()) == 0){
+        execv(argv[0], argv);
+        unix_error("exec ./proxy error");
+    }
+    free(copy);
+    return pid;
+}
+
+static void *origin_listener(void *vargp)
+{
+    int listenfd = (int)(long)vargp, connfd;
+    pthread_t tid;
+
+    while(1){
+        if((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        Pthread_create(&tid, NULL, origin_conn, (void *)(long)connfd);
+    }
+    return NULL;
+}
+
+/*
+ * origin_conn - serve /obj/<id> on one persistent conn
+ */
+static void *origin_conn(void *vargp)
+{
+    int fd = (int)(long)vargp, id, keep = 1, one = 1;
+    char line[MAXLINE], hdrs[MAXLINE];
+    struct iovec iov[2];
+    rio_t rio;
+    long size;
+    ssize_t n;
+
+    Pthread_detach(Pthread_self());
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    rio_readinitb(&rio, fd);
+    while(keep && rio_readlineb(&rio, line, MAXLINE) > 0){
+        if(sscanf(line, "GET /obj/%d", &id) != 1)
+            id = 0;
+        // the proxy may ask for a close-delimited conn
+        while((n = rio_readlineb(&rio, hdrs, MAXLINE)) > 0 && strcmp(hdrs, "\r\n"))
+            if(!strncasecmp(hdrs, "Connection:", 11) && strstr(hdrs, "close"))
+                keep = 0;
+        if(n <= 0)
+            break;
+        __atomic_add_fetch(&origin_reqs, 1, __ATOMIC_RELAXED);
+        if(latency_ms)
+            usleep(latency_ms * 1000);
+        size = obj_size(id);
+        n = snprintf(hdrs, MAXLINE, "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n"
+                     "Content-Type: application/octet-stream\r\n"
+                     "Cache-Control: max-age=3600\r\n\r\n", size);
+        // one write, so no segment waits on a delayed ACK
+        iov[0].iov_base = hdrs;
+        iov[0].iov_len = n;
+        iov[1].iov_base = origin_body;
+        iov[1].iov_len = size;
+        if(rio_writev(fd, iov, 2) != n + size)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void record(Client *cl, uint64_t us)
+{
+    if(cl->nlat == cl->caplat){
+        cl->caplat = cl->caplat ? 2 * cl->caplat : 4096;
+        cl->lat = (uint32_t *)Realloc(cl->lat, cl->caplat * sizeof(uint32_t));
+    }
+    cl->lat[cl->nlat++] = us > 0xffffffffU ? 0xffffffffU : us;
+}
+
+/*
+ * fetch - one req on *fd, reconnecting as needed
+ * A reused conn the proxy closed meanwhile is retried once on a new
+ * one. Returns the body length, or -1 on failure.
+ */
+static long fetch(int *fd, rio_t *rio, int id, char *scratch)
+{
+    struct timeval tv = { REQ_TIMEOUT_SECS, 0 };
+    char line[MAXLINE];
+    long clen = -1, left;
+    int status = 0, keep = 1, reused = *fd >= 0, n;
+
+    while(1){
+        if(*fd < 0){
+            if((*fd = open_clientfd("127.0.0.1", proxyport)) < 0)
+                return -1;
+            setsockopt(*fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            rio_readinitb(rio, *fd);
+        }
+        n = snprintf(line, MAXLINE, "GET http://127.0.0.1:%s/obj/%d HTTP/1.1\r\n"
+                     "Host: 127.0.0.1:%s\r\n\r\n", originport, id, originport);
+        if(rio_writen(*fd, line, n) == n && rio_readlineb(rio, line, MAXLINE) > 0)
+            break;
+        close(*fd);
+        *fd = -1;
+        if(!reused)
+            return -1;
+        reused = 0;
+    }
+    if(sscanf(line, "HTTP/%*s %d", &status) != 1)
+        goto fail;
+    while(1){
+        if(rio_readlineb(rio, line, MAXLINE) <= 0)
+            goto fail;
+        if(!strcmp(line, "\r\n"))
+            break;
+        if(!strncasecmp(line, "Content-Length:", 15))
+            clen = atol(line + 15);
+        else if(!strncasecmp(line, "Connection:", 11) && strstr(line, "close"))
+            keep = 0;
+    }
+    if(clen < 0 || status != 200)
+        goto fail;
+    for(left = clen; left > 0; left -= n)
+        if((n = rio_readnb(rio, scratch, left > MAXBUF ? MAXBUF : left)) <= 0)
+            goto fail;
+    if(!keep){
+        close(*fd);
+        *fd = -1;
+    }
+    return clen;
+
+fail:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+/*
+ * client_thread - closed loop: next req as soon as one ends; open
+ * loop: reqs due every nconns / rate secs, each timed from its due time
+ */
+static void *client_thread(void *vargp)
+{
+    Client *cl = (Client *)vargp;
+    char scratch[MAXBUF];
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (cl->id + 1), due, now, gap = 0;
+    int fd = -1;
+    long n;
+    rio_t rio;
+
+    if(rate > 0)
+        gap = (uint64_t)(1e6 * nconns / rate);
+    // spread open-loop threads over one gap
+    due = now_us() + gap * cl->id / nconns;
+    while(!stop){
+        if(gap){
+            if((now = now_us()) < due)
+                usleep(due - now);
+        }
+        else
+            due = now_us();
+        n = fetch(&fd, &rio, zipf_pick(&seed), scratch);
+        if(n < 0)
+            cl->errors++;
+        else{
+            cl->reqs++;
+            cl->bytes += n;
+            record(cl, now_us() - due);
+        }
+        due += gap;
+    }
+    if(fd >= 0)
+        close(fd);
+    return NULL;
+}
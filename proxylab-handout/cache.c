@@ -1,102 +1,905 @@
+#include <limits.h>
 #include "cache.h"
+#include "disk.h"
+#include "http.h"
+#include "gzip.h"
 
-CacheList *list;
-pthread_rwlock_t lock;
+static CacheShard shards[CACHE_SHARDS];
+static int policy = CACHE_CLOCK;
+static int admit = CACHE_ADMIT_TINYLFU;
+static int compress = 0;
 
-void cache_init()
+static void move_to_head(CacheShard *shard, CacheItem *item);
+static void unlink_item(CacheShard *shard, CacheItem *item);
+static CacheItem *cache_victim(CacheShard *shard);
+static size_t cache_evict(CacheShard *shard, CacheItem **evicted);
+static void drop_evicted(CacheItem *evicted);
+static void sketch_record(CacheShard *shard, unsigned long hash);
+static int sketch_estimate(CacheShard *shard, unsigned long hash);
+static void free_item(CacheItem *item);
+static void cache_insert(char *url, unsigned long hash, char *object, size_t objectlen,
+                         size_t hdrlen, int framed, size_t rawlen, char *vary,
+                         int replace);
+
+/* Offset of the CacheObject in an entry's arena block */
+#define OBJ_OFFSET ((sizeof(CacheItem) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* High hash bits pick the shard, low bits the bucket */
+#define SHARD_OF(hash) (&shards[((hash) >> 56) % CACHE_SHARDS])
+#define BUCKET_OF(hash) ((hash) % CACHE_BUCKETS)
+
+void cache_init(int pol, int adm, int comp)
 {
-    list = (CacheList *)Malloc(sizeof(CacheList));
-    list->head = list->tail = NULL;
-    list->remainlen = MAX_CACHE_SIZE;
-    pthread_rwlock_init(&lock, NULL);
+    size_t size = SHARD_SIZE & ~(size_t)(ARENA_ALIGN - 1);
+    char *base;
+
+    policy = pol;
+    admit = adm;
+    compress = comp;
+    // one region for all shards, reserved up front
+    base = Mmap(NULL, size * CACHE_SHARDS, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *shard = &shards[i];
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->head = shard->tail = NULL;
+        arena_init(&shard->arena, base + i * size, size);
+        shard->hits = shard->misses = shard->evictions = shard->rejects = 0;
+        shard->zsaved = 0;
+        memset(shard->sketch, 0, sizeof(shard->sketch));
+        shard->sketch_ops = 0;
+        pthread_rwlock_init(&shard->lock, NULL);
+    }
 }
 
 void cache_deinit()
 {
-    // printf("********deinit\n");
-    pthread_rwlock_wrlock(&lock);
     CacheItem *item2;
-    for(CacheItem *item = list->head; item; ){
-        free(item->tag);
-        free(item->object);
-        item2 = item;
-        item = item->next;
-        free(item2);
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *shard = &shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        for(CacheItem *item = shard->head; item; ){
+            item2 = item;
+            item = item->next;
+            free_item(item2);
+        }
+        shard->head = shard->tail = NULL;
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+}
+
+/*
+ * cache_hash - 64-bit FNV-1a of url; callers compute it once per request
+ */
+unsigned long cache_hash(char *url)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for(unsigned char *p = (unsigned char *)url; *p; p++){
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/* Odd multipliers giving each sketch row its own index */
+static const unsigned long sketch_seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15UL, 0xbf58476d1ce4e5b9UL,
+    0x94d049bb133111ebUL, 0xd6e8feb86659fd93UL,
+};
+
+static inline unsigned sketch_index(unsigned long hash, int row)
+{
+    // the top bits already picked the shard, so fold before mixing
+    return ((hash ^ (hash >> 32)) * sketch_seeds[row]) >> (64 - SKETCH_BITS);
+}
+
+/*
+ * sketch_record - count one lookup of hash, aging the shard's sketch
+ * Runs under the read lock at most; racing updates may drop a count,
+ * which only makes the estimate a little lower.
+ */
+static void sketch_record(CacheShard *shard, unsigned long hash)
+{
+    unsigned char *ctr, v;
+
+    for(int i = 0; i < SKETCH_DEPTH; i++){
+        ctr = &shard->sketch[i][sketch_index(hash, i)];
+        v = __atomic_load_n(ctr, __ATOMIC_RELAXED);
+        if(v < SKETCH_MAX)
+            __atomic_store_n(ctr, v + 1, __ATOMIC_RELAXED);
+    }
+    // exactly one thread sees the threshold and ages the sketch
+    if(__atomic_add_fetch(&shard->sketch_ops, 1, __ATOMIC_RELAXED) == SKETCH_SAMPLE){
+        for(int i = 0; i < SKETCH_DEPTH; i++){
+            for(int j = 0; j < SKETCH_WIDTH; j++){
+                ctr = &shard->sketch[i][j];
+                v = __atomic_load_n(ctr, __ATOMIC_RELAXED);
+                __atomic_store_n(ctr, v >> 1, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&shard->sketch_ops, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* estimated recent lookups of hash: the smallest of its counters */
+static int sketch_estimate(CacheShard *shard, unsigned long hash)
+{
+    int min = SKETCH_MAX, v;
+
+    for(int i = 0; i < SKETCH_DEPTH; i++){
+        v = __atomic_load_n(&shard->sketch[i][sketch_index(hash, i)], __ATOMIC_RELAXED);
+        if(v < min)
+            min = v;
     }
-    free(list);
-    pthread_rwlock_unlock(&lock);
-    pthread_rwlock_destroy(&lock);
+    return min;
 }
 
-void move_to_head(CacheItem *item)
+/* find item in its bucket; caller holds shard lock */
+static CacheItem *find_item(CacheShard *shard, char *url, unsigned long hash)
 {
-    // printf("move to head\n");
-    if(list->head == item)
+    CacheItem *item;
+    for(item = shard->buckets[BUCKET_OF(hash)]; item; item = item->hnext){
+        if(item->hash == hash && !strcmp(item->tag, url))
+            break;
+    }
+    return item;
+}
+
+static void move_to_head(CacheShard *shard, CacheItem *item)
+{
+    if(shard->head == item)
         return;
-    if(!list->head)
-        list->head = list->tail = item;
-    else{
-        if(list->tail == item) list->tail = item->prev;
+    // detach if already linked
+    if(item->prev){
+        if(shard->tail == item) shard->tail = item->prev;
         if(item->prev) item->prev->next = item->next;
         if(item->next) item->next->prev = item->prev;
+    }
+    item->prev = NULL;
+    item->next = shard->head;
+    if(shard->head) shard->head->prev = item;
+    shard->head = item;
+    if(!shard->tail) shard->tail = item;
+}
+
+/* drop item from LRU list and hash chain; caller frees it */
+static void unlink_item(CacheShard *shard, CacheItem *item)
+{
+    CacheItem **pp;
+
+    if(item->prev) item->prev->next = item->next;
+    else shard->head = item->next;
+    if(item->next) item->next->prev = item->prev;
+    else shard->tail = item->prev;
+
+    for(pp = &shard->buckets[BUCKET_OF(item->hash)]; *pp != item; pp = &(*pp)->hnext)
+        ;
+    *pp = item->hnext;
+    if(item->obj->rawlen)
+        shard->zsaved -= item->obj->rawlen - (item->obj->len - item->obj->hdrlen - 2);
+}
+
+/* drop the cache's ref; readers may still hold the object, and with
+   it the item's block */
+static void free_item(CacheItem *item)
+{
+    cache_release(item->obj);
+}
+
+/*
+ * cache_release - drop a ref taken by cache_lookup
+ */
+void cache_release(CacheObject *obj)
+{
+    if(__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        arena_free(obj->arena, (char *)obj - OBJ_OFFSET);
+}
+
+int cache_compressing()
+{
+    return compress;
+}
+
+/*
+ * cache_hithdrs - hdrs a hit adds after obj's own: how a gzipped body
+ * is sent, and the body length when the stored hdrs carry none.
+ * Writes at most CACHE_HITHDRS_MAX bytes to buf; returns the count.
+ */
+size_t cache_hithdrs(CacheObject *obj, int gzip, char *buf)
+{
+    size_t n = 0;
+
+    if(obj->rawlen){
+        n += sprintf(buf, "Vary: Accept-Encoding\r\n");
+        if(gzip)
+            n += sprintf(buf + n, "Content-Encoding: gzip\r\n");
+    }
+    if(!obj->framed)
+        n += sprintf(buf + n, "Content-Length: %zu\r\n",
+                     obj->rawlen && !gzip ? obj->rawlen : obj->len - obj->hdrlen - 2);
+    return n;
+}
+
+/* a gzipped body inflated into out, which holds obj->rawlen bytes */
+static int inflate_body(CacheObject *obj, char *out)
+{
+    return gzip_decompress(obj->data + obj->hdrlen + 2, obj->len - obj->hdrlen - 2,
+                           out, obj->rawlen) == obj->rawlen ? 0 : -1;
+}
+
+/*
+ * cache_inflate - a gzipped obj's body for a client that does not take
+ * gzip, after the blank line, in a buffer the caller frees. Sets *len;
+ * returns NULL if the stored body is damaged.
+ */
+char *cache_inflate(CacheObject *obj, size_t *len)
+{
+    char *buf = (char *)Malloc(obj->rawlen + 2);
+
+    memcpy(buf, "\r\n", 2);
+    if(inflate_body(obj, buf + 2) < 0){
+        free(buf);
+        return NULL;
+    }
+    *len = obj->rawlen + 2;
+    return buf;
+}
+
+/*
+ * cache_copy - obj laid out as cache_add takes it, body inflated, in
+ * buf of MAX_OBJECT_SIZE bytes. Returns its length, or 0 if damaged.
+ */
+size_t cache_copy(CacheObject *obj, char *buf)
+{
+    if(!obj->rawlen){
+        memcpy(buf, obj->data, obj->len);
+        return obj->len;
+    }
+    if(obj->hdrlen + 2 + obj->rawlen > MAX_OBJECT_SIZE)
+        return 0;
+    memcpy(buf, obj->data, obj->hdrlen + 2);
+    if(inflate_body(obj, buf + obj->hdrlen + 2) < 0)
+        return 0;
+    return obj->hdrlen + 2 + obj->rawlen;
+}
+
+/*
+ * cache_expiry - when a resp with these hdrs goes stale, or -1 if it
+ * must not be cached at all
+ */
+time_t cache_expiry(char *data, size_t hdrlen)
+{
+    Freshness fr;
+
+    parse_freshness(data, hdrlen, &fr);
+    return fr.cacheable ? fr.date + fr.lifetime : -1;
+}
+
+int cache_fresh(CacheObject *obj)
+{
+    return time(NULL) < __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_servable - true if stale obj may be served for this reason,
+ * STALE_REVALIDATE or STALE_ERROR
+ */
+int cache_servable(CacheObject *obj, int why)
+{
+    return time(NULL) < __atomic_load_n(&obj->expires, __ATOMIC_RELAXED) +
+                        __atomic_load_n(why == STALE_ERROR ? &obj->sie : &obj->swr,
+                                        __ATOMIC_RELAXED);
+}
+
+/* a stale window from its directive, or the default */
+static int stale_secs(Freshness *fr, long secs, int def)
+{
+    if(fr->mustrevalidate)
+        return 0;
+    if(secs < 0)
+        return def;
+    return secs < STALE_MAX_SECS ? secs : STALE_MAX_SECS;
+}
+
+/* true if hdr block hdrs[0..len) has a name: hdr, ignoring case */
+static int has_hdr(char *hdrs, size_t len, char *name, size_t n)
+{
+    char *p, *eol, *end = hdrs + len;
+
+    for(p = hdrs; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1)
+        if(eol - p > n && p[n] == ':' && !strncasecmp(p, name, n))
+            return 1;
+    return 0;
+}
+
+/*
+ * merge_hdrs - obj's stored hdrs updated by those of a 304, into out,
+ * which holds obj->hdrlen + hdrlen bytes; returns the length
+ * A 304 hdr replaces every stored one of its name, as a cache updates
+ * stored hdrs. Date and Age always come from the 304, so a lifetime
+ * it leaves alone counts from now. Its hop-by-hop hdrs and
+ * Content-Length do not describe the stored body and are left out.
+ */
+static size_t merge_hdrs(CacheObject *obj, char *hdrs, size_t hdrlen, char *out)
+{
+    char *p, *eol, *end = obj->data + obj->hdrlen;
+    size_t n, name;
+
+    // stored status line, then the stored hdrs the 304 does not replace
+    eol = memchr(obj->data, '\n', obj->hdrlen);
+    n = eol + 1 - obj->data;
+    memcpy(out, obj->data, n);
+    for(p = eol + 1; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        name = strcspn(p, ":\n");
+        if(hdr_is(p, "Date") || hdr_is(p, "Age") || has_hdr(hdrs, hdrlen, p, name))
+            continue;
+        memcpy(out + n, p, eol + 1 - p);
+        n += eol + 1 - p;
+    }
+    // the 304's own hdrs, up to its blank line
+    end = hdrs + hdrlen;
+    if(!(p = memchr(hdrs, '\n', hdrlen)))
+        return n;
+    for(p++; p < end && *p != '\r' && *p != '\n' && (eol = memchr(p, '\n', end - p));
+        p = eol + 1){
+        if(is_hop_hdr(p) || hdr_is(p, "Content-Length"))
+            continue;
+        memcpy(out + n, p, eol + 1 - p);
+        n += eol + 1 - p;
+    }
+    return n;
+}
+
+/* same validator value, or both absent */
+static int same_validator(char *a, size_t alen, char *b, size_t blen)
+{
+    return alen == blen && (!alen || !memcmp(a, b, alen));
+}
+
+/*
+ * cache_refresh - a revalidation of obj got 304 with these hdrs
+ * The 304's hdrs update the stored ones. With the same validators, obj
+ * takes the new freshness and stale windows in place and keeps its
+ * body and stored hdrs. New validators, or a 304 that forbids caching,
+ * drop obj; it comes back under the updated hdrs if it may, so later
+ * revalidations send what the server now knows it by.
+ */
+void cache_refresh(CacheObject *obj, char *hdrs, size_t hdrlen)
+{
+    CacheItem *item = (CacheItem *)((char *)obj - OBJ_OFFSET);
+    CacheShard *shard = SHARD_OF(item->hash);
+    Freshness fr, old;
+    char *merged;
+    size_t n, bodylen = obj->len - obj->hdrlen;
+    int current;
+
+    merged = (char *)Malloc(obj->hdrlen + hdrlen + bodylen);
+    n = merge_hdrs(obj, hdrs, hdrlen, merged);
+    parse_freshness(merged, n, &fr);
+    parse_freshness(obj->data, obj->hdrlen, &old);
+    if(fr.cacheable && same_validator(fr.etag, fr.etaglen, old.etag, old.etaglen) &&
+       same_validator(fr.lastmod, fr.lastmodlen, old.lastmod, old.lastmodlen)){
+        __atomic_store_n(&obj->swr, stale_secs(&fr, fr.swr, STALE_REVALIDATE_SECS),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&obj->sie, stale_secs(&fr, fr.sie, STALE_ERROR_SECS),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&obj->expires, fr.date + fr.lifetime, __ATOMIC_RELAXED);
+        free(merged);
+        return;
+    }
+
+    // only the entry still holding obj goes; a newer fetch stays
+    pthread_rwlock_wrlock(&shard->lock);
+    current = find_item(shard, item->tag, item->hash) == item;
+    if(current)
+        unlink_item(shard, item);
+    pthread_rwlock_unlock(&shard->lock);
+    if(current){
+        // the body, blank line first, after the updated hdrs
+        memcpy(merged + n, obj->data + obj->hdrlen, bodylen);
+        cache_insert(item->tag, item->hash, merged, n + bodylen, n, obj->framed,
+                     obj->rawlen, NULL, 1);
+        free_item(item);
+    }
+    free(merged);
+}
+
+/*
+ * compress_object - a Malloc'd copy of a compressible resp with its
+ * body gzipped and its Content-Length hdr dropped, or NULL if gzip
+ * does not save enough. Updates the lengths to match the copy.
+ */
+static char *compress_object(char *object, size_t *objectlen, size_t *hdrlen,
+                             size_t *rawlen)
+{
+    char *out, *p, *eol, *end = object + *hdrlen;
+    size_t n = 0, bodylen = *objectlen - *hdrlen - 2, zlen;
 
-        item->prev = NULL;
-        item->next = list->head;
-        list->head = item;
+    if(bodylen < GZIP_MIN_SIZE || !compressible(object, *hdrlen))
+        return NULL;
+    out = (char *)Malloc(*objectlen);
+    for(p = object; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        if(!hdr_is(p, "Content-Length")){
+            memcpy(out + n, p, eol + 1 - p);
+            n += eol + 1 - p;
+        }
     }
+    memcpy(out + n, "\r\n", 2);
+    if(!(zlen = gzip_compress(object + *hdrlen + 2, bodylen, out + n + 2,
+                              bodylen - bodylen / GZIP_MIN_GAIN))){
+        free(out);
+        return NULL;
+    }
+    *hdrlen = n;
+    *rawlen = bodylen;
+    *objectlen = n + 2 + zlen;
+    return out;
 }
 
-void cache_add(char* url, char* object, int objectlen)
+/*
+ * cache_add - insert a resp stored without hop-by-hop hdrs
+ * object[0..hdrlen) is the hdr block minus its blank line, so hits can
+ * append their own Connection (and Content-Length if !framed) hdrs.
+ * Resps the hdrs forbid caching are dropped here. With compression on,
+ * text bodies are gzipped first, before any lock is taken.
+ */
+void cache_add(char *url, unsigned long hash, char *object, size_t objectlen,
+               size_t hdrlen, int framed)
 {
-    // printf("add\n");
-    pthread_rwlock_wrlock(&lock);
-    while(list->remainlen < objectlen)
-        cache_evict();
+    char *packed = NULL;
+    size_t rawlen = 0;
+
+    if(objectlen > MAX_OBJECT_SIZE || cache_expiry(object, hdrlen) < 0)
+        return;
+    if(compress && (packed = compress_object(object, &objectlen, &hdrlen, &rawlen))){
+        object = packed;
+        framed = 0;
+    }
+    cache_insert(url, hash, object, objectlen, hdrlen, framed, rawlen, NULL, 0);
+    free(packed);
+}
+
+/*
+ * cache_vary - make sure the url of variant key has a marker listing
+ * the key's Vary names
+ * Called for every variant stored, in RAM or on disk; an equal marker
+ * is left alone.
+ */
+void cache_vary(char *key)
+{
+    char url[MAXLINE], names[MAXLINE];
+    char *p, *colon, *nl = strchr(key, '\n');
+    size_t n = 0, urllen;
+    unsigned long hash;
+    CacheShard *shard;
+    CacheItem *item;
+    int same;
 
-    CacheItem *item = (CacheItem *)Malloc(sizeof(CacheItem));
-    size_t len = strlen(url);
-    item->tag = (char *)Malloc(len+1);
-    strcpy(item->tag, url);
-    item->object = (char *)Malloc(objectlen+1);
-    strcpy(item->object, object);
-    item->prev = item->next = NULL;
-    item->objectlen = objectlen;
+    if(!nl || (urllen = nl - key) >= MAXLINE)
+        return;
+    memcpy(url, key, urllen);
+    url[urllen] = '\0';
+    // the names are what precedes the colons
+    for(p = nl + 1; *p && (colon = strchr(p, ':')); p = colon + strcspn(colon, "\n") + 1){
+        if(n + (colon - p) + 2 > sizeof(names))
+            return;
+        if(n)
+            names[n++] = ',';
+        memcpy(names + n, p, colon - p);
+        n += colon - p;
+        if(!colon[strcspn(colon, "\n")])
+            break;
+    }
+    names[n] = '\0';
 
-    list->remainlen -= objectlen;
-    move_to_head(item);
-    pthread_rwlock_unlock(&lock);
+    hash = cache_hash(url);
+    shard = SHARD_OF(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    item = find_item(shard, url, hash);
+    same = item && item->obj->vary && !strcmp(item->obj->vary, names);
+    pthread_rwlock_unlock(&shard->lock);
+    if(!same)
+        cache_insert(url, hash, NULL, 0, 0, 0, 0, names, 0);
 }
 
-void cache_evict()
+/*
+ * cache_insert - store object as given; rawlen is its inflated body
+ * length if the body is gzipped
+ * With vary set it stores a marker of those names instead, which has
+ * no resp and is never fresh. A variant stored here gets its marker.
+ * replace is set for an entry cache_refresh took out to rebuild, which
+ * skips admission like one still in the cache.
+ */
+static void cache_insert(char *url, unsigned long hash, char *object, size_t objectlen,
+                         size_t hdrlen, int framed, size_t rawlen, char *vary,
+                         int replace)
 {
-    // printf("evict\n");
-    CacheItem *temp = list->tail;
-    list->tail = temp->prev;
-    list->remainlen += temp->objectlen;
+    CacheShard *shard = SHARD_OF(hash);
+    CacheItem *item, *victim, *new, *evicted = NULL;
+    CacheObject *obj;
+    int freq, rejected = 0;
+    char cond[2 * MAXLINE], *block;
+    size_t condlen = 0, n, need, freed = 0;
+    Freshness fr;
+
+    if(objectlen > MAX_OBJECT_SIZE)
+        return;
+    if(vary){
+        // the marker's names take the validators' place
+        memset(&fr, 0, sizeof(fr));
+        if((condlen = strlen(vary)) >= sizeof(cond))
+            return;
+        memcpy(cond, vary, condlen);
+    }
+    else{
+        parse_freshness(object, hdrlen, &fr);
+        if(!fr.cacheable)
+            return;
+        // validators to send once it goes stale
+        if(fr.etag && fr.etaglen < MAXLINE / 2)
+            condlen += sprintf(cond + condlen, "If-None-Match: %.*s\r\n",
+                               (int)fr.etaglen, fr.etag);
+        if(fr.lastmod && fr.lastmodlen < MAXLINE / 2)
+            condlen += sprintf(cond + condlen, "If-Modified-Since: %.*s\r\n",
+                               (int)fr.lastmodlen, fr.lastmod);
+    }
+    // item, object, body, validators and tag share one block
+    n = OBJ_OFFSET + sizeof(CacheObject) + objectlen + condlen + 1 + strlen(url) + 1;
+    if((need = arena_blocksize(n)) > shard->arena.size)
+        return;
+
+    // make room, counting victims as freed though readers may pin some
+    pthread_rwlock_wrlock(&shard->lock);
+    freq = admit == CACHE_ADMIT_TINYLFU ? sketch_estimate(shard, hash) : 0;
+    // a refreshed url replaces itself below and needs no admission;
+    // nor does a marker, which only follows an admitted variant
+    if(vary || replace || find_item(shard, url, hash))
+        freq = INT_MAX;
+    while(arena_free_bytes(&shard->arena) + freed < need && shard->tail){
+        victim = cache_victim(shard);
+        if(admit == CACHE_ADMIT_TINYLFU && sketch_estimate(shard, victim->hash) >= freq){
+            shard->rejects++;
+            rejected = 1;
+            break;
+        }
+        freed += cache_evict(shard, &evicted);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    drop_evicted(evicted);
+    if(rejected)
+        return;
 
-    free(temp->tag);
-    free(temp->object);
-    free(temp);
+    // free space may be in pieces or still pinned; evict until a
+    // block fits or nothing is left to evict
+    while(!(block = arena_alloc(&shard->arena, n))){
+        evicted = NULL;
+        pthread_rwlock_wrlock(&shard->lock);
+        if(shard->tail)
+            cache_evict(shard, &evicted);
+        pthread_rwlock_unlock(&shard->lock);
+        if(!evicted)
+            return;
+        drop_evicted(evicted);
+    }
+
+    new = (CacheItem *)block;
+    obj = (CacheObject *)(block + OBJ_OFFSET);
+    obj->refcnt = 1;
+    obj->arena = &shard->arena;
+    obj->len = objectlen;
+    obj->hdrlen = hdrlen;
+    obj->framed = framed;
+    obj->rawlen = rawlen;
+    obj->expires = fr.date + fr.lifetime;
+    obj->swr = stale_secs(&fr, fr.swr, STALE_REVALIDATE_SECS);
+    obj->sie = stale_secs(&fr, fr.sie, STALE_ERROR_SECS);
+    if(objectlen)
+        memcpy(obj->data, object, objectlen);
+    obj->cond = obj->vary = NULL;
+    if(condlen){
+        obj->cond = obj->data + objectlen;
+        memcpy(obj->cond, cond, condlen);
+    }
+    if(vary){
+        obj->vary = obj->cond;
+        obj->cond = NULL;
+    }
+    obj->data[objectlen + condlen] = '\0';
+    new->tag = obj->data + objectlen + condlen + 1;
+    strcpy(new->tag, url);
+    new->obj = obj;
+    new->prev = new->next = new->hnext = NULL;
+    new->hash = hash;
+    new->size = need;
+    new->ref = 0;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    // another thread may have fetched the same url meanwhile
+    if((item = find_item(shard, url, hash))){
+        unlink_item(shard, item);
+        free_item(item);
+    }
+    new->hnext = shard->buckets[BUCKET_OF(hash)];
+    shard->buckets[BUCKET_OF(hash)] = new;
+    move_to_head(shard, new);
+    if(rawlen)
+        shard->zsaved += rawlen - (objectlen - hdrlen - 2);
+    pthread_rwlock_unlock(&shard->lock);
+    if(!vary && strchr(url, '\n'))
+        cache_vary(url);
 }
 
-size_t cache_lookup(char* url, char* buf)
+/* victims move down to the disk tier, outside the lock; it sends
+   bodies as stored, so gzipped ones go down inflated */
+static void drop_evicted(CacheItem *evicted)
 {
-    // printf("lookup\n");
     CacheItem *item;
-    size_t len;
-    pthread_rwlock_rdlock(&lock);
-    for(item = list->head; item; item = item->next){
-        if(!strcmp(item->tag, url)) break;
+    CacheObject *obj;
+    char *buf;
+    size_t n;
+
+    while((item = evicted)){
+        evicted = item->next;
+        obj = item->obj;
+        // markers are remade by the next fetch
+        if(obj->vary)
+            ;
+        else if(!obj->rawlen)
+            disk_store(item->tag, item->hash, obj->data, obj->len, obj->hdrlen, obj->framed);
+        else if(disk_enabled()){
+            buf = (char *)Malloc(MAX_OBJECT_SIZE);
+            if((n = cache_copy(obj, buf)))
+                disk_store(item->tag, item->hash, buf, n, obj->hdrlen, 0);
+            free(buf);
+        }
+        free_item(item);
     }
-    if(!item){
-        pthread_rwlock_unlock(&lock);
-        return 0;
+}
+
+/* the LRU item, or under CLOCK the first unreferenced one */
+static CacheItem *cache_victim(CacheShard *shard)
+{
+    CacheItem *temp;
+
+    // each pass clears the bits it skips, so this ends within a lap
+    while(policy == CACHE_CLOCK && shard->tail->ref){
+        temp = shard->tail;
+        temp->ref = 0;
+        move_to_head(shard, temp);
+    }
+    return shard->tail;
+}
+
+/*
+ * cache_evict - unlink the victim onto *evicted; the caller frees it
+ * after unlocking. Returns the bytes that frees unless a reader holds it.
+ */
+static size_t cache_evict(CacheShard *shard, CacheItem **evicted)
+{
+    CacheItem *temp = cache_victim(shard);
+    unlink_item(shard, temp);
+    temp->next = *evicted;
+    *evicted = temp;
+    shard->evictions++;
+    return temp->size;
+}
+
+/*
+ * cache_lookup - return the pinned object for url, or NULL on a miss
+ * The caller writes obj->data straight out and then calls cache_release.
+ */
+CacheObject *cache_lookup(char *url, unsigned long hash)
+{
+    CacheShard *shard = SHARD_OF(hash);
+    CacheItem *item;
+    CacheObject *obj = NULL;
+
+    if(admit == CACHE_ADMIT_TINYLFU)
+        sketch_record(shard, hash);
+
+    // strict LRU reorders the list, so hits are serialized
+    if(policy == CACHE_LRU)
+        pthread_rwlock_wrlock(&shard->lock);
+    else
+        pthread_rwlock_rdlock(&shard->lock);
+    if((item = find_item(shard, url, hash))){
+        obj = item->obj;
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+        if(policy == CACHE_LRU)
+            move_to_head(shard, item);
+        else if(!__atomic_load_n(&item->ref, __ATOMIC_RELAXED))
+            __atomic_store_n(&item->ref, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    // a marker's lookup is counted by the variant's
+    if(!obj || !obj->vary)
+        __atomic_add_fetch(obj ? &shard->hits : &shard->misses, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+/*
+ * cache_totals - hit, miss and eviction counts summed over all shards
+ */
+void cache_totals(CacheTotals *t)
+{
+    memset(t, 0, sizeof(CacheTotals));
+    for(int i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *shard = &shards[i];
+        t->hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+        t->misses += __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+        pthread_rwlock_rdlock(&shard->lock);
+        t->evictions += shard->evictions;
+        t->rejects += shard->rejects;
+        t->zsaved += shard->zsaved;
+        pthread_rwlock_unlock(&shard->lock);
+        t->used += shard->arena.size - arena_free_bytes(&shard->arena);
+        t->size += shard->arena.size;
+    }
+}
+
+/*
+ * cache_report - print hit ratio and eviction counts over all shards
+ */
+void cache_report(FILE *fp)
+{
+    CacheTotals t;
+
+    cache_totals(&t);
+    fprintf(fp, "cache: %s/%s hits %lu misses %lu ratio %.2f%% "
+            "evictions %lu rejects %lu used %zu/%zu gzip_saved %zu\n",
+            policy == CACHE_LRU ? "lru" : "clock",
+            admit == CACHE_ADMIT_TINYLFU ? "tinylfu" : "all",
+            t.hits, t.misses, t.hits + t.misses ? 100.0 * t.hits / (t.hits + t.misses) : 0.0,
+            t.evictions, t.rejects, t.used, t.size, t.zsaved);
+    disk_report(fp);
+}
+
+/* fwrite n bytes and zero padding up to the next SNAP_ALIGN boundary */
+static int snap_write(FILE *fp, void *buf, size_t n)
+{
+    static const char zeros[8];
+
+    if(fwrite(buf, 1, n, fp) != n)
+        return -1;
+    n = SNAP_ALIGN(n) - n;
+    return fwrite(zeros, 1, n, fp) == n ? 0 : -1;
+}
+
+/*
+ * cache_save - write every cached object to path
+ * Objects are pinned under the shard read lock and written after it
+ * is dropped, so hits and inserts go on meanwhile. The file is built
+ * under a temp name and renamed, so a crash never leaves half a
+ * snapshot at path.
+ */
+int cache_save(char *path)
+{
+    char tmp[MAXLINE];
+    CacheItem *item;
+    CacheObject **objs;
+    char **tags;
+    SnapHdr hdr;
+    SnapEntry ent;
+    FILE *fp;
+    int n, rc = 0;
+
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    if(!(fp = fopen(tmp, "w"))){
+        unix_error("snapshot open error");
+        return -1;
+    }
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.count = 0;
+    if(snap_write(fp, &hdr, sizeof(hdr)) < 0)
+        rc = -1;
+
+    for(int i = 0; i < CACHE_SHARDS && rc == 0; i++){
+        CacheShard *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        n = 0;
+        for(item = shard->head; item; item = item->next)
+            n++;
+        objs = (CacheObject **)Malloc((n + 1) * sizeof(CacheObject *));
+        tags = (char **)Malloc((n + 1) * sizeof(char *));
+        n = 0;
+        // markers are rebuilt from their variants' keys on load
+        for(item = shard->tail; item; item = item->prev){
+            if(item->obj->vary)
+                continue;
+            objs[n] = item->obj;
+            __atomic_add_fetch(&objs[n]->refcnt, 1, __ATOMIC_RELAXED);
+            tags[n++] = strdup(item->tag);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+
+        for(int j = 0; j < n; j++){
+            ent.len = objs[j]->len;
+            ent.hdrlen = objs[j]->hdrlen;
+            ent.urllen = strlen(tags[j]);
+            ent.framed = objs[j]->framed;
+            ent.rawlen = objs[j]->rawlen;
+            if(rc == 0 && (snap_write(fp, &ent, sizeof(ent)) < 0 ||
+                           snap_write(fp, tags[j], ent.urllen + 1) < 0 ||
+                           snap_write(fp, objs[j]->data, ent.len) < 0))
+                rc = -1;
+            cache_release(objs[j]);
+            free(tags[j]);
+        }
+        free(objs);
+        free(tags);
+        hdr.count += n;
     }
-    len = item->objectlen;
-    memcpy(buf, item->object, len);
-    pthread_rwlock_unlock(&lock);
-    pthread_rwlock_wrlock(&lock);
-    move_to_head(item);
-    pthread_rwlock_unlock(&lock);
-    return len;
-}
\ No newline at end of file
+
+    // count goes in last, once it is known
+    if(rc == 0 && (fseek(fp, 0, SEEK_SET) < 0 ||
+                   snap_write(fp, &hdr, sizeof(hdr)) < 0 ||
+                   fflush(fp) != 0 || fsync(fileno(fp)) < 0))
+        rc = -1;
+    if(fclose(fp) != 0)
+        rc = -1;
+    if(rc == 0 && rename(tmp, path) < 0)
+        rc = -1;
+    if(rc < 0){
+        unix_error("snapshot write error");
+        unlink(tmp);
+    }
+    return rc;
+}
+
+/*
+ * cache_load - insert the objects of a snapshot written by cache_save
+ * The file is mapped and copied straight into the shards. A missing
+ * file is not an error; a damaged one is ignored from the first bad
+ * entry on. Returns the number of objects loaded, or -1.
+ */
+int cache_load(char *path)
+{
+    struct stat st;
+    SnapHdr *hdr;
+    SnapEntry *ent;
+    char *base, *p, *end, *url;
+    uint64_t i;
+    int fd, n = 0;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(SnapHdr)){
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return -1;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (SnapHdr *)base;
+    end = base + st.st_size;
+    if(memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))){
+        munmap(base, st.st_size);
+        return -1;
+    }
+    p = base + SNAP_ALIGN(sizeof(SnapHdr));
+    // every field is checked against the bytes left, padding included
+    for(i = 0; i < hdr->count; i++, n++){
+        if(end - p < SNAP_ALIGN(sizeof(SnapEntry)))
+            break;
+        ent = (SnapEntry *)p;
+        p += SNAP_ALIGN(sizeof(SnapEntry));
+        url = p;
+        if(ent->urllen >= MAXLINE || end - p < SNAP_ALIGN(ent->urllen + 1) ||
+           url[ent->urllen])
+            break;
+        p += SNAP_ALIGN(ent->urllen + 1);
+        if(ent->len > MAX_OBJECT_SIZE || ent->len < 2 || ent->hdrlen > ent->len - 2 ||
+           ent->rawlen > MAX_OBJECT_SIZE || end - p < SNAP_ALIGN(ent->len))
+            break;
+        cache_insert(url, cache_hash(url), p, ent->len, ent->hdrlen, ent->framed,
+                     ent->rawlen, NULL, 0);
+        p += SNAP_ALIGN(ent->len);
+    }
+    munmap(base, st.st_size);
+    return n;
+}
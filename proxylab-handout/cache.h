@@ -2,30 +2,174 @@
 #define __CACHE_H__
 
 #include "csapp.h"
+#include "arena.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/*
+ * Independently locked shards, each with its own list and an arena of
+ * SHARD_SIZE bytes that every entry is carved from, so the cache never
+ * holds more than MAX_CACHE_SIZE bytes, metadata and evicted objects
+ * still being sent included.
+ */
+#define CACHE_SHARDS 8
+#define CACHE_BUCKETS 256   /* hash buckets per shard */
+#define SHARD_SIZE (MAX_CACHE_SIZE / CACHE_SHARDS)
+
+#if SHARD_SIZE < MAX_OBJECT_SIZE + 4096
+#error "cache shard cannot hold a max size object and its metadata"
+#endif
+
+/*
+ * Immutable cached object. The cache holds one reference while the
+ * object is indexed and every reader pins its own; the last one to
+ * drop its reference frees it, so eviction never pulls bytes out
+ * from under a connection that is still writing them. It shares one
+ * arena block with its CacheItem, which comes first, and its tag.
+ */
+typedef struct CacheObject {
+    int refcnt;
+    Arena *arena;   // takes the block back on the last release
+    size_t len;
+    size_t hdrlen;  // status line and hdrs, without the blank line
+    int framed;     // hdrs carry Content-Length
+    size_t rawlen;  // body bytes once inflated if stored gzipped, else 0
+    time_t expires; // fresh until; moved on by a 304, accessed atomically
+    int swr;        // secs past expires it may be served while refreshed,
+    int sie;        // or stand in for a failed fetch; set like expires
+    char *cond;     // validator hdrs for a revalidation, or NULL
+    char *vary;     // Vary names if this is a marker (see key.h), or NULL
+    char data[];    // resp, the cond string, then the tag
+} CacheObject;
+
+/*
+ * Replacement policies. LRU moves an item to the head on every hit,
+ * which needs the shard write lock. CLOCK only sets the item's ref
+ * bit, so hits run under the read lock; eviction sweeps from the
+ * tail and gives referenced items a second chance at the head.
+ */
+#define CACHE_LRU   0
+#define CACHE_CLOCK 1
+
+/*
+ * Admission policies. With TinyLFU a miss is only cached if a
+ * count-min sketch of recent lookups says its url is requested more
+ * often than the item it would evict, so a scan of one-off urls
+ * cannot flush the hot set. Counters are halved every SKETCH_SAMPLE
+ * recorded lookups so old popularity fades.
+ */
+#define CACHE_ADMIT_ALL     0
+#define CACHE_ADMIT_TINYLFU 1
+
+/*
+ * With compression on, text bodies are stored gzipped, minus their
+ * Content-Length hdr, when that saves at least 1 / GZIP_MIN_GAIN of
+ * the body. Clients that accept gzip get them as stored and others
+ * get them inflated; either way the hit adds Content-Length and Vary.
+ */
+#define GZIP_MIN_SIZE 256       /* smaller bodies are stored as they are */
+#define GZIP_MIN_GAIN 8
+#define CACHE_HITHDRS_MAX 96    /* bytes cache_hithdrs may write */
+
+#define SKETCH_DEPTH 4
+#define SKETCH_BITS 10
+#define SKETCH_WIDTH (1 << SKETCH_BITS)   /* counters per row per shard */
+#define SKETCH_MAX 15                     /* counters saturate here */
+#define SKETCH_SAMPLE (8 * SKETCH_WIDTH)
+
 typedef struct CacheItem {
     char *tag;
-    char *object;
-    struct CacheItem *prev;
+    CacheObject *obj;
+    struct CacheItem *prev;   // recency list, head is newest
     struct CacheItem *next;
-    size_t objectlen;
+    struct CacheItem *hnext;  // hash chain
+    unsigned long hash;
+    size_t size;              // arena block bytes
+    int ref;                  // CLOCK ref bit, set atomically by hits
 } CacheItem;
 
-typedef struct CacheList {
+typedef struct CacheShard {
+    CacheItem *buckets[CACHE_BUCKETS];
     CacheItem *head;
     CacheItem *tail;
-    size_t remainlen;
-} CacheList;
+    Arena arena;              // entries, and evicted ones still pinned
+    pthread_rwlock_t lock;
+    unsigned long hits;       // updated atomically
+    unsigned long misses;
+    unsigned long evictions;  // under the write lock
+    unsigned long rejects;    // misses refused by admission
+    size_t zsaved;            // bytes gzip saves on indexed objects
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];   // accessed atomically
+    unsigned long sketch_ops; // lookups recorded since last aging
+} CacheShard;
+
+/* Counts summed over all shards */
+typedef struct CacheTotals {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long rejects;
+    size_t used;
+    size_t size;
+    size_t zsaved;
+} CacheTotals;
+
+/*
+ * How long past expiry a stale object may still be served: while a
+ * background refresh runs, or in place of a failed fetch. The
+ * stale-while-revalidate and stale-if-error directives override these,
+ * up to STALE_MAX_SECS; must-revalidate and no-cache turn both off.
+ */
+#define STALE_REVALIDATE_SECS 60
+#define STALE_ERROR_SECS 3600
+#define STALE_MAX_SECS 86400
+
+#define STALE_REVALIDATE 0
+#define STALE_ERROR      1
+
+/*
+ * Snapshot file for warm restarts: a SnapHdr, then per object a
+ * SnapEntry, its url with a NUL, and its data, each padded to 8
+ * bytes. Objects are written oldest first per shard, so loading them
+ * in order rebuilds the recency lists. Gzipped bodies stay gzipped.
+ */
+#define SNAP_MAGIC "PXCACHE2"
+#define SNAP_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct SnapHdr {
+    char magic[8];
+    uint64_t count;
+} SnapHdr;
+
+typedef struct SnapEntry {
+    uint64_t len;
+    uint64_t hdrlen;
+    uint32_t urllen;    // without the NUL
+    uint32_t framed;
+    uint64_t rawlen;
+} SnapEntry;
 
-void cache_init();
+void cache_init(int policy, int admit, int compress);
 void cache_deinit();
-void move_to_head(CacheItem *item);
-void cache_add(char* url, char* object, int objectlen);
-void cache_evict();
-size_t cache_lookup(char* url, char* buf);
+unsigned long cache_hash(char *url);
+void cache_add(char *url, unsigned long hash, char *object, size_t objectlen,
+               size_t hdrlen, int framed);
+CacheObject *cache_lookup(char *url, unsigned long hash);
+void cache_release(CacheObject *obj);
+void cache_vary(char *key);
+size_t cache_hithdrs(CacheObject *obj, int gzip, char *buf);
+char *cache_inflate(CacheObject *obj, size_t *len);
+size_t cache_copy(CacheObject *obj, char *buf);
+int cache_compressing();
+time_t cache_expiry(char *data, size_t hdrlen);
+int cache_fresh(CacheObject *obj);
+int cache_servable(CacheObject *obj, int why);
+void cache_refresh(CacheObject *obj, char *hdrs, size_t hdrlen);
+void cache_totals(CacheTotals *t);
+void cache_report(FILE *fp);
+int cache_save(char *path);
+int cache_load(char *path);
 
-#endif
\ No newline at end of file
+#endif
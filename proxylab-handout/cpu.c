@@ -0,0 +1,53 @@
+/*
+ * cpu.c - pin threads to the cores the process may run on
+ *
+ * Slots are numbered over the CPUs in the process's starting affinity
+ * mask, not over all CPUs, so "taskset -c 4-7 ./proxy -l 4" puts the
+ * four groups on cores 4 to 7.
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include "cpu.h"
+
+static cpu_set_t allowed;
+static int nallowed;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* threads only pin themselves, so any caller still has the full mask */
+static void init_allowed(void)
+{
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    nallowed = CPU_COUNT(&allowed);
+}
+
+/*
+ * cpu_count - CPUs the process may run on, at least 1
+ */
+int cpu_count(void)
+{
+    pthread_once(&once, init_allowed);
+    return nallowed > 0 ? nallowed : 1;
+}
+
+/*
+ * cpu_pin - pin the calling thread to the slot'th allowed CPU, modulo
+ * their count. Threads it creates afterwards inherit the pin.
+ */
+int cpu_pin(int slot)
+{
+    cpu_set_t set;
+    int cpu, n;
+
+    pthread_once(&once, init_allowed);
+    if(nallowed == 0)
+        return -1;
+    slot %= nallowed;
+    for(cpu = 0, n = -1; cpu < CPU_SETSIZE; cpu++)
+        if(CPU_ISSET(cpu, &allowed) && ++n == slot)
+            break;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
@@ -0,0 +1,12 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+/*
+ * Thread to core pinning for listener groups. sched_setaffinity() and
+ * the cpu_set_t macros need _GNU_SOURCE, which csapp.h does not take,
+ * so this lives in its own file like zcopy.c.
+ */
+int cpu_count(void);
+int cpu_pin(int slot);
+
+#endif
@@ -1,6 +1,11 @@
 /* 
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated for the proxy:
+ *   - rio_readlineb: scans for the newline with memchr and copies whole
+ *     runs instead of one byte per call
+ *   - Added rio_getlineb, which returns lines in place in the buffer
+ *
  * Updated 2/2016 droh:
  *   - Updated open_clientfd and open_listenfd to fail more gracefully
  *
@@ -781,20 +786,49 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write all of an iovec array (unbuffered)
+ *     Advances iov past what was written, so callers pass a scratch
+ *     copy if they need the array again.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt > RIO_IOVMAX ? RIO_IOVMAX : iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;        /* and call writev() again */
+	    return -1;           /* errno set by writev() */
+	}
+	total += nwritten;
+	/* Skip fully written entries, trim a partial one */
+	while (iovcnt > 0 && nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
  *    buffer, where n is the number of bytes requested by the user and
  *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
+ *    entry, rio_fill() refills the internal buffer via a call to
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -807,6 +841,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -855,33 +898,87 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *     Finds the newline in the internal buffer with memchr and copies
+ *     the line in whole runs rather than a byte per rio_read call.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    if (maxlen == 0)
+	return 0;
+    while (!nl && n < maxlen - 1) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;           /* Error */
+	else if (rc == 0)
+	    break;               /* EOF */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)))
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
-    return n-1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_getlineb - Robustly find a text line in place (buffered)
+ *     Sets *linep to the next line inside the internal buffer and
+ *     returns its length, newline included, without copying it. The
+ *     line is not NUL-terminated and stays valid only until the next
+ *     read from rp. A line longer than RIO_BUFSIZE comes back in
+ *     buffer-sized pieces, as does an unterminated line at EOF.
+ *     Returns 0 on EOF with no data, -1 on error.
+ */
+ssize_t rio_getlineb(rio_t *rp, char **linep)
+{
+    char *nl;
+    ssize_t n, rc;
+
+    while (1) {
+	if (rp->rio_cnt > 0 && (nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt))) {
+	    n = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt == sizeof(rp->rio_buf)) {
+	    n = rp->rio_cnt;     /* Full buf and no newline */
+	    break;
+	}
+	/* Move the partial line to the front and read more after it */
+	if (rp->rio_cnt <= 0)
+	    rp->rio_cnt = 0;
+	else if (rp->rio_bufptr != rp->rio_buf)
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		  sizeof(rp->rio_buf) - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR)  /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rc == 0) {      /* EOF */
+	    if ((n = rp->rio_cnt) == 0)
+		return 0;
+	    break;
+	}
+	else
+	    rp->rio_cnt += rc;
+    }
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -923,6 +1020,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_getlineb(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_getlineb(rp, linep)) < 0)
+	unix_error("Rio_getlineb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -983,7 +1089,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
-int open_listenfd(char *port) 
+static int bind_listenfd(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1008,6 +1114,15 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Let other sockets bind the same port; the kernel spreads
+           incoming connections over them by flow hash */
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1030,6 +1145,20 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
+
+int open_listenfd(char *port)
+{
+    return bind_listenfd(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - open_listenfd with SO_REUSEPORT set, so
+ *     several listening sockets can share port.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return bind_listenfd(port, 1);
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -1053,6 +1182,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port)
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,310 @@
+/*
+ * disk.c - mmap'd segment file tier below the RAM cache
+ *
+ * Holds resps too big for RAM (stored while they stream to the first
+ * client) and objects evicted from RAM. Hits are sent with sendfile()
+ * straight from the page cache; a RAM-sized object hit often enough
+ * is handed back to the caller for promotion.
+ */
+#include <sys/sendfile.h>
+#include "disk.h"
+#include "cache.h"
+
+static DiskSeg segs[DISK_SEGMENTS];
+static DiskEntry *buckets[DISK_BUCKETS];
+static DiskSeg *cur;    // segment being appended to
+static int hand;        // clock hand over segs
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long hits, stores, promotions, reclaims;
+
+int disk_init(char *dir)
+{
+    char path[MAXLINE];
+    DiskSeg *seg;
+    int rc;
+
+    if(mkdir(dir, 0700) < 0 && errno != EEXIST){
+        unix_error("disk mkdir error");
+        return -1;
+    }
+    for(int i = 0; i < DISK_SEGMENTS; i++){
+        seg = &segs[i];
+        snprintf(path, MAXLINE, "%s/seg-%02d", dir, i);
+        if((seg->fd = open(path, O_RDWR | O_CREAT, 0600)) < 0){
+            unix_error("disk open error");
+            return -1;
+        }
+        // reserve the blocks now so appends never hit ENOSPC as SIGBUS
+        if(ftruncate(seg->fd, DISK_SEG_SIZE) < 0 ||
+           ((rc = posix_fallocate(seg->fd, 0, DISK_SEG_SIZE)) != 0 && rc != EOPNOTSUPP)){
+            unix_error("disk allocate error");
+            return -1;
+        }
+        seg->base = mmap(NULL, DISK_SEG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+        if(seg->base == MAP_FAILED){
+            unix_error("disk mmap error");
+            return -1;
+        }
+        seg->used = 0;
+        seg->pins = 0;
+        seg->ref = 0;
+        seg->entries = NULL;
+    }
+    memset(buckets, 0, sizeof(buckets));
+    cur = &segs[0];
+    hand = 1;
+    enabled = 1;
+    return 0;
+}
+
+int disk_enabled()
+{
+    return enabled;
+}
+
+/* caller holds lock */
+static DiskEntry *find_entry(char *url, unsigned long hash)
+{
+    DiskEntry *e;
+    for(e = buckets[hash % DISK_BUCKETS]; e; e = e->next)
+        if(e->hash == hash && !strcmp(e->url, url))
+            break;
+    return e;
+}
+
+/* drop e from the index and its segment; caller holds lock */
+static void drop_entry(DiskEntry *e)
+{
+    DiskEntry **pp;
+
+    for(pp = &buckets[e->hash % DISK_BUCKETS]; *pp != e; pp = &(*pp)->next)
+        ;
+    *pp = e->next;
+    for(pp = &e->seg->entries; *pp != e; pp = &(*pp)->snext)
+        ;
+    *pp = e->snext;
+    free(e->url);
+    free(e);
+}
+
+/*
+ * clock_next - empty the next unpinned, unreferenced segment
+ * Returns NULL if every segment is being read or written.
+ */
+static DiskSeg *clock_next()
+{
+    DiskSeg *seg;
+
+    for(int i = 0; i < 2 * DISK_SEGMENTS; i++){
+        seg = &segs[hand];
+        hand = (hand + 1) % DISK_SEGMENTS;
+        if(seg->pins)
+            continue;
+        if(seg->ref){
+            seg->ref = 0;
+            continue;
+        }
+        while(seg->entries)
+            drop_entry(seg->entries);
+        seg->used = 0;
+        reclaims++;
+        return seg;
+    }
+    return NULL;
+}
+
+/*
+ * disk_lookup - pin the disk copy of url; returns 0 on a hit, else -1
+ */
+int disk_lookup(char *url, unsigned long hash, DiskRef *ref)
+{
+    DiskEntry *e;
+
+    if(!enabled)
+        return -1;
+    pthread_mutex_lock(&lock);
+    if(!(e = find_entry(url, hash))){
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    e->seg->pins++;
+    e->seg->ref = 1;
+    ref->seg = e->seg;
+    ref->data = e->seg->base + e->off;
+    ref->off = e->off;
+    ref->len = e->len;
+    ref->hdrlen = e->hdrlen;
+    ref->framed = e->framed;
+    ref->hot = ++e->hits == DISK_PROMOTE_HITS && e->len <= MAX_OBJECT_SIZE;
+    hits++;
+    if(ref->hot)
+        promotions++;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void disk_release(DiskRef *ref)
+{
+    pthread_mutex_lock(&lock);
+    ref->seg->pins--;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * disk_sendfile - one sendfile() of the object from *pos on
+ */
+ssize_t disk_sendfile(int fd, DiskRef *ref, size_t *pos)
+{
+    off_t off = ref->off + *pos;
+    ssize_t n;
+
+    if((n = sendfile(fd, ref->seg->fd, &off, ref->len - *pos)) > 0)
+        *pos += n;
+    return n;
+}
+
+/*
+ * disk_reserve - claim len bytes for an object that is not fully here
+ * Returns NULL if the tier is off or no segment can be reclaimed.
+ */
+DiskSlot *disk_reserve(size_t len)
+{
+    DiskSlot *slot;
+    DiskSeg *seg;
+
+    if(!enabled || len > DISK_SEG_SIZE)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    if(cur->used + len > DISK_SEG_SIZE){
+        if(!(seg = clock_next())){
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        cur = seg;
+    }
+    slot = (DiskSlot *)Malloc(sizeof(DiskSlot));
+    slot->seg = cur;
+    slot->off = cur->used;
+    slot->cap = len;
+    slot->len = 0;
+    cur->used += len;
+    cur->pins++;
+    pthread_mutex_unlock(&lock);
+    return slot;
+}
+
+/* the slot is private until committed, so no lock is needed */
+int disk_append(DiskSlot *slot, char *buf, size_t n)
+{
+    if(slot->len + n > slot->cap)
+        return -1;
+    memcpy(slot->seg->base + slot->off + slot->len, buf, n);
+    slot->len += n;
+    return 0;
+}
+
+/*
+ * disk_commit - index a filled slot under url; a short one is dropped
+ */
+void disk_commit(DiskSlot *slot, char *url, unsigned long hash,
+                 size_t hdrlen, int framed)
+{
+    DiskEntry *e;
+
+    if(slot->len != slot->cap){
+        disk_abort(slot);
+        return;
+    }
+    e = (DiskEntry *)Malloc(sizeof(DiskEntry));
+    e->url = (char *)Malloc(strlen(url) + 1);
+    strcpy(e->url, url);
+    e->hash = hash;
+    e->seg = slot->seg;
+    e->off = slot->off;
+    e->len = slot->len;
+    e->hdrlen = hdrlen;
+    e->framed = framed;
+    e->hits = 0;
+
+    pthread_mutex_lock(&lock);
+    if((e->next = find_entry(url, hash)))
+        drop_entry(e->next);
+    e->next = buckets[hash % DISK_BUCKETS];
+    buckets[hash % DISK_BUCKETS] = e;
+    e->snext = slot->seg->entries;
+    slot->seg->entries = e;
+    slot->seg->pins--;
+    stores++;
+    pthread_mutex_unlock(&lock);
+    free(slot);
+    // a variant is only found through its url's marker
+    if(strchr(url, '\n'))
+        cache_vary(url);
+}
+
+/* what was appended to slot so far, in place */
+char *disk_slotdata(DiskSlot *slot)
+{
+    return slot->seg->base + slot->off;
+}
+
+/* the space stays unused until its segment is reclaimed */
+void disk_abort(DiskSlot *slot)
+{
+    pthread_mutex_lock(&lock);
+    slot->seg->pins--;
+    pthread_mutex_unlock(&lock);
+    free(slot);
+}
+
+/*
+ * disk_store - copy a complete object down, e.g. on RAM eviction
+ * An older copy of url is replaced; the same bytes are left in place.
+ */
+void disk_store(char *url, unsigned long hash, char *data, size_t len,
+                size_t hdrlen, int framed)
+{
+    DiskSlot *slot;
+    DiskEntry *e;
+    DiskSeg *seg = NULL;
+    size_t off = 0;
+    int same = 0;
+
+    if(!enabled)
+        return;
+    // promoted objects keep their disk copy; pin it to compare, as
+    // the entry itself may go meanwhile
+    pthread_mutex_lock(&lock);
+    if((e = find_entry(url, hash)) && e->len == len){
+        seg = e->seg;
+        off = e->off;
+        seg->pins++;
+    }
+    pthread_mutex_unlock(&lock);
+    if(seg){
+        same = !memcmp(seg->base + off, data, len);
+        pthread_mutex_lock(&lock);
+        seg->pins--;
+        pthread_mutex_unlock(&lock);
+    }
+    // disk_commit drops the older copy
+    if(same || !(slot = disk_reserve(len)))
+        return;
+    disk_append(slot, data, len);
+    disk_commit(slot, url, hash, hdrlen, framed);
+}
+
+void disk_report(FILE *fp)
+{
+    size_t used = 0;
+
+    if(!enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    for(int i = 0; i < DISK_SEGMENTS; i++)
+        used += segs[i].used;
+    fprintf(fp, "disk: hits %lu stores %lu promotions %lu reclaims %lu used %zu/%d\n",
+            hits, stores, promotions, reclaims, used, DISK_SEGMENTS * DISK_SEG_SIZE);
+    pthread_mutex_unlock(&lock);
+}
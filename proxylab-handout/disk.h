@@ -0,0 +1,73 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+/*
+ * Second cache tier in preallocated, mmap'd segment files. Objects are
+ * appended to the current segment; when it is full the clock hand
+ * reclaims the next segment nobody is reading, skipping once any
+ * segment hit since the last sweep, and drops its index entries.
+ */
+#define DISK_SEGMENTS 16
+#define DISK_SEG_SIZE (8 << 20)
+#define DISK_BUCKETS 1024
+#define DISK_PROMOTE_HITS 2     /* disk hits before a RAM-sized object moves up */
+
+typedef struct DiskSeg {
+    int fd;
+    char *base;             // mmap of the whole file
+    size_t used;            // append offset
+    int pins;               // readers and writers inside the segment
+    int ref;                // hit since the clock hand last passed
+    struct DiskEntry *entries;
+} DiskSeg;
+
+typedef struct DiskEntry {
+    char *url;
+    unsigned long hash;
+    DiskSeg *seg;
+    size_t off;             // object start in the segment
+    size_t len;             // laid out like CacheObject data
+    size_t hdrlen;
+    int framed;
+    int hits;
+    struct DiskEntry *next;     // hash chain
+    struct DiskEntry *snext;    // segment's entry list
+} DiskEntry;
+
+/* Space being filled by a resp on its way to the client */
+typedef struct DiskSlot {
+    DiskSeg *seg;
+    size_t off;
+    size_t cap;
+    size_t len;
+} DiskSlot;
+
+/* A pinned disk hit */
+typedef struct DiskRef {
+    DiskSeg *seg;
+    char *data;             // object bytes in the mmap
+    size_t off;             // file offset of data, for sendfile()
+    size_t len;
+    size_t hdrlen;
+    int framed;
+    int hot;                // caller should promote it to RAM
+} DiskRef;
+
+int disk_init(char *dir);
+int disk_enabled();
+int disk_lookup(char *url, unsigned long hash, DiskRef *ref);
+void disk_release(DiskRef *ref);
+ssize_t disk_sendfile(int fd, DiskRef *ref, size_t *pos);
+DiskSlot *disk_reserve(size_t len);
+int disk_append(DiskSlot *slot, char *buf, size_t n);
+void disk_commit(DiskSlot *slot, char *url, unsigned long hash,
+                 size_t hdrlen, int framed);
+void disk_abort(DiskSlot *slot);
+char *disk_slotdata(DiskSlot *slot);
+void disk_store(char *url, unsigned long hash, char *data, size_t len,
+                size_t hdrlen, int framed);
+void disk_report(FILE *fp);
+
+#endif
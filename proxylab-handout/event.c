@@ -0,0 +1,1509 @@
+/*
+ * event.c - epoll-driven proxy service
+ *
+ * Every loop thread owns one epoll instance and the connections it
+ * accepted. All sockets are non-blocking and edge-triggered, so each
+ * connection is a small state machine that is pushed forward until
+ * the kernel reports EAGAIN, then parked until the next event.
+ *
+ * With "-b uring" a loop waits on an io_uring instead of epoll: the
+ * listener takes a multishot accept, every fd a multishot poll, and
+ * socket reads and writes go out as recv and sendmsg ops, so one
+ * io_uring_enter() submits and reaps a whole batch. The handlers are
+ * the same for both; see ev_io.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "event.h"
+#include "cache.h"
+#include "disk.h"
+#include "flight.h"
+#include "resolve.h"
+#include "pool.h"
+#include "refresh.h"
+#include "stats.h"
+#include "http.h"
+#include "key.h"
+#include "zcopy.h"
+#include "cpu.h"
+#include "uring.h"
+
+typedef enum {
+    ST_REQ,     // reading req hdrs from client
+    ST_RESOLVE, // server name lookup queued to the resolver threads
+    ST_CONNECT, // racing non-blocking connects to server addrs
+    ST_FWD,     // writing fwd req to server with writev
+    ST_RELAY,   // relaying resp from server to client, spliced once
+                // it is known to be uncacheable
+    ST_HIT,     // writing cached object to client
+    ST_DISKHIT, // writing disk tier object, body by sendfile
+    ST_FOLLOW,  // streaming another conn's fetch of the same url
+    ST_REPLY,   // writing a page the proxy made itself from out
+    ST_DRAIN,   // reading the rest of a hit's req hdrs before closing
+} ConnState;
+
+/* io_uring user_data besides Endpoint pointers */
+#define UD_TICK     0   // the loop's periodic timeout
+#define UD_IGNORE   1   // cancels; their results don't matter
+#define UD_IO       1   // low bit set on a recv or send of an endpoint
+
+/* Buffers one queued send may carry; a longer writev goes out short */
+#define EV_IOV 4
+
+/* Result of one state handler */
+#define STEP_CLOSE  -1  // done or failed; tear down
+#define STEP_AGAIN   0  // blocked; wait for next event
+#define STEP_NEXT    1  // moved to another state
+
+struct Conn;
+struct Loop;
+
+/* epoll user data; tells which side of which conn fired */
+typedef struct Endpoint {
+    struct Conn *conn;  // NULL for the listening socket
+    int fd;
+    /* io_uring only */
+    uint32_t events;    // poll mask, to re-arm with
+    int busy;           // a recv or send is queued
+    int done;           // and its result is in res
+    int res;
+    int ready;          // its poll has seen it readable
+    struct iovec iov[EV_IOV];   // the queued send's buffers
+    struct msghdr msg;
+} Endpoint;
+
+/* a conn's buffers, held only while its req is being served */
+typedef struct ConnIO {
+    char url[MAXLINE];      // as the client sent it, for the server
+    char key[MAXLINE];      // cache key: canonical url or a variant of it
+    char in[MAXBUF];        // req hdrs from client
+    char out[MAXBUF];       // resp chunks
+    HttpHead head;          // parse of in so far
+} ConnIO;
+
+typedef struct Conn {
+    ConnState state;
+    Endpoint client;
+    Endpoint server;
+    Endpoint wake;          // eventfd kicked by a flight or the resolver
+    Endpoint racer[CONNECT_RACE];           // connects in progress
+    struct addrinfo *raceaddr[CONNECT_RACE];
+    Endpoint timer;         // timerfd adding the next addr to the race
+    Resolv *resolv;         // server addrs
+    struct addrinfo *addr;  // next addr to try
+    ConnIO *io;             // NULL while idle
+    unsigned long hash;     // of key
+    int looked;             // url looked up from the req line alone
+    size_t inlen;
+    FwdReq fwd;             // fwd req; slices point into in
+    struct iovec *iov;
+    int iovcnt, iovpos;
+    size_t outlen, outoff;
+    Flight *flight;         // fetch we lead or follow
+    int solo;               // followed flight failed; don't join another
+    size_t objectlen;       // resp copy in flight->buf
+    int overflow;           // resp exceeded MAX_OBJECT_SIZE
+    int hdrs_seen;          // resp hdrs stripped and published
+    int pipefd[2];          // splice pipe once overflowed
+    size_t inpipe;          // bytes sitting in the pipe
+    CacheObject *hit;       // pinned cached object being sent
+    int gzip;               // client accepts gzip
+    int nobody;             // a HEAD; hits go out without the body
+    int hitready;           // hit hdrs are in out
+    char *plain;            // hit body inflated for this client, or NULL
+    size_t plainlen;
+    CacheObject *stale;     // pinned expired object being revalidated
+    DiskRef dref;           // pinned disk object being sent
+    int dhit;               // dref is held
+    DiskSlot *disk;         // too big for RAM; body streams to disk
+    uint64_t t_start;       // first req byte in
+    uint64_t t_stage;       // start of the stage being timed; 0 until parsed
+    uint64_t t_first;       // first resp byte in, or 0
+    struct Loop *lp;        // owning loop
+    int inflight;           // io_uring ops that still name this conn
+    struct Conn *next;      // graveyard link
+} Conn;
+
+typedef struct Loop {
+    int epfd;               // -1 with io_uring
+    Uring *ring;            // NULL with epoll
+    struct __kernel_timespec tick;
+    int ticking;            // the tick timeout is queued
+    int cpu;                // core slot the loop is pinned to, or -1
+    Endpoint listen;
+    Conn *graveyard;        // closed conns freed once nothing names them
+} Loop;
+
+static void *loop_thread(void *vargp);
+static void loop_run(Loop *lp);
+static void uring_run(Loop *lp);
+static void uring_complete(Loop *lp, uint64_t ud, int res, int flags);
+static void accept_conns(Loop *lp);
+static void conn_new(Loop *lp, int connfd);
+static void sweep(Loop *lp);
+static void conn_step(Loop *lp, Conn *c);
+static void conn_close(Loop *lp, Conn *c);
+static int do_req(Loop *lp, Conn *c);
+static int read_req(Conn *c);
+static int answer_hit(Conn *c);
+static int do_drain(Conn *c);
+static int do_resolve(Loop *lp, Conn *c);
+static int do_connect(Loop *lp, Conn *c);
+static int do_fwd(Conn *c);
+static int do_relay(Conn *c);
+static int do_splice(Conn *c);
+static void set_overflow(Conn *c);
+static void check_hdrs(Conn *c);
+static void not_modified(Conn *c, size_t hdrlen);
+static void share_stale(Conn *c);
+static int serve_stale(Conn *c);
+static int do_hit(Conn *c);
+static int do_diskhit(Conn *c);
+static int start_follow(Loop *lp, Conn *c);
+static void stop_follow(Conn *c);
+static int do_follow(Conn *c);
+static int do_reply(Conn *c);
+static void cache_resp(Conn *c);
+static int start_connect(Loop *lp, Conn *c);
+static void end_race(Conn *c);
+static int conn_wake(Loop *lp, Conn *c);
+static int add_fd(Loop *lp, Endpoint *ep, uint32_t events);
+static int move_fd(Loop *lp, Endpoint *from, Endpoint *to, uint32_t events);
+static void ep_init(Endpoint *ep, Conn *c);
+static void ep_close(Loop *lp, Endpoint *ep);
+static void arm_poll(Loop *lp, Endpoint *ep);
+static void arm_accept(Loop *lp);
+static void cancel(Loop *lp, uint64_t ud);
+static ssize_t ev_io(Endpoint *ep, int out, struct iovec *iov, int cnt);
+static ssize_t ev_read(Endpoint *ep, void *buf, size_t len);
+static ssize_t ev_write(Endpoint *ep, void *buf, size_t len);
+static void set_nonblock(int fd);
+
+void event_run(int *listenfds, int nlisten, int nloops, int pin, int backend)
+{
+    pthread_t tid;
+
+    // accept loops until EAGAIN, so listenfds must not block
+    for(int i = 0; i < nlisten; i++)
+        set_nonblock(listenfds[i]);
+
+    for(int i = 0; i < nloops; i++){
+        Loop *lp = (Loop *)Malloc(sizeof(Loop));
+        lp->epfd = -1;
+        lp->ring = NULL;
+        if(backend == EV_URING){
+            lp->ring = (Uring *)Malloc(sizeof(Uring));
+            if(uring_init(lp->ring, URING_ENTRIES) < 0){
+                if(i > 0){
+                    unix_error("io_uring_setup error");
+                    exit(1);
+                }
+                // all loops fall back together
+                unix_error("io_uring unavailable, using epoll");
+                free(lp->ring);
+                lp->ring = NULL;
+                backend = EV_EPOLL;
+            }
+        }
+        if(!lp->ring && (lp->epfd = epoll_create1(0)) < 0){
+            unix_error("epoll_create1 error");
+            exit(1);
+        }
+        lp->tick.tv_sec = EVENT_TICK_MS / 1000;
+        lp->tick.tv_nsec = EVENT_TICK_MS % 1000 * 1000000L;
+        lp->ticking = 0;
+        // loop i serves listener group i % nlisten, on that group's core
+        lp->cpu = pin ? i % nlisten : -1;
+        lp->listen.conn = NULL;
+        lp->listen.fd = listenfds[i % nlisten];
+        lp->graveyard = NULL;
+        // level-triggered; EPOLLEXCLUSIVE wakes one loop per conn
+        // among those sharing a listener. A ring takes its multishot
+        // accept once running.
+        if(!lp->ring && add_fd(lp, &lp->listen, EPOLLIN | EPOLLEXCLUSIVE) < 0)
+            exit(1);
+        if(i == nloops - 1)
+            loop_run(lp);
+        else
+            Pthread_create(&tid, NULL, loop_thread, lp);
+    }
+}
+
+static void *loop_thread(void *vargp)
+{
+    Pthread_detach(Pthread_self());
+    loop_run((Loop *)vargp);
+    return NULL;
+}
+
+static void loop_run(Loop *lp)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    if(lp->cpu >= 0 && cpu_pin(lp->cpu) < 0)
+        unix_error("cpu_pin error");
+    if(lp->ring){
+        uring_run(lp);
+        return;
+    }
+    while(1){
+        // wake now and then to notice a stats request
+        stats_count(CNT_SYSCALLS, 1);
+        if((n = epoll_wait(lp->epfd, events, MAX_EVENTS, EVENT_TICK_MS)) < 0){
+            if(errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+        if(poolReportFlag){
+            poolReportFlag = 0;
+            cache_report(stderr);
+        }
+        for(int i = 0; i < n; i++){
+            Endpoint *ep = (Endpoint *)events[i].data.ptr;
+            if(!ep->conn)
+                accept_conns(lp);
+            // skip conns closed earlier in this batch
+            else if(ep->conn->client.fd >= 0)
+                conn_step(lp, ep->conn);
+        }
+        // now no pending event can refer to them
+        sweep(lp);
+    }
+}
+
+/*
+ * uring_run - the loop on an io_uring; one enter per batch
+ */
+static void uring_run(Loop *lp)
+{
+    struct io_uring_cqe *cqe;
+    uint64_t ud;
+    int res, flags;
+
+    arm_accept(lp);
+    while(1){
+        // wake now and then to notice a stats request
+        if(!lp->ticking){
+            struct io_uring_sqe *sqe = uring_sqe(lp->ring);
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uintptr_t)&lp->tick;
+            sqe->len = 1;
+            sqe->user_data = UD_TICK;
+            lp->ticking = 1;
+        }
+        stats_count(CNT_SYSCALLS, 1);
+        if(uring_enter(lp->ring, 1) < 0 && errno != EINTR && errno != EAGAIN &&
+           errno != EBUSY)
+            unix_error("io_uring_enter error");
+        if(poolReportFlag){
+            poolReportFlag = 0;
+            cache_report(stderr);
+        }
+        while((cqe = uring_peek(lp->ring))){
+            ud = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            uring_seen(lp->ring);
+            uring_complete(lp, ud, res, flags);
+        }
+        sweep(lp);
+    }
+}
+
+/*
+ * uring_complete - act on one CQE
+ * A poll or a finished recv or send steps its conn, as an epoll event
+ * would; the kernel ending a multishot poll or accept on its own gets
+ * it re-armed.
+ */
+static void uring_complete(Loop *lp, uint64_t ud, int res, int flags)
+{
+    Endpoint *ep = (Endpoint *)(uintptr_t)(ud & ~(uint64_t)UD_IO);
+    int more = flags & IORING_CQE_F_MORE;
+    Conn *c;
+
+    if(ud == UD_TICK){
+        lp->ticking = 0;
+        return;
+    }
+    if(ud == UD_IGNORE)
+        return;
+    if(!ep->conn){
+        if(res >= 0)
+            conn_new(lp, res);
+        else if(res != -EAGAIN && res != -EINTR && res != -ECONNABORTED){
+            errno = -res;
+            unix_error("accept error");
+        }
+        if(!more)
+            arm_accept(lp);
+        return;
+    }
+    c = ep->conn;
+    if(!more)
+        c->inflight--;
+    if(ud & UD_IO){
+        ep->busy = 0;
+        // a closed endpoint's result is dropped
+        if(ep->fd >= 0){
+            ep->done = 1;
+            ep->res = res;
+        }
+    }
+    else{
+        // a poll's result is the events it saw
+        if(res > 0 && (res & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            ep->ready = 1;
+        if(!more && res != -ECANCELED && ep->fd >= 0)
+            arm_poll(lp, ep);
+    }
+    // skip conns closed earlier in this batch
+    if(c->client.fd >= 0)
+        conn_step(lp, c);
+}
+
+/* free closed conns no pending event or queued op can refer to */
+static void sweep(Loop *lp)
+{
+    Conn **pp = &lp->graveyard, *c;
+
+    while((c = *pp)){
+        if(c->inflight){
+            pp = &c->next;
+            continue;
+        }
+        *pp = c->next;
+        free(c->io);
+        free(c);
+    }
+}
+
+static void accept_conns(Loop *lp)
+{
+    int connfd;
+
+    while(1){
+        stats_count(CNT_SYSCALLS, 1);
+        if((connfd = accept(lp->listen.fd, NULL, NULL)) < 0)
+            break;
+        conn_new(lp, connfd);
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        unix_error("accept error");
+}
+
+static void conn_new(Loop *lp, int connfd)
+{
+    Conn *c = (Conn *)Malloc(sizeof(Conn));
+
+    set_nonblock(connfd);
+    c->state = ST_REQ;
+    c->lp = lp;
+    c->inflight = 0;
+    ep_init(&c->client, c);
+    ep_init(&c->server, c);
+    ep_init(&c->wake, c);
+    ep_init(&c->timer, c);
+    for(int i = 0; i < CONNECT_RACE; i++)
+        ep_init(&c->racer[i], c);
+    c->client.fd = connfd;
+    c->resolv = NULL;
+    c->addr = NULL;
+    c->io = NULL;
+    c->inlen = c->outlen = c->outoff = 0;
+    c->looked = 0;
+    c->nobody = 0;
+    c->flight = NULL;
+    c->solo = 0;
+    c->objectlen = 0;
+    c->overflow = 0;
+    c->hdrs_seen = 0;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->inpipe = 0;
+    c->hit = c->stale = NULL;
+    c->gzip = c->hitready = 0;
+    c->plain = NULL;
+    c->dhit = 0;
+    c->disk = NULL;
+    c->t_start = c->t_stage = c->t_first = 0;
+    fwd_init(&c->fwd);
+    c->iov = NULL;
+    c->iovcnt = c->iovpos = 0;
+    c->next = NULL;
+    if(add_fd(lp, &c->client, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0){
+        Close(connfd);
+        free(c);
+        return;
+    }
+    // req bytes may already be queued
+    conn_step(lp, c);
+}
+
+/*
+ * conn_step - run state handlers until one blocks or the conn ends
+ */
+static void conn_step(Loop *lp, Conn *c)
+{
+    int rc;
+
+    do{
+        switch(c->state){
+        case ST_REQ:     rc = do_req(lp, c);     break;
+        case ST_RESOLVE: rc = do_resolve(lp, c); break;
+        case ST_CONNECT: rc = do_connect(lp, c); break;
+        case ST_FWD:     rc = do_fwd(c);         break;
+        case ST_RELAY:   rc = do_relay(c);       break;
+        case ST_HIT:     rc = do_hit(c);         break;
+        case ST_DISKHIT: rc = do_diskhit(c);     break;
+        case ST_FOLLOW:  rc = do_follow(c);      break;
+        case ST_REPLY:   rc = do_reply(c);       break;
+        case ST_DRAIN:   rc = do_drain(c);       break;
+        default:         rc = STEP_CLOSE;        break;
+        }
+    } while(rc == STEP_NEXT);
+
+    if(rc == STEP_CLOSE)
+        conn_close(lp, c);
+}
+
+static void conn_close(Loop *lp, Conn *c)
+{
+    if(c->t_first)
+        stats_time(STAGE_TRANSFER, c->t_first);
+    if(c->t_stage)
+        stats_time(STAGE_TOTAL, c->t_start);
+    // closing drops the fds from the epoll set
+    ep_close(lp, &c->server);
+    ep_close(lp, &c->client);
+    end_race(c);
+    if(c->pipefd[0] >= 0){
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    if(c->state == ST_FOLLOW)
+        stop_follow(c);
+    else if(c->flight){
+        // a leader closing early fails its followers; no-op once done
+        flight_finish(c->flight, FL_FAILED);
+        flight_release(c->flight);
+    }
+    if(c->resolv){
+        resolve_unwatch(c->resolv, c->wake.fd);
+        resolve_release(c->resolv);
+    }
+    ep_close(lp, &c->wake);
+    fwd_free(&c->fwd);
+    free(c->iov);
+    if(c->hit)
+        cache_release(c->hit);
+    free(c->plain);
+    if(c->stale)
+        cache_release(c->stale);
+    if(c->dhit)
+        disk_release(&c->dref);
+    if(c->disk)
+        disk_abort(c->disk);
+    c->next = lp->graveyard;
+    lp->graveyard = c;
+}
+
+static int add_fd(Loop *lp, Endpoint *ep, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if(lp->ring){
+        ep->events = events;
+        arm_poll(lp, ep);
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    stats_count(CNT_SYSCALLS, 1);
+    if(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0){
+        unix_error("epoll_ctl error");
+        return -1;
+    }
+    return 0;
+}
+
+/* hand from's fd over to endpoint to, which is told of events */
+static int move_fd(Loop *lp, Endpoint *from, Endpoint *to, uint32_t events)
+{
+    struct epoll_event ev;
+
+    to->fd = from->fd;
+    from->fd = -1;
+    if(lp->ring){
+        cancel(lp, (uintptr_t)from);
+        return add_fd(lp, to, events);
+    }
+    ev.events = events;
+    ev.data.ptr = to;
+    stats_count(CNT_SYSCALLS, 1);
+    if(epoll_ctl(lp->epfd, EPOLL_CTL_MOD, to->fd, &ev) < 0){
+        unix_error("epoll_ctl error");
+        return -1;
+    }
+    return 0;
+}
+
+static void ep_init(Endpoint *ep, Conn *c)
+{
+    ep->conn = c;
+    ep->fd = -1;
+    ep->busy = ep->done = ep->ready = 0;
+}
+
+/*
+ * ep_close - close an endpoint's fd, if open
+ * The ring holds its own file refs, so its poll and any queued recv
+ * or send are cancelled too; their last CQEs free the conn.
+ */
+static void ep_close(Loop *lp, Endpoint *ep)
+{
+    if(ep->fd < 0)
+        return;
+    if(lp->ring){
+        // a recv or send still queued names the fd by number; it must
+        // reach the kernel before the number can be reused
+        if(ep->busy && lp->ring->queued){
+            stats_count(CNT_SYSCALLS, 1);
+            uring_enter(lp->ring, 0);
+        }
+        cancel(lp, (uintptr_t)ep);
+        if(ep->busy)
+            cancel(lp, (uintptr_t)ep | UD_IO);
+    }
+    close(ep->fd);
+    ep->fd = -1;
+    ep->done = 0;
+}
+
+/* multishot poll standing in for the epoll registration */
+static void arm_poll(Loop *lp, Endpoint *ep)
+{
+    struct io_uring_sqe *sqe = uring_sqe(lp->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ep->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = ep->events;
+    sqe->user_data = (uintptr_t)ep;
+    ep->conn->inflight++;
+}
+
+/* one CQE per accepted conn until the kernel ends it */
+static void arm_accept(Loop *lp)
+{
+    struct io_uring_sqe *sqe = uring_sqe(lp->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = lp->listen.fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uintptr_t)&lp->listen;
+}
+
+/* every op queued with user data ud */
+static void cancel(Loop *lp, uint64_t ud)
+{
+    struct io_uring_sqe *sqe = uring_sqe(lp->ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ud;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = UD_IGNORE;
+}
+
+/*
+ * ev_io - read into or write out of iov on an endpoint, as a state
+ * handler would with read(), write() or writev()
+ * With epoll it is that syscall. With io_uring the first call queues a
+ * recv or sendmsg and fails with EAGAIN; the completion steps the conn
+ * again, and the handler's repeat call, which names the same buffers
+ * since its state has not moved, returns the result. Reads take one
+ * buffer.
+ */
+static ssize_t ev_io(Endpoint *ep, int out, struct iovec *iov, int cnt)
+{
+    Loop *lp = ep->conn->lp;
+    struct io_uring_sqe *sqe;
+
+    if(!lp->ring){
+        stats_count(CNT_SYSCALLS, 1);
+        if(!out)
+            return read(ep->fd, iov->iov_base, iov->iov_len);
+        return cnt == 1 ? write(ep->fd, iov->iov_base, iov->iov_len) :
+                          writev(ep->fd, iov, cnt);
+    }
+    if(ep->done){
+        ep->done = 0;
+        if(ep->res < 0){
+            errno = -ep->res;
+            return -1;
+        }
+        return ep->res;
+    }
+    if(!ep->busy){
+        sqe = uring_sqe(lp->ring);
+        sqe->fd = ep->fd;
+        if(out){
+            // the kernel reads msg and iov at submission, after the
+            // caller's stack is gone, so they are kept here
+            if(cnt > EV_IOV)
+                cnt = EV_IOV;
+            memcpy(ep->iov, iov, cnt * sizeof(struct iovec));
+            memset(&ep->msg, 0, sizeof(ep->msg));
+            ep->msg.msg_iov = ep->iov;
+            ep->msg.msg_iovlen = cnt;
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->addr = (uintptr_t)&ep->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        else{
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (uintptr_t)iov->iov_base;
+            sqe->len = iov->iov_len;
+        }
+        sqe->user_data = (uintptr_t)ep | UD_IO;
+        ep->busy = 1;
+        ep->conn->inflight++;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static ssize_t ev_read(Endpoint *ep, void *buf, size_t len)
+{
+    struct iovec iov = { buf, len };
+    return ev_io(ep, 0, &iov, 1);
+}
+
+static ssize_t ev_write(Endpoint *ep, void *buf, size_t len)
+{
+    struct iovec iov = { buf, len };
+    return ev_io(ep, 1, &iov, 1);
+}
+
+/* the conn's eventfd, created on first use */
+static int conn_wake(Loop *lp, Conn *c)
+{
+    if(c->wake.fd >= 0)
+        return 0;
+    if((c->wake.fd = eventfd(0, EFD_NONBLOCK)) < 0){
+        unix_error("eventfd error");
+        return -1;
+    }
+    return add_fd(lp, &c->wake, EPOLLIN | EPOLLET);
+}
+
+static void set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * do_req - collect req hdrs; answer from cache or build fwd req
+ * A fresh RAM hit is answered from the req line alone, and do_drain
+ * reads the hdrs after the resp is out.
+ */
+static int do_req(Loop *lp, Conn *c)
+{
+    char method[8];
+    char hostname[MAXLINE];
+    char port[8];
+    char resource[MAXLINE];
+    uint64_t t;
+    int leader, rc;
+    Hdr *h;
+
+    // an idle conn holds no buffers; a ring's first recv waits for
+    // the poll so it does not pin them either
+    if(!c->io){
+        if(lp->ring && !c->client.ready)
+            return STEP_AGAIN;
+        c->io = (ConnIO *)Malloc(sizeof(ConnIO));
+        head_init(&c->io->head, 0);
+    }
+    // read until the req line is in, parsing each piece as it comes;
+    // the parser never looks past inlen, where a queued recv may be
+    // writing
+    while((rc = head_startline(&c->io->head, c->io->in, c->inlen)) == HEAD_MORE)
+        if((rc = read_req(c)) != STEP_NEXT)
+            return rc;
+    if(rc < 0 || slice_copy(c->io->in, c->io->head.method, method, sizeof(method)) < 0){
+        send_error(c->client.fd, "400", "Bad Request");
+        return STEP_CLOSE;
+    }
+    if(slice_copy(c->io->in, c->io->head.target, c->io->url, sizeof(c->io->url)) < 0){
+        send_error(c->client.fd, "414", "URI Too Long");
+        return STEP_CLOSE;
+    }
+    key_canon(c->io->url, c->io->key, sizeof(c->io->key));
+    // a follower redoing its req was timed and counted already
+    if(!c->t_stage){
+        c->t_stage = stats_time(STAGE_PARSE, c->t_start);
+        stats_count(CNT_REQUESTS, 1);
+    }
+    // cache hit on the req line alone; a gzipped object waits for
+    // Accept-Encoding
+    if(!c->looked && !strcasecmp(method, "GET") && !stats_is_path(c->io->url)){
+        c->looked = 1;
+        c->hash = cache_hash(c->io->key);
+        t = stats_now();
+        c->hit = cache_lookup(c->io->key, c->hash);
+        stats_time(STAGE_LOOKUP, t);
+        // a Vary marker needs the hdrs too
+        if(c->hit && !c->hit->vary && !c->hit->rawlen &&
+           cache_servable(c->hit, STALE_REVALIDATE))
+            return answer_hit(c);
+    }
+
+    // read until blank line
+    while((rc = head_parse(&c->io->head, c->io->in, c->inlen)) == HEAD_MORE)
+        if((rc = read_req(c)) != STEP_NEXT)
+            return rc;
+    if(rc == HEAD_FULL){
+        send_error(c->client.fd, "431", "Request Header Fields Too Large");
+        return STEP_CLOSE;
+    }
+    if(rc < 0){
+        send_error(c->client.fd, "400", "Bad Request");
+        return STEP_CLOSE;
+    }
+    // the proxy's own metrics page
+    if(stats_is_path(c->io->url)){
+        if(!(c->outlen = stats_reply(c->io->url, c->io->out, MAXBUF, 0)))
+            return STEP_CLOSE;
+        c->outoff = 0;
+        c->state = ST_REPLY;
+        return STEP_NEXT;
+    }
+
+    // whether a gzipped copy can go out as stored
+    for(int i = 0; i < c->io->head.nhdrs; i++)
+        if(c->io->head.hdrs[i].id == HDR_ACCEPT_ENCODING)
+            c->gzip = accepts_gzip(c->io->in + c->io->head.hdrs[i].value.off);
+
+    // cache hit; only GET is answered from the cache, and HEAD with the
+    // hdrs alone
+    c->nobody = !strcasecmp(method, "HEAD");
+    if(!c->looked && (c->nobody || !strcasecmp(method, "GET"))){
+        c->looked = 1;
+        c->hash = cache_hash(c->io->key);
+        t = stats_now();
+        c->hit = cache_lookup(c->io->key, c->hash);
+        stats_time(STAGE_LOOKUP, t);
+    }
+    // a Vary marker leads to this req's variant
+    c->hit = key_resolve(c->hit, c->io->key, sizeof(c->io->key), &c->hash,
+                         c->io->in, &c->io->head);
+    if(c->hit){
+        if(cache_servable(c->hit, STALE_REVALIDATE))
+            return answer_hit(c);
+        // revalidate, keeping the copy in case the server fails
+        c->stale = c->hit;
+        c->hit = NULL;
+    }
+    // disk tier hit; hot RAM-sized objects move up
+    if(!c->stale && disk_lookup(c->io->key, c->hash, &c->dref) == 0){
+        if(time(NULL) >= cache_expiry(c->dref.data, c->dref.hdrlen))
+            disk_release(&c->dref);
+        else{
+            c->dhit = 1;
+            stats_count(CNT_DISK_HITS, 1);
+            if(c->dref.hot)
+                cache_add(c->io->key, c->hash, c->dref.data, c->dref.len,
+                          c->dref.hdrlen, c->dref.framed);
+            c->outoff = 0;
+            c->state = ST_DISKHIT;
+            return STEP_NEXT;
+        }
+    }
+
+    // cache miss; only GET goes upstream, a HEAD the cache could not
+    // answer included
+    if(strcasecmp(method, "GET")){
+        send_error(c->client.fd, "501", "Not Implemented");
+        return STEP_CLOSE;
+    }
+    if(parse_url(c->io->url, hostname, port, resource) < 0)
+        return STEP_CLOSE;
+    if(!c->solo)
+        stats_count(CNT_MISSES, 1);
+
+    // share a running fetch of the same url, or lead a new one
+    if(c->solo)
+        c->flight = flight_new(c->io->key, c->hash);
+    else{
+        c->flight = flight_join(c->io->key, c->hash, &leader);
+        if(!leader){
+            // the leader revalidates for everyone
+            if(c->stale)
+                cache_release(c->stale);
+            c->stale = NULL;
+            return start_follow(lp, c);
+        }
+    }
+
+    // build fwd req; kept client hdrs are sent straight from in
+    fwd_reqline(&c->fwd, method, hostname, port, resource, 0);
+    if(c->stale && c->stale->cond)
+        fwd_extra(&c->fwd, c->stale->cond);
+    for(int i = 0; i < c->io->head.nhdrs; i++){
+        h = &c->io->head.hdrs[i];
+        // a compressing cache asks for identity bodies
+        if(!is_replaced_hdr(h->id) &&
+           !(cache_compressing() && h->id == HDR_ACCEPT_ENCODING))
+            fwd_add(&c->fwd, h->line.off, h->line.len);
+    }
+    c->iov = (struct iovec *)Malloc((c->fwd.nslices + 2) * sizeof(struct iovec));
+    c->iovcnt = fwd_iovec(&c->fwd, c->io->in, c->iov);
+    c->iovpos = 0;
+
+    // resolve server off the loop; a cached answer is ready at once
+    if(conn_wake(lp, c) < 0)
+        return STEP_CLOSE;
+    c->t_stage = stats_now();
+    c->resolv = resolve_lookup(hostname, port, c->wake.fd);
+    c->state = ST_RESOLVE;
+    return STEP_NEXT;
+}
+
+/*
+ * read_req - read more of the req head into in
+ * Returns STEP_NEXT once bytes came in, else what the handler should
+ * return.
+ */
+static int read_req(Conn *c)
+{
+    ssize_t n;
+
+    if(c->inlen == MAXBUF){
+        send_error(c->client.fd, "431", "Request Header Fields Too Large");
+        return STEP_CLOSE;
+    }
+    while((n = ev_read(&c->client, c->io->in + c->inlen, MAXBUF - c->inlen)) < 0 && errno == EINTR)
+        ;
+    if(n < 0 && errno == EAGAIN && c->inlen == 0 && !c->client.busy){
+        // nothing came after all; idle again without the buffers
+        free(c->io);
+        c->io = NULL;
+        return STEP_AGAIN;
+    }
+    if(n < 0)
+        return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+    if(n == 0)
+        return STEP_CLOSE;
+    if(c->inlen == 0)
+        c->t_start = stats_now();
+    c->inlen += n;
+    return STEP_NEXT;
+}
+
+/*
+ * answer_hit - send the servable object in c->hit
+ * An expired one is answered now and refreshed off the loop.
+ */
+static int answer_hit(Conn *c)
+{
+    if(cache_fresh(c->hit))
+        stats_count(CNT_HITS, 1);
+    else{
+        stats_count(CNT_STALE_HITS, 1);
+        refresh_queue(c->io->key, c->hit);
+    }
+    c->outoff = 0;
+    c->state = ST_HIT;
+    return STEP_NEXT;
+}
+
+/*
+ * do_drain - read the req hdrs a hit was answered without
+ * Closing on unread bytes would send a reset, which can cut the resp
+ * off at the client. A head too big for in is closed on anyway.
+ */
+static int do_drain(Conn *c)
+{
+    int rc;
+
+    while(head_parse(&c->io->head, c->io->in, c->inlen) == HEAD_MORE && c->inlen < MAXBUF)
+        if((rc = read_req(c)) != STEP_NEXT)
+            return rc;
+    return STEP_CLOSE;
+}
+
+static int do_resolve(Loop *lp, Conn *c)
+{
+    uint64_t kicks;
+
+    // drain first, so a lookup ending after the check kicks us again
+    if(read(c->wake.fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN)
+        return STEP_CLOSE;
+    switch(resolve_wait(c->resolv, 0)){
+    case RS_PENDING:
+        return STEP_AGAIN;
+    case RS_READY:
+        c->t_stage = stats_time(STAGE_DNS, c->t_stage);
+        c->addr = c->resolv->addrs;
+        return start_connect(lp, c);
+    default:
+        return serve_stale(c);
+    }
+}
+
+/*
+ * start_connect - add a connect to the next addr to the race
+ * The stagger timer adds another while addrs remain, and a failed
+ * connect frees its slot for the next addr right away.
+ */
+static int start_connect(Loop *lp, Conn *c)
+{
+    struct itimerspec its;
+    int i, fd;
+
+    for(i = 0; i < CONNECT_RACE && c->racer[i].fd >= 0; i++)
+        ;
+    for(; i < CONNECT_RACE && c->addr; c->addr = c->addr->ai_next){
+        if((fd = connect_start(c->addr)) < 0)
+            continue;
+        c->racer[i].fd = fd;
+        c->raceaddr[i] = c->addr;
+        if(add_fd(lp, &c->racer[i], EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+            return STEP_CLOSE;
+        c->addr = c->addr->ai_next;
+        break;
+    }
+    if(c->addr){
+        if(c->timer.fd < 0){
+            if((c->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0){
+                unix_error("timerfd_create error");
+                return STEP_CLOSE;
+            }
+            if(add_fd(lp, &c->timer, EPOLLIN | EPOLLET) < 0)
+                return STEP_CLOSE;
+        }
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_nsec = CONNECT_STAGGER_MS * 1000000L;
+        timerfd_settime(c->timer.fd, 0, &its, NULL);
+    }
+    c->state = ST_CONNECT;
+    return STEP_NEXT;
+}
+
+static int do_connect(Loop *lp, Conn *c)
+{
+    uint64_t ticks;
+    int more = 0, active = 0;
+
+    // stagger timer fired
+    if(c->timer.fd >= 0 && read(c->timer.fd, &ticks, sizeof(ticks)) > 0)
+        more = 1;
+    for(int i = 0; i < CONNECT_RACE; i++){
+        if(c->racer[i].fd < 0)
+            continue;
+        // a second connect() reports the outcome of the first
+        if(connect(c->racer[i].fd, c->raceaddr[i]->ai_addr,
+                   c->raceaddr[i]->ai_addrlen) == 0 || errno == EISCONN){
+            // winner takes the server endpoint; the rest are dropped
+            if(move_fd(lp, &c->racer[i], &c->server,
+                       EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0)
+                return STEP_CLOSE;
+            end_race(c);
+            c->t_stage = stats_time(STAGE_CONNECT, c->t_stage);
+            c->state = ST_FWD;
+            return STEP_NEXT;
+        }
+        if(errno == EALREADY || errno == EINPROGRESS || errno == EINTR){
+            active++;
+            continue;
+        }
+        // failed; its slot goes to the next addr
+        ep_close(lp, &c->racer[i]);
+        more = 1;
+    }
+    if(c->addr && (more || !active))
+        return start_connect(lp, c);
+    // all connects failed
+    return active ? STEP_AGAIN : serve_stale(c);
+}
+
+/* close connects still racing and the stagger timer */
+static void end_race(Conn *c)
+{
+    for(int i = 0; i < CONNECT_RACE; i++)
+        ep_close(c->lp, &c->racer[i]);
+    ep_close(c->lp, &c->timer);
+}
+
+static int do_fwd(Conn *c)
+{
+    ssize_t n;
+
+    struct iovec *iov;
+
+    while(c->iovpos < c->iovcnt){
+        iov = c->iov + c->iovpos;
+        n = ev_io(&c->server, 1, iov, c->iovcnt - c->iovpos);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : serve_stale(c);
+        // skip fully written entries, trim a partial one
+        for(; c->iovpos < c->iovcnt && n >= iov->iov_len; iov++, c->iovpos++)
+            n -= iov->iov_len;
+        if(c->iovpos < c->iovcnt){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    c->outlen = c->outoff = 0;
+    c->objectlen = 0;
+    c->t_stage = stats_now();
+    c->state = ST_RELAY;
+    return STEP_NEXT;
+}
+
+static int do_relay(Conn *c)
+{
+    ssize_t n;
+
+    while(1){
+        // flush pending chunk to client first
+        while(c->outoff < c->outlen){
+            n = ev_write(&c->client, c->io->out + c->outoff, c->outlen - c->outoff);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0)
+                return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+            c->outoff += n;
+        }
+        // uncacheable; the rest bypasses user space
+        if(c->overflow && !c->disk)
+            return do_splice(c);
+        n = ev_read(&c->server, c->io->out, MAXBUF);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : serve_stale(c);
+        if(n == 0){
+            // server done; resp complete unless it ended before its hdrs
+            if(c->stale)
+                return serve_stale(c);
+            cache_resp(c);
+            return STEP_CLOSE;
+        }
+        if(!c->t_first)
+            c->t_first = stats_time(STAGE_FIRSTBYTE, c->t_stage);
+        stats_count(CNT_SERVER_BYTES, n);
+        c->outlen = n;
+        c->outoff = 0;
+        if(c->stale){
+            // held back until it is known not to be our 304
+            if(c->objectlen + n > MAXBUF)
+                return STEP_CLOSE;
+            c->outlen = 0;
+        }
+        if(c->disk && disk_append(c->disk, c->io->out, n) < 0){
+            disk_abort(c->disk);
+            c->disk = NULL;
+        }
+        if(!c->overflow){
+            if(c->objectlen + n > MAX_OBJECT_SIZE){
+                set_overflow(c);
+                continue;
+            }
+            memcpy(c->flight->buf + c->objectlen, c->io->out, n);
+            c->objectlen += n;
+            if(!c->hdrs_seen){
+                check_hdrs(c);
+                if(c->state != ST_RELAY)
+                    return STEP_NEXT;
+            }
+            else if(c->flight->framed)
+                flight_publish(c->flight, c->objectlen);
+        }
+    }
+}
+
+/* drop the cache copy; followers that haven't started refetch */
+static void set_overflow(Conn *c)
+{
+    c->overflow = 1;
+    c->objectlen = 0;
+    flight_finish(c->flight, FL_FAILED);
+}
+
+/*
+ * check_hdrs - once resp hdrs are in, strip them for the cache and
+ * publish the resp to followers, or give up on a resp whose
+ * Content-Length is already over MAX_OBJECT_SIZE; the disk tier may
+ * still take that one
+ */
+static void check_hdrs(Conn *c)
+{
+    char key[MAXLINE];
+    char *buf = c->flight->buf, *end;
+    size_t hdrlen;
+    ssize_t len;
+    RespInfo ri;
+    int rc;
+
+    for(end = buf; end + 4 <= buf + c->objectlen; end++)
+        if(!memcmp(end, "\r\n\r\n", 4))
+            break;
+    if(end + 4 > buf + c->objectlen)
+        return;
+    c->hdrs_seen = 1;
+    // terminate hdr block for parsing
+    end[2] = '\0';
+    rc = parse_resphdrs(buf, end + 2 - buf, &ri);
+    end[2] = '\r';
+    if(c->stale){
+        if(rc == 304 && c->stale->cond){
+            not_modified(c, end + 2 - buf);
+            return;
+        }
+        // a server error the stale copy may hide
+        if(rc >= 500 && cache_servable(c->stale, STALE_ERROR)){
+            stats_count(CNT_STALE_HITS, 1);
+            share_stale(c);
+            return;
+        }
+        // a new resp; let out what was held back
+        memcpy(c->io->out, buf, c->objectlen);
+        c->outlen = c->objectlen;
+        c->outoff = 0;
+        cache_release(c->stale);
+        c->stale = NULL;
+    }
+    if(rc < 0 || (len = strip_resp(buf, c->objectlen, &hdrlen)) < 0){
+        set_overflow(c);
+        return;
+    }
+    flight_hdrs(c->flight, hdrlen, ri.clen >= 0,
+                key_store(c->io->key, key, sizeof(key), buf, hdrlen, c->io->in,
+                          &c->io->head) == 0 ? key : NULL);
+    if(ri.clen > MAX_OBJECT_SIZE){
+        if(cache_expiry(buf, hdrlen) >= 0 &&
+           (c->disk = disk_reserve(hdrlen + 2 + ri.clen)) &&
+           disk_append(c->disk, buf, len) < 0){
+            disk_abort(c->disk);
+            c->disk = NULL;
+        }
+        set_overflow(c);
+        return;
+    }
+    c->objectlen = len;
+    // an unframed resp could still overflow with no way for followers
+    // to tell the body was cut; cache_resp publishes it whole
+    if(ri.clen >= 0)
+        flight_publish(c->flight, len);
+}
+
+/*
+ * not_modified - our revalidation got a 304 with hdrs of hdrlen bytes
+ * The stale copy is refreshed and sent as a hit.
+ */
+static void not_modified(Conn *c, size_t hdrlen)
+{
+    stats_count(CNT_NOT_MODIFIED, 1);
+    cache_refresh(c->stale, c->flight->buf, hdrlen);
+    share_stale(c);
+}
+
+/*
+ * serve_stale - the server failed before anything reached the client;
+ * answer from the stale copy if it may stand in for an error
+ */
+static int serve_stale(Conn *c)
+{
+    if(!c->stale || !cache_servable(c->stale, STALE_ERROR)){
+        stats_count(CNT_ERRORS, 1);
+        return STEP_CLOSE;
+    }
+    stats_count(CNT_STALE_HITS, 1);
+    end_race(c);
+    share_stale(c);
+    return STEP_NEXT;
+}
+
+/*
+ * share_stale - publish the stale copy to followers and send it as a hit
+ */
+static void share_stale(Conn *c)
+{
+    char key[MAXLINE];
+    Flight *f = c->flight;
+    CacheObject *obj = c->stale;
+    size_t n;
+
+    // followers stream plain bytes, so a gzipped copy is inflated
+    if((n = cache_copy(obj, f->buf))){
+        flight_hdrs(f, obj->hdrlen, obj->framed,
+                    key_store(c->io->key, key, sizeof(key), f->buf, obj->hdrlen,
+                              c->io->in, &c->io->head) == 0 ? key : NULL);
+        flight_publish(f, n);
+    }
+    flight_finish(f, n ? FL_DONE : FL_FAILED);
+    ep_close(c->lp, &c->server);
+    c->hit = obj;
+    c->stale = NULL;
+    c->outoff = 0;
+    c->state = ST_HIT;
+}
+
+/*
+ * do_splice - relay the rest of an uncacheable resp through a pipe
+ */
+static int do_splice(Conn *c)
+{
+    ssize_t n;
+
+    if(c->pipefd[0] < 0 && zc_pipe(c->pipefd) < 0)
+        return STEP_CLOSE;
+    while(1){
+        while(c->inpipe > 0){
+            n = zc_splice_out(c->pipefd[0], c->client.fd, c->inpipe);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0)
+                return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+            c->inpipe -= n;
+        }
+        n = zc_splice_in(c->server.fd, c->pipefd[1], ZC_CHUNK);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        if(n == 0)
+            return STEP_CLOSE;  // server done
+        stats_count(CNT_SERVER_BYTES, n);
+        c->inpipe += n;
+    }
+}
+
+/*
+ * cache_resp - cache a complete close-delimited resp and end its flight
+ */
+static void cache_resp(Conn *c)
+{
+    char key[MAXLINE];
+    Flight *f = c->flight;
+
+    // a Vary'd resp goes under the variant key for this req
+    if(c->disk){
+        if(key_store(c->io->key, key, sizeof(key), disk_slotdata(c->disk), f->hdrlen,
+                     c->io->in, &c->io->head) < 0)
+            disk_abort(c->disk);
+        else
+            disk_commit(c->disk, key, cache_hash(key), f->hdrlen, 1);
+        c->disk = NULL;
+    }
+    if(c->overflow || !c->hdrs_seen){
+        flight_finish(f, FL_FAILED);
+        return;
+    }
+    if(key_store(c->io->key, key, sizeof(key), f->buf, f->hdrlen, c->io->in, &c->io->head) == 0)
+        cache_add(key, cache_hash(key), f->buf, c->objectlen, f->hdrlen, f->framed);
+    if(!f->framed)
+        flight_publish(f, c->objectlen);
+    flight_finish(f, FL_DONE);
+}
+
+/*
+ * do_hit - stored hdrs, the hdrs cache_hithdrs adds, then the body
+ * A gzipped object's body goes out as stored if the client accepts
+ * gzip; otherwise it is inflated once into c->plain.
+ */
+static int do_hit(Conn *c)
+{
+    CacheObject *obj = c->hit;
+    struct iovec iov[3], *v;
+    size_t total, skip;
+    int cnt;
+    ssize_t n;
+
+    if(!c->hitready){
+        // the conn closes after every reply; an HTTP/1.1 client
+        // would take a hit without a Connection hdr as persistent
+        c->outlen = sprintf(c->io->out, "Connection: close\r\n");
+        c->outlen += cache_hithdrs(obj, c->gzip, c->io->out + c->outlen);
+        if(obj->rawlen && !c->gzip && !c->nobody &&
+           !(c->plain = cache_inflate(obj, &c->plainlen)))
+            return STEP_CLOSE;
+        c->hitready = 1;
+    }
+    iov[0].iov_base = obj->data;
+    iov[0].iov_len = obj->hdrlen;
+    iov[1].iov_base = c->io->out;
+    iov[1].iov_len = c->outlen;
+    iov[2].iov_base = c->plain ? c->plain : obj->data + obj->hdrlen;
+    iov[2].iov_len = c->plain ? c->plainlen : obj->len - obj->hdrlen;
+    // the body starts with the blank line ending the hdrs
+    if(c->nobody)
+        iov[2].iov_len = 2;
+    total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    while(c->outoff < total){
+        // skip what earlier writes took
+        for(v = iov, cnt = 3, skip = c->outoff; skip >= v->iov_len; v++, cnt--)
+            skip -= v->iov_len;
+        v->iov_base = (char *)v->iov_base + skip;
+        v->iov_len -= skip;
+        n = ev_io(&c->client, 1, v, cnt);
+        v->iov_base = (char *)v->iov_base - skip;
+        v->iov_len += skip;
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        c->outoff += n;
+    }
+    stats_count(CNT_HIT_BYTES, total);
+    if(c->io->head.done)
+        return STEP_CLOSE;
+    c->state = ST_DRAIN;
+    return STEP_NEXT;
+}
+
+/*
+ * do_diskhit - stripped hdrs from the mmap and the hdrs a RAM hit would
+ * add, then the body by sendfile unless this is a HEAD
+ */
+static int do_diskhit(Conn *c)
+{
+    size_t hdrend = c->dref.hdrlen + 2;
+    size_t end = c->nobody ? hdrend : c->dref.len;
+    size_t head, total, skip, pos;
+    struct iovec iov[3], *v;
+    int cnt;
+    ssize_t n;
+
+    if(!c->hitready){
+        // the conn closes after the reply, as with a RAM hit
+        c->outlen = sprintf(c->io->out, "Connection: close\r\n");
+        if(!c->dref.framed)
+            c->outlen += sprintf(c->io->out + c->outlen, "Content-Length: %zu\r\n",
+                                 c->dref.len - hdrend);
+        c->hitready = 1;
+    }
+    iov[0].iov_base = c->dref.data;
+    iov[0].iov_len = c->dref.hdrlen;
+    iov[1].iov_base = c->io->out;
+    iov[1].iov_len = c->outlen;
+    iov[2].iov_base = c->dref.data + c->dref.hdrlen;
+    iov[2].iov_len = 2;
+    head = hdrend + c->outlen;
+    total = end + c->outlen;
+    while(c->outoff < total){
+        if(c->outoff < head){
+            // skip what earlier writes took
+            for(v = iov, cnt = 3, skip = c->outoff; skip >= v->iov_len; v++, cnt--)
+                skip -= v->iov_len;
+            v->iov_base = (char *)v->iov_base + skip;
+            v->iov_len -= skip;
+            n = ev_io(&c->client, 1, v, cnt);
+            v->iov_base = (char *)v->iov_base - skip;
+            v->iov_len += skip;
+            if(n > 0)
+                c->outoff += n;
+        }
+        else{
+            // body offsets in the object are outlen behind ours
+            pos = c->outoff - c->outlen;
+            if((n = disk_sendfile(c->client.fd, &c->dref, &pos)) > 0)
+                c->outoff = pos + c->outlen;
+        }
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        if(n == 0)
+            return STEP_CLOSE;
+    }
+    stats_count(CNT_HIT_BYTES, total);
+    return STEP_CLOSE;
+}
+
+/*
+ * start_follow - wait on another conn's fetch instead of our own
+ */
+static int start_follow(Loop *lp, Conn *c)
+{
+    if(conn_wake(lp, c) < 0){
+        // not ours to fail
+        flight_release(c->flight);
+        c->flight = NULL;
+        return STEP_CLOSE;
+    }
+    flight_watch(c->flight, c->wake.fd);
+    c->outoff = 0;
+    c->state = ST_FOLLOW;
+    return STEP_NEXT;
+}
+
+static void stop_follow(Conn *c)
+{
+    flight_unwatch(c->flight, c->wake.fd);
+    flight_release(c->flight);
+    c->flight = NULL;
+}
+
+/*
+ * do_follow - write whatever the leader published so far
+ */
+static int do_follow(Conn *c)
+{
+    Flight *f = c->flight;
+    uint64_t kicks;
+    size_t len;
+    ssize_t n;
+    int state;
+
+    // drain first, so a publish after the snapshot kicks us again
+    if(read(c->wake.fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN)
+        return STEP_CLOSE;
+    state = flight_wait(c->flight, 0, &len, 0);
+    // (a queued first write may have sent some already)
+    if(c->outoff == 0 && !c->client.busy && !c->client.done &&
+       (state == FL_FAILED || (state == FL_DONE && len == 0) ||
+        (len && !key_shares(f->store, c->io->key, f->buf, f->hdrlen, c->io->in,
+                            &c->io->head)))){
+        // nothing sent yet, or the leader got a variant other than
+        // ours; redo the req with a fetch of our own
+        stop_follow(c);
+        c->solo = 1;
+        c->looked = 0;
+        c->state = ST_REQ;
+        return STEP_NEXT;
+    }
+    if(state == FL_FAILED)
+        return STEP_CLOSE;
+    while(c->outoff < len){
+        n = ev_write(&c->client, c->flight->buf + c->outoff, len - c->outoff);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        c->outoff += n;
+    }
+    return state == FL_DONE ? STEP_CLOSE : STEP_AGAIN;
+}
+
+static int do_reply(Conn *c)
+{
+    ssize_t n;
+
+    while(c->outoff < c->outlen){
+        n = ev_write(&c->client, c->io->out + c->outoff, c->outlen - c->outoff);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno == EAGAIN ? STEP_AGAIN : STEP_CLOSE;
+        c->outoff += n;
+    }
+    return STEP_CLOSE;
+}
@@ -0,0 +1,23 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+
+/* Max events handled per epoll_wait() */
+#define MAX_EVENTS 256
+
+/* epoll_wait timeout, so loops poll the stats flag */
+#define EVENT_TICK_MS 1000
+
+/* What a loop waits on */
+#define EV_EPOLL 0
+#define EV_URING 1      // falls back to epoll if the kernel lacks it
+
+/*
+ * Event-driven service: nloops threads over nlisten listening
+ * sockets, loop i taking listenfds[i % nlisten]. With pin, the loops
+ * of a listener group run on that group's core.
+ */
+void event_run(int *listenfds, int nlisten, int nloops, int pin, int backend);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * flight.c - single-flight collapsing of concurrent misses
+ *
+ * The first miss on a url becomes the leader of a flight and owns the
+ * upstream fetch. Misses on the same url that arrive while it runs
+ * join as followers and stream the resp out of the leader's buffer as
+ * it fills, so a burst of identical cold reqs costs one server fetch
+ * and at most one cache insert.
+ */
+#include "flight.h"
+
+static Flight *buckets[FLIGHT_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* wake waiters after len or state changed; caller holds f->mutex */
+static void kick(Flight *f)
+{
+    uint64_t one = 1;
+
+    pthread_cond_broadcast(&f->cond);
+    for(FlightWaiter *w = f->waiters; w; w = w->next)
+        if(write(w->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            unix_error("flight kick error");
+}
+
+void flight_init()
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+/*
+ * flight_new - a flight nobody else can join, for a solo fetch
+ */
+Flight *flight_new(char *url, unsigned long hash)
+{
+    Flight *f = (Flight *)Malloc(sizeof(Flight));
+
+    f->url = (char *)Malloc(strlen(url) + 1);
+    strcpy(f->url, url);
+    f->hash = hash;
+    f->buf = (char *)Malloc(MAX_OBJECT_SIZE);
+    f->len = f->hdrlen = 0;
+    f->framed = 0;
+    f->store = NULL;
+    f->state = FL_RUNNING;
+    f->refcnt = 1;
+    f->listed = 0;
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->waiters = NULL;
+    f->next = NULL;
+    return f;
+}
+
+/*
+ * flight_join - attach to the running fetch of url, or start one
+ * *leader is set if the caller must fetch and fill the flight.
+ */
+Flight *flight_join(char *url, unsigned long hash, int *leader)
+{
+    Flight *f;
+    unsigned b = hash % FLIGHT_BUCKETS;
+
+    pthread_mutex_lock(&lock);
+    for(f = buckets[b]; f; f = f->next){
+        if(f->hash == hash && !strcmp(f->url, url)){
+            // listed flights still hold their leader's ref
+            __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&lock);
+            *leader = 0;
+            return f;
+        }
+    }
+    f = flight_new(url, hash);
+    f->listed = 1;
+    f->next = buckets[b];
+    buckets[b] = f;
+    pthread_mutex_unlock(&lock);
+    *leader = 1;
+    return f;
+}
+
+/*
+ * flight_hdrs - record hdr layout; leader calls it before publishing
+ * store is the key the resp is cached under, or NULL if it has none.
+ * With a Vary hdr it is the leader's variant, and followers whose own
+ * differs fetch on their own.
+ */
+void flight_hdrs(Flight *f, size_t hdrlen, int framed, char *store)
+{
+    f->hdrlen = hdrlen;
+    f->framed = framed;
+    free(f->store);
+    f->store = NULL;
+    if(store){
+        f->store = (char *)Malloc(strlen(store) + 1);
+        strcpy(f->store, store);
+    }
+}
+
+/*
+ * flight_publish - make buf[0..len) visible to followers
+ */
+void flight_publish(Flight *f, size_t len)
+{
+    pthread_mutex_lock(&f->mutex);
+    f->len = len;
+    kick(f);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/*
+ * flight_finish - end the flight as FL_DONE or FL_FAILED
+ * New misses stop joining it; later calls are no-ops.
+ */
+void flight_finish(Flight *f, int state)
+{
+    Flight **pp;
+
+    if(f->listed){
+        pthread_mutex_lock(&lock);
+        for(pp = &buckets[f->hash % FLIGHT_BUCKETS]; *pp != f; pp = &(*pp)->next)
+            ;
+        *pp = f->next;
+        f->listed = 0;
+        pthread_mutex_unlock(&lock);
+    }
+    pthread_mutex_lock(&f->mutex);
+    if(f->state == FL_RUNNING){
+        f->state = state;
+        kick(f);
+    }
+    pthread_mutex_unlock(&f->mutex);
+}
+
+/*
+ * flight_wait - current state, with the published length in *len
+ * If block is set, first waits until more than seen bytes are
+ * published or the flight ended.
+ */
+int flight_wait(Flight *f, size_t seen, size_t *len, int block)
+{
+    int state;
+
+    pthread_mutex_lock(&f->mutex);
+    while(block && f->len <= seen && f->state == FL_RUNNING)
+        pthread_cond_wait(&f->cond, &f->mutex);
+    *len = f->len;
+    state = f->state;
+    pthread_mutex_unlock(&f->mutex);
+    return state;
+}
+
+/*
+ * flight_watch - have efd kicked on every change, for event loops
+ */
+void flight_watch(Flight *f, int efd)
+{
+    FlightWaiter *w = (FlightWaiter *)Malloc(sizeof(FlightWaiter));
+
+    w->fd = efd;
+    pthread_mutex_lock(&f->mutex);
+    w->next = f->waiters;
+    f->waiters = w;
+    pthread_mutex_unlock(&f->mutex);
+}
+
+void flight_unwatch(Flight *f, int efd)
+{
+    FlightWaiter **pp, *w = NULL;
+
+    pthread_mutex_lock(&f->mutex);
+    for(pp = &f->waiters; *pp; pp = &(*pp)->next){
+        if((*pp)->fd == efd){
+            w = *pp;
+            *pp = w->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&f->mutex);
+    free(w);
+}
+
+void flight_release(Flight *f)
+{
+    if(__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    pthread_mutex_destroy(&f->mutex);
+    pthread_cond_destroy(&f->cond);
+    free(f->buf);
+    free(f->store);
+    free(f->url);
+    free(f);
+}
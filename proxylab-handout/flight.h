@@ -0,0 +1,54 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* In-flight fetches, keyed by url like the cache */
+#define FLIGHT_BUCKETS 64
+
+/* Flight states */
+#define FL_RUNNING 0
+#define FL_DONE    1    // buf holds the whole resp
+#define FL_FAILED  2    // fetch broke or resp was too big to share
+
+typedef struct FlightWaiter {
+    int fd;                     // eventfd kicked on every publish
+    struct FlightWaiter *next;
+} FlightWaiter;
+
+/*
+ * One upstream fetch shared by every miss on the same url. Only the
+ * leader writes buf, laid out like CacheObject data; bytes below len
+ * never change once published, so followers read them without the
+ * lock and stream them out at their own pace.
+ */
+typedef struct Flight {
+    char *url;
+    unsigned long hash;
+    char *buf;              // MAX_OBJECT_SIZE bytes
+    size_t len;             // published prefix of buf; 0 until hdrs are in
+    size_t hdrlen;          // hdrs without the blank line
+    int framed;             // hdrs carry Content-Length
+    char *store;            // key the leader stores the resp under, or NULL
+    int state;
+    int refcnt;             // leader and followers
+    int listed;             // still joinable
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    // thread-mode followers wait here
+    FlightWaiter *waiters;  // event-mode followers
+    struct Flight *next;    // table chain
+} Flight;
+
+void flight_init();
+Flight *flight_join(char *url, unsigned long hash, int *leader);
+Flight *flight_new(char *url, unsigned long hash);
+void flight_hdrs(Flight *f, size_t hdrlen, int framed, char *store);
+void flight_publish(Flight *f, size_t len);
+void flight_finish(Flight *f, int state);
+int flight_wait(Flight *f, size_t seen, size_t *len, int block);
+void flight_watch(Flight *f, int efd);
+void flight_unwatch(Flight *f, int efd);
+void flight_release(Flight *f);
+
+#endif
@@ -0,0 +1,737 @@
+/*
+ * gzip.c - gzip codec for cached bodies
+ *
+ * The cache compresses text bodies once, when they are added, and
+ * inflates them only for clients that do not accept gzip. Both sides
+ * work on whole buffers, which at MAX_OBJECT_SIZE is never much.
+ */
+#include "gzip.h"
+
+#define WINDOW 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define TOO_FAR 4096        /* a 3-byte match further back costs more than it saves */
+#define MAX_BITS 15         /* longest lit/len or dist code */
+#define MAX_CL_BITS 7       /* longest code length code */
+#define NLITLEN 286
+#define NDIST 30
+#define NCL 19
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+/* order the code length code lengths are sent in */
+static const uint8_t cl_order[NCL] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* An LZ77 token: literal byte len if dist is 0, else a match */
+typedef struct {
+    uint16_t len;
+    uint16_t dist;
+} Token;
+
+/* Hash chains over the whole input */
+typedef struct {
+    unsigned char *in;
+    size_t len;
+    int hashbits;           // sized to the input, up to GZIP_HASH_BITS
+    int32_t *head;          // newest position per hash, -1 if none
+    int32_t *prev;          // next older position with the same hash
+} Matcher;
+
+/* LSB-first bit writer; len past cap means the output did not fit */
+typedef struct {
+    unsigned char *out;
+    size_t cap;
+    size_t len;
+    uint64_t bits;
+    int nbits;
+} BitOut;
+
+/* LSB-first bit reader; reads past the end yield zeros and move pos on */
+typedef struct {
+    unsigned char *in;
+    size_t len;
+    size_t pos;
+    uint64_t bits;
+    int nbits;
+} BitIn;
+
+/* Canonical decoding tables for one code */
+typedef struct {
+    uint16_t fast[1 << GZIP_FAST_BITS]; // len << 9 | symbol, 0 if longer
+    uint16_t count[MAX_BITS + 1];       // codes of each length
+    uint16_t symbol[NLITLEN + 2];       // by code, shortest first
+} Huff;
+
+static void crc_init()
+{
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc_of(unsigned char *p, size_t n)
+{
+    uint32_t c = 0xffffffff;
+
+    pthread_once(&crc_once, crc_init);
+    while(n--)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffff;
+}
+
+static uint32_t reverse(uint32_t code, int n)
+{
+    uint32_t r = 0;
+
+    while(n--){
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+/******************
+ * Compression
+ ******************/
+
+static inline uint32_t hash3(unsigned char *p, int bits)
+{
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761U) >> (32 - bits);
+}
+
+static void insert(Matcher *m, size_t i)
+{
+    uint32_t h;
+
+    if(i + MIN_MATCH > m->len)
+        return;
+    h = hash3(m->in + i, m->hashbits);
+    m->prev[i] = m->head[h];
+    m->head[h] = i;
+}
+
+/* common prefix of a and b, up to max bytes, a word at a time */
+static int match_len(unsigned char *a, unsigned char *b, int max)
+{
+    uint64_t x, y;
+    int n = 0;
+
+    while(n + 8 <= max){
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if(x != y){
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return n + (__builtin_clzll(x ^ y) >> 3);
+#else
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+#endif
+        }
+        n += 8;
+    }
+    while(n < max && a[n] == b[n])
+        n++;
+    return n;
+}
+
+/*
+ * find_match - longest earlier match for position i, which is added
+ * to the chains. Returns its length and sets *dist, or returns 0.
+ */
+static int find_match(Matcher *m, size_t i, int *dist)
+{
+    unsigned char *p = m->in + i, *q;
+    int max = m->len - i < MAX_MATCH ? m->len - i : MAX_MATCH;
+    int best = MIN_MATCH - 1, chain = GZIP_CHAIN, n;
+    int32_t cand;
+
+    if(max < MIN_MATCH)
+        return 0;
+    cand = m->head[hash3(p, m->hashbits)];
+    insert(m, i);
+    for(; cand >= 0 && i - cand <= WINDOW && chain-- > 0; cand = m->prev[cand]){
+        q = m->in + cand;
+        // the byte that would make it longer is the likeliest miss
+        if(q[best] != p[best] || q[0] != p[0])
+            continue;
+        if((n = match_len(p, q, max)) > best){
+            best = n;
+            *dist = i - cand;
+            if(n >= GZIP_NICE)
+                break;
+        }
+    }
+    if(best < MIN_MATCH || (best == MIN_MATCH && *dist > TOO_FAR))
+        return 0;
+    return best;
+}
+
+/*
+ * build_lengths - Huffman code lengths for freq[0..n), none over
+ * maxbits; unused symbols get 0. A code always has two symbols, so it
+ * is complete. Too deep a tree is rebuilt from flattened frequencies.
+ */
+static void build_lengths(uint32_t *freq, int n, int maxbits, uint8_t *lens)
+{
+    uint32_t f[NLITLEN], w[2 * NLITLEN];
+    int leaves[NLITLEN], parent[2 * NLITLEN], depth[2 * NLITLEN];
+    int nleaf, nnode, li, ni, a, b, max, used = 0;
+
+    memcpy(f, freq, n * sizeof(uint32_t));
+    for(int i = 0; i < n; i++)
+        used += f[i] != 0;
+    for(int i = 0; used < 2; i++){
+        if(!f[i]){
+            f[i] = 1;
+            used++;
+        }
+    }
+
+    while(1){
+        // leaves by weight are nodes 0..nleaf-1, internal nodes follow
+        nleaf = 0;
+        for(int i = 0; i < n; i++){
+            if(!f[i])
+                continue;
+            for(a = nleaf++; a > 0 && f[leaves[a - 1]] > f[i]; a--)
+                leaves[a] = leaves[a - 1];
+            leaves[a] = i;
+        }
+        for(int i = 0; i < nleaf; i++)
+            w[i] = f[leaves[i]];
+        // internal nodes come out in weight order, so two queues do
+        for(nnode = nleaf, li = 0, ni = nleaf; nnode < 2 * nleaf - 1; nnode++){
+            a = li < nleaf && (ni >= nnode || w[li] <= w[ni]) ? li++ : ni++;
+            b = li < nleaf && (ni >= nnode || w[li] <= w[ni]) ? li++ : ni++;
+            w[nnode] = w[a] + w[b];
+            parent[a] = parent[b] = nnode;
+        }
+        depth[nnode - 1] = 0;
+        max = 0;
+        for(int i = nnode - 2; i >= 0; i--){
+            depth[i] = depth[parent[i]] + 1;
+            if(depth[i] > max)
+                max = depth[i];
+        }
+        if(max <= maxbits)
+            break;
+        for(int i = 0; i < n; i++)
+            if(f[i])
+                f[i] = (f[i] >> 1) | 1;
+    }
+    memset(lens, 0, n);
+    for(int i = 0; i < nleaf; i++)
+        lens[leaves[i]] = depth[i];
+}
+
+/* canonical codes for lens, bit-reversed for the LSB-first writer */
+static void build_codes(uint8_t *lens, int n, uint16_t *codes)
+{
+    int count[MAX_BITS + 1] = { 0 }, next[MAX_BITS + 1], code = 0;
+
+    for(int i = 0; i < n; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+    for(int bits = 1; bits <= MAX_BITS; bits++){
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for(int i = 0; i < n; i++)
+        if(lens[i])
+            codes[i] = reverse(next[lens[i]]++, lens[i]);
+}
+
+static int len_code(int len)
+{
+    int i = 28;
+
+    while(len_base[i] > len)
+        i--;
+    return i;
+}
+
+static int dist_code(int dist)
+{
+    int i = 29;
+
+    while(dist_base[i] > dist)
+        i--;
+    return i;
+}
+
+static void put_bits(BitOut *b, uint32_t v, int n)
+{
+    b->bits |= (uint64_t)v << b->nbits;
+    b->nbits += n;
+    while(b->nbits >= 8){
+        if(b->len < b->cap)
+            b->out[b->len] = b->bits;
+        b->len++;
+        b->bits >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+/*
+ * put_header - the dynamic block hdr: code lengths for both codes,
+ * run-length coded and sent with their own code
+ */
+static void put_header(BitOut *b, uint8_t *litlens, uint8_t *distlens)
+{
+    static const uint8_t rle_extra[3] = { 2, 3, 7 };
+    uint8_t all[NLITLEN + NDIST], syms[NLITLEN + NDIST], extra[NLITLEN + NDIST];
+    uint8_t cllens[NCL];
+    uint16_t clcodes[NCL];
+    uint32_t clfreq[NCL] = { 0 };
+    int hlit = NLITLEN, hdist = NDIST, hclen = NCL, total, nsyms = 0, run, k, j;
+
+    while(hlit > 257 && !litlens[hlit - 1])
+        hlit--;
+    while(hdist > 1 && !distlens[hdist - 1])
+        hdist--;
+    memcpy(all, litlens, hlit);
+    memcpy(all + hlit, distlens, hdist);
+    total = hlit + hdist;
+
+    // 16 repeats the last length 3-6 times, 17 and 18 give runs of zeros
+    for(int i = 0; i < total; i = j){
+        for(j = i + 1; j < total && all[j] == all[i]; j++)
+            ;
+        run = j - i;
+        if(all[i] == 0){
+            for(; run >= 11; run -= k){
+                k = run < 138 ? run : 138;
+                syms[nsyms] = 18;
+                extra[nsyms++] = k - 11;
+            }
+            if(run >= 3){
+                syms[nsyms] = 17;
+                extra[nsyms++] = run - 3;
+                run = 0;
+            }
+        }
+        else{
+            syms[nsyms++] = all[i];
+            for(run--; run >= 3; run -= k){
+                k = run < 6 ? run : 6;
+                syms[nsyms] = 16;
+                extra[nsyms++] = k - 3;
+            }
+        }
+        while(run-- > 0)
+            syms[nsyms++] = all[i];
+    }
+    for(int i = 0; i < nsyms; i++)
+        clfreq[syms[i]]++;
+    build_lengths(clfreq, NCL, MAX_CL_BITS, cllens);
+    build_codes(cllens, NCL, clcodes);
+    while(hclen > 4 && !cllens[cl_order[hclen - 1]])
+        hclen--;
+
+    put_bits(b, hlit - 257, 5);
+    put_bits(b, hdist - 1, 5);
+    put_bits(b, hclen - 4, 4);
+    for(int i = 0; i < hclen; i++)
+        put_bits(b, cllens[cl_order[i]], 3);
+    for(int i = 0; i < nsyms; i++){
+        put_bits(b, clcodes[syms[i]], cllens[syms[i]]);
+        if(syms[i] >= 16)
+            put_bits(b, extra[i], rle_extra[syms[i] - 16]);
+    }
+}
+
+/*
+ * gzip_compress - gzip len bytes of in into out
+ * Returns the gzip length, or 0 if it does not fit in cap bytes.
+ */
+size_t gzip_compress(char *in, size_t len, char *out, size_t cap)
+{
+    static const unsigned char gzhdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    uint32_t litfreq[NLITLEN] = { 0 }, distfreq[NDIST] = { 0 };
+    uint8_t litlens[NLITLEN], distlens[NDIST];
+    uint16_t litcodes[NLITLEN], distcodes[NDIST];
+    int cur, curdist = 0, prevlen = 0, prevdist = 0, avail = 0, c;
+    size_t ntok = 0, i, j, end;
+    unsigned char *p = (unsigned char *)in;
+    Matcher m;
+    Token *toks, *t;
+    BitOut b;
+
+    if(cap < sizeof(gzhdr) + 8 || len > 0xffffffffU)
+        return 0;
+    m.in = p;
+    m.len = len;
+    // about a bucket per input byte; clearing more is wasted on small bodies
+    for(m.hashbits = 8; m.hashbits < GZIP_HASH_BITS && (1UL << m.hashbits) < len; m.hashbits++)
+        ;
+    m.head = (int32_t *)Malloc((1 << m.hashbits) * sizeof(int32_t));
+    m.prev = (int32_t *)Malloc((len + 1) * sizeof(int32_t));
+    toks = (Token *)Malloc((len + 1) * sizeof(Token));
+    memset(m.head, 0xff, (1 << m.hashbits) * sizeof(int32_t));
+
+    // a match is held back a byte in case the next one is longer
+    for(i = 0; i < len; ){
+        if(avail && prevlen >= GZIP_LAZY){
+            insert(&m, i);
+            cur = 0;
+        }
+        else
+            cur = find_match(&m, i, &curdist);
+        if(avail && prevlen >= MIN_MATCH && cur <= prevlen){
+            toks[ntok].len = prevlen;
+            toks[ntok++].dist = prevdist;
+            end = i - 1 + prevlen;
+            for(j = i + 1; j < end; j++)
+                insert(&m, j);
+            i = end;
+            avail = 0;
+            prevlen = 0;
+            continue;
+        }
+        if(avail){
+            toks[ntok].len = p[i - 1];
+            toks[ntok++].dist = 0;
+        }
+        prevlen = cur;
+        prevdist = curdist;
+        avail = 1;
+        i++;
+    }
+    if(avail){
+        toks[ntok].len = p[len - 1];
+        toks[ntok++].dist = 0;
+    }
+    free(m.head);
+    free(m.prev);
+
+    for(t = toks; t < toks + ntok; t++){
+        if(t->dist){
+            litfreq[257 + len_code(t->len)]++;
+            distfreq[dist_code(t->dist)]++;
+        }
+        else
+            litfreq[t->len]++;
+    }
+    litfreq[256]++;
+    build_lengths(litfreq, NLITLEN, MAX_BITS, litlens);
+    build_lengths(distfreq, NDIST, MAX_BITS, distlens);
+    build_codes(litlens, NLITLEN, litcodes);
+    build_codes(distlens, NDIST, distcodes);
+
+    // one final dynamic block
+    memcpy(out, gzhdr, sizeof(gzhdr));
+    b.out = (unsigned char *)out;
+    b.cap = cap;
+    b.len = sizeof(gzhdr);
+    b.bits = 0;
+    b.nbits = 0;
+    put_bits(&b, 1, 1);
+    put_bits(&b, 2, 2);
+    put_header(&b, litlens, distlens);
+    for(t = toks; t < toks + ntok && b.len <= cap; t++){
+        if(!t->dist){
+            put_bits(&b, litcodes[t->len], litlens[t->len]);
+            continue;
+        }
+        c = len_code(t->len);
+        put_bits(&b, litcodes[257 + c], litlens[257 + c]);
+        put_bits(&b, t->len - len_base[c], len_extra[c]);
+        c = dist_code(t->dist);
+        put_bits(&b, distcodes[c], distlens[c]);
+        put_bits(&b, t->dist - dist_base[c], dist_extra[c]);
+    }
+    free(toks);
+    put_bits(&b, litcodes[256], litlens[256]);
+    if(b.nbits)
+        put_bits(&b, 0, 8 - b.nbits);
+    put_bits(&b, crc_of(p, len), 32);
+    put_bits(&b, len, 32);
+    return b.len <= cap ? b.len : 0;
+}
+
+/******************
+ * Decompression
+ ******************/
+
+/* make n bits available */
+static inline void need(BitIn *b, int n)
+{
+    while(b->nbits < n){
+        if(b->pos < b->len)
+            b->bits |= (uint64_t)b->in[b->pos] << b->nbits;
+        b->pos++;
+        b->nbits += 8;
+    }
+}
+
+static inline uint32_t get_bits(BitIn *b, int n)
+{
+    uint32_t v;
+
+    if(n == 0)
+        return 0;
+    need(b, n);
+    v = b->bits & ((1U << n) - 1);
+    b->bits >>= n;
+    b->nbits -= n;
+    return v;
+}
+
+/* past the end of the input, counting only bytes taken from the buffer */
+static inline int overrun(BitIn *b)
+{
+    return b->pos - b->nbits / 8 > b->len;
+}
+
+/*
+ * build_huff - decoding tables for code lengths lens[0..n)
+ * Returns -1 if the lengths over-subscribe the code space.
+ */
+static int build_huff(Huff *h, uint8_t *lens, int n)
+{
+    uint16_t offs[MAX_BITS + 2];
+    int left = 1, code = 0, idx = 0;
+
+    memset(h->count, 0, sizeof(h->count));
+    for(int i = 0; i < n; i++)
+        h->count[lens[i]]++;
+    h->count[0] = 0;
+    for(int len = 1; len <= MAX_BITS; len++){
+        left = (left << 1) - h->count[len];
+        if(left < 0)
+            return -1;
+    }
+    offs[1] = 0;
+    for(int len = 1; len <= MAX_BITS; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for(int i = 0; i < n; i++)
+        if(lens[i])
+            h->symbol[offs[lens[i]]++] = i;
+
+    // every table slot whose low bits are a short code maps to it
+    memset(h->fast, 0, sizeof(h->fast));
+    for(int len = 1; len <= GZIP_FAST_BITS; len++){
+        for(int k = 0; k < h->count[len]; k++, code++, idx++){
+            for(uint32_t fill = reverse(code, len); fill < (1 << GZIP_FAST_BITS);
+                fill += 1 << len)
+                h->fast[fill] = len << 9 | h->symbol[idx];
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+/* next symbol of code h, or -1 for a bit pattern that is no code */
+static int decode(BitIn *b, Huff *h)
+{
+    int e, code = 0, first = 0, index = 0, count;
+
+    need(b, MAX_BITS);
+    if((e = h->fast[b->bits & ((1 << GZIP_FAST_BITS) - 1)])){
+        b->bits >>= e >> 9;
+        b->nbits -= e >> 9;
+        return e & 511;
+    }
+    // a long code: walk the canonical code a bit at a time
+    for(int len = 1; len <= MAX_BITS; len++){
+        code |= b->bits & 1;
+        b->bits >>= 1;
+        b->nbits--;
+        count = h->count[len];
+        if(code - count < first)
+            return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+/* code length tables sent ahead of a dynamic block */
+static int read_dynamic(BitIn *b, Huff *lit, Huff *dist)
+{
+    uint8_t lens[NLITLEN + NDIST], cl[NCL] = { 0 }, val;
+    int hlit, hdist, hclen, sym, rep;
+    Huff clh;
+
+    hlit = get_bits(b, 5) + 257;
+    hdist = get_bits(b, 5) + 1;
+    hclen = get_bits(b, 4) + 4;
+    if(hlit > NLITLEN || hdist > NDIST)
+        return -1;
+    for(int i = 0; i < hclen; i++)
+        cl[cl_order[i]] = get_bits(b, 3);
+    if(build_huff(&clh, cl, NCL) < 0)
+        return -1;
+    for(int i = 0; i < hlit + hdist; ){
+        if((sym = decode(b, &clh)) < 0)
+            return -1;
+        if(sym < 16){
+            lens[i++] = sym;
+            continue;
+        }
+        if(sym == 16){
+            if(i == 0)
+                return -1;
+            val = lens[i - 1];
+            rep = 3 + get_bits(b, 2);
+        }
+        else{
+            val = 0;
+            rep = sym == 17 ? 3 + get_bits(b, 3) : 11 + get_bits(b, 7);
+        }
+        if(i + rep > hlit + hdist)
+            return -1;
+        while(rep--)
+            lens[i++] = val;
+    }
+    if(!lens[256] || overrun(b))
+        return -1;
+    if(build_huff(lit, lens, hlit) < 0 || build_huff(dist, lens + hlit, hdist) < 0)
+        return -1;
+    return 0;
+}
+
+static void fixed_tables(Huff *lit, Huff *dist)
+{
+    uint8_t lens[NLITLEN + 2];
+    int i;
+
+    for(i = 0; i < 144; i++)
+        lens[i] = 8;
+    for(; i < 256; i++)
+        lens[i] = 9;
+    for(; i < 280; i++)
+        lens[i] = 7;
+    for(; i < NLITLEN + 2; i++)
+        lens[i] = 8;
+    build_huff(lit, lens, NLITLEN + 2);
+    memset(lens, 5, NDIST);
+    build_huff(dist, lens, NDIST);
+}
+
+/* raw deflate stream in b into out; returns its length or -1 */
+static ssize_t inflate(BitIn *b, unsigned char *out, size_t cap)
+{
+    Huff lit, dist;
+    size_t n = 0, len, d;
+    int final, type, sym;
+
+    do{
+        final = get_bits(b, 1);
+        type = get_bits(b, 2);
+        if(overrun(b))
+            return -1;
+        if(type == 0){
+            // stored: byte aligned LEN, its complement, then the bytes,
+            // the first of which may already be in the bit buffer
+            get_bits(b, b->nbits & 7);
+            len = get_bits(b, 16);
+            if(get_bits(b, 16) != (~len & 0xffff) || len > cap - n)
+                return -1;
+            for(; len > 0 && b->nbits >= 8; len--){
+                out[n++] = b->bits;
+                b->bits >>= 8;
+                b->nbits -= 8;
+            }
+            if(overrun(b) || len > b->len - b->pos)
+                return -1;
+            memcpy(out + n, b->in + b->pos, len);
+            b->pos += len;
+            n += len;
+            continue;
+        }
+        if(type == 1)
+            fixed_tables(&lit, &dist);
+        else if(type != 2 || read_dynamic(b, &lit, &dist) < 0)
+            return -1;
+        while((sym = decode(b, &lit)) != 256){
+            if(sym < 0 || overrun(b))
+                return -1;
+            if(sym < 256){
+                if(n >= cap)
+                    return -1;
+                out[n++] = sym;
+                continue;
+            }
+            if((sym -= 257) >= 29)
+                return -1;
+            len = len_base[sym] + get_bits(b, len_extra[sym]);
+            if((sym = decode(b, &dist)) < 0 || sym >= NDIST)
+                return -1;
+            d = dist_base[sym] + get_bits(b, dist_extra[sym]);
+            if(d > n || len > cap - n)
+                return -1;
+            if(d >= len)
+                memcpy(out + n, out + n - d, len);
+            else
+                for(size_t k = 0; k < len; k++)
+                    out[n + k] = out[n + k - d];
+            n += len;
+        }
+    } while(!final);
+    return overrun(b) ? -1 : n;
+}
+
+/*
+ * gzip_decompress - inflate a gzip member into out
+ * Returns the inflated length, or -1 if in is not gzip or needs more
+ * than cap bytes. The trailer's length is checked but not its CRC: the
+ * cache wrote the stream itself, and structural checks catch damage.
+ */
+ssize_t gzip_decompress(char *in, size_t len, char *out, size_t cap)
+{
+    unsigned char *p = (unsigned char *)in;
+    size_t pos = 10;
+    uint32_t isize;
+    ssize_t n;
+    BitIn b;
+
+    if(len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8)
+        return -1;
+    // optional extra field, name, comment and hdr CRC
+    if(p[3] & 4)
+        pos += 2 + (p[pos] | p[pos + 1] << 8);
+    for(int flag = 8; flag <= 16; flag <<= 1){
+        if(p[3] & flag){
+            while(pos < len && p[pos])
+                pos++;
+            pos++;
+        }
+    }
+    if(p[3] & 2)
+        pos += 2;
+    if(pos + 8 > len)
+        return -1;
+    b.in = p + pos;
+    b.len = len - 8 - pos;
+    b.pos = 0;
+    b.bits = 0;
+    b.nbits = 0;
+    if((n = inflate(&b, (unsigned char *)out, cap)) < 0)
+        return -1;
+    isize = p[len - 4] | p[len - 3] << 8 | p[len - 2] << 16 | (uint32_t)p[len - 1] << 24;
+    return isize == (uint32_t)n ? n : -1;
+}
@@ -0,0 +1,23 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "csapp.h"
+
+/*
+ * Self-contained gzip (RFC 1952) codec for cached bodies. Compression
+ * is LZ77 over hash chains with one step of lazy matching, coded as a
+ * single dynamic Huffman deflate block; the whole input is in memory,
+ * so there is no streaming state. Decompression takes any deflate
+ * stream, decoding codes of up to GZIP_FAST_BITS bits with one table
+ * lookup.
+ */
+#define GZIP_HASH_BITS 15
+#define GZIP_CHAIN 64       /* candidates tried per position */
+#define GZIP_NICE 128       /* a match this long ends the search */
+#define GZIP_LAZY 32        /* matches this long are taken at once */
+#define GZIP_FAST_BITS 10
+
+size_t gzip_compress(char *in, size_t len, char *out, size_t cap);
+ssize_t gzip_decompress(char *in, size_t len, char *out, size_t cap);
+
+#endif
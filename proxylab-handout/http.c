@@ -0,0 +1,744 @@
+#include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "http.h"
+
+/* Constant req headers */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+static const char *conn_ka_hdr = "Connection: keep-alive\r\n";
+static const char *proxy_conn_ka_hdr = "Proxy-Connection: keep-alive\r\n";
+
+/* Names behind the HDR_* ids, lowercase and padded for 16-byte loads */
+static const struct {
+    char name[32];
+    size_t len;
+    int id;
+} known_hdrs[] = {
+    { "host", 4, HDR_HOST },
+    { "user-agent", 10, HDR_USER_AGENT },
+    { "connection", 10, HDR_CONNECTION },
+    { "proxy-connection", 16, HDR_PROXY_CONNECTION },
+    { "keep-alive", 10, HDR_KEEP_ALIVE },
+    { "if-none-match", 13, HDR_IF_NONE_MATCH },
+    { "if-modified-since", 17, HDR_IF_MODIFIED_SINCE },
+    { "accept-encoding", 15, HDR_ACCEPT_ENCODING },
+    { "content-length", 14, HDR_CONTENT_LENGTH },
+    { "transfer-encoding", 17, HDR_TRANSFER_ENCODING },
+};
+
+/*
+ * name_eq - p[0..len) is the lowercase name, ignoring case
+ * avail bytes from p are readable; 16-byte chunks that fit are folded
+ * and compared with SSE2, the rest a byte at a time.
+ */
+static int name_eq(const char *p, size_t avail, const char *name, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i lower = _mm_set1_epi8(0x20);
+    __m128i v, upper;
+    unsigned eq, want;
+
+    for(; i < len && i + 16 <= avail; i += 16){
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        // fold A-Z only; bytes over 0x7f compare as negative, so stay put
+        upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a), _mm_cmplt_epi8(v, after_z));
+        v = _mm_or_si128(v, _mm_and_si128(upper, lower));
+        eq = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(name + i))));
+        want = len - i >= 16 ? 0xffff : (1u << (len - i)) - 1;
+        if((eq & want) != want)
+            return 0;
+    }
+#endif
+    for(; i < len; i++)
+        if(tolower((unsigned char)p[i]) != name[i])
+            return 0;
+    return 1;
+}
+
+/* HDR_* id of a hdr name; avail bytes from name are readable */
+static int hdr_id(const char *name, size_t len, size_t avail)
+{
+    for(int i = 0; i < sizeof(known_hdrs) / sizeof(known_hdrs[0]); i++)
+        if(known_hdrs[i].len == len && name_eq(name, avail, known_hdrs[i].name, len))
+            return known_hdrs[i].id;
+    return HDR_OTHER;
+}
+
+/*
+ * scan_line - find the LF ending the line at h->pos, resuming where
+ * the last call stopped, and note the first colon before it
+ * SSE2 tests 16 bytes for both at once; loads never pass len, as a
+ * recv may still be filling in the buffer past it. Returns the LF's
+ * offset, or -1 if it is not in yet.
+ */
+static ssize_t scan_line(HttpHead *h, char *buf, size_t len)
+{
+    size_t i = h->scan;
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i colon = _mm_set1_epi8(':');
+    __m128i v;
+    unsigned lfs, colons;
+
+    for(; i + 16 <= len; i += 16){
+        v = _mm_loadu_si128((const __m128i *)(buf + i));
+        lfs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        colons = _mm_movemask_epi8(_mm_cmpeq_epi8(v, colon));
+        // only colons before the LF count
+        if(lfs)
+            colons &= (1u << __builtin_ctz(lfs)) - 1;
+        if(h->colon < 0 && colons)
+            h->colon = i + __builtin_ctz(colons);
+        if(lfs)
+            return i + __builtin_ctz(lfs);
+    }
+#endif
+    for(; i < len; i++){
+        if(buf[i] == '\n')
+            return i;
+        if(buf[i] == ':' && h->colon < 0)
+            h->colon = i;
+    }
+    h->scan = len;
+    return -1;
+}
+
+/* next blank-separated word of buf[*i..end) into s; 0 if there is none */
+static int next_word(char *buf, size_t *i, size_t end, Slice *s)
+{
+    size_t j = *i;
+
+    while(j < end && (buf[j] == ' ' || buf[j] == '\t'))
+        j++;
+    s->off = j;
+    while(j < end && buf[j] != ' ' && buf[j] != '\t')
+        j++;
+    s->len = j - s->off;
+    *i = j;
+    return s->len > 0;
+}
+
+/* "HTTP/d.d" */
+static int parse_version(char *buf, Slice s, HttpHead *h)
+{
+    char *p = buf + s.off;
+
+    if(s.len != 8 || strncmp(p, "HTTP/", 5) || !isdigit((unsigned char)p[5]) ||
+       p[6] != '.' || !isdigit((unsigned char)p[7]))
+        return -1;
+    h->major = p[5] - '0';
+    h->minor = p[7] - '0';
+    return 0;
+}
+
+/* req line "method target version" or status line "version code reason" */
+static int parse_startline(HttpHead *h, char *buf, size_t pos, size_t end)
+{
+    Slice version, code, extra;
+    char *p;
+
+    if(h->resp){
+        if(!next_word(buf, &pos, end, &version) || parse_version(buf, version, h) < 0 ||
+           !next_word(buf, &pos, end, &code) || code.len != 3)
+            return -1;
+        p = buf + code.off;
+        if(!isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1]) ||
+           !isdigit((unsigned char)p[2]))
+            return -1;
+        h->status = (p[0] - '0') * 100 + (p[1] - '0') * 10 + (p[2] - '0');
+        return 0;
+    }
+    if(!next_word(buf, &pos, end, &h->method) || !next_word(buf, &pos, end, &h->target) ||
+       !next_word(buf, &pos, end, &version) || next_word(buf, &pos, end, &extra))
+        return -1;
+    return parse_version(buf, version, h);
+}
+
+/*
+ * parse_hdrline - record the "name: value" line buf[pos..end), whose
+ * LF is at lf
+ * A line without a colon, or with blanks in or before its name (an
+ * obsolete folded line included), is malformed.
+ */
+static int parse_hdrline(HttpHead *h, char *buf, size_t pos, size_t end, size_t lf)
+{
+    Hdr *hdr;
+    size_t v, e;
+
+    if(h->colon < 0 || h->colon == pos)
+        return HEAD_BAD;
+    for(size_t i = pos; i < h->colon; i++)
+        if(buf[i] == ' ' || buf[i] == '\t')
+            return HEAD_BAD;
+    if(h->nhdrs == HEAD_MAX_HDRS)
+        return HEAD_FULL;
+    hdr = &h->hdrs[h->nhdrs++];
+    hdr->name.off = pos;
+    hdr->name.len = h->colon - pos;
+    for(v = h->colon + 1; v < end && (buf[v] == ' ' || buf[v] == '\t'); v++)
+        ;
+    for(e = end; e > v && (buf[e - 1] == ' ' || buf[e - 1] == '\t'); e--)
+        ;
+    hdr->value.off = v;
+    hdr->value.len = e - v;
+    hdr->line.off = pos;
+    hdr->line.len = lf + 1 - pos;
+    hdr->id = hdr_id(buf + pos, hdr->name.len, lf + 1 - pos);
+    return 0;
+}
+
+void head_init(HttpHead *h, int resp)
+{
+    h->resp = resp;
+    h->inhdrs = h->done = 0;
+    h->pos = h->scan = 0;
+    h->colon = -1;
+    h->status = h->major = h->minor = 0;
+    h->nhdrs = 0;
+}
+
+/* parse lines until the head is done, or only the start line if hdrs is 0 */
+static int parse_lines(HttpHead *h, char *buf, size_t len, int hdrs)
+{
+    ssize_t lf;
+    size_t end;
+    int rc;
+
+    while(!h->done && (hdrs || !h->inhdrs)){
+        if((lf = scan_line(h, buf, len)) < 0)
+            return HEAD_MORE;
+        end = lf - (lf > h->pos && buf[lf - 1] == '\r');
+        if(!h->inhdrs){
+            // blank lines before a req line are skipped
+            if(end > h->pos){
+                if(parse_startline(h, buf, h->pos, end) < 0)
+                    return HEAD_BAD;
+                h->inhdrs = 1;
+            }
+        }
+        else if(end == h->pos)
+            h->done = 1;
+        else if((rc = parse_hdrline(h, buf, h->pos, end, lf)) < 0)
+            return rc;
+        h->pos = h->scan = lf + 1;
+        h->colon = -1;
+    }
+    return HEAD_DONE;
+}
+
+/*
+ * head_parse - parse buf[0..len) as far as it goes
+ * buf must hold what the last call saw and more; lines end in LF with
+ * an optional CR. Once done, h->pos is past the blank line. Returns
+ * HEAD_DONE, HEAD_MORE, HEAD_BAD or HEAD_FULL.
+ */
+int head_parse(HttpHead *h, char *buf, size_t len)
+{
+    return parse_lines(h, buf, len, 1);
+}
+
+/*
+ * head_startline - like head_parse, but done once the start line is;
+ * the hdrs are left for a later head_parse
+ */
+int head_startline(HttpHead *h, char *buf, size_t len)
+{
+    return parse_lines(h, buf, len, 0);
+}
+
+/*
+ * slice_copy - NUL-terminated copy of a slice of buf into dst
+ * Returns -1 if it does not fit in size bytes.
+ */
+int slice_copy(char *buf, Slice s, char *dst, size_t size)
+{
+    if(s.len >= size)
+        return -1;
+    memcpy(dst, buf + s.off, s.len);
+    dst[s.len] = '\0';
+    return 0;
+}
+
+/*
+ * parse_url - split url into hostname, port and resource
+ * The scheme is optional. hostname and resource must hold MAXLINE
+ * bytes, port 8 bytes. Returns 0 on success, -1 on malformed url.
+ */
+int parse_url(char *url, char *hostname, char *port, char *resource)
+{
+    char *host = url, *path, *colon;
+    size_t n;
+
+    // match off leading "http://"
+    if((path = strstr(url, "://")) && path > url && path - url < 8 &&
+       !memchr(url, '/', path - url))
+        host = path + 3;
+    path = host + strcspn(host, "/");
+    if(path == host || path - host >= MAXLINE || strlen(path) >= MAXLINE)
+        return -1;
+    strcpy(resource, *path ? path : "/");
+    // pull out port number if present
+    if((colon = memchr(host, ':', path - host))){
+        n = path - colon - 1;
+        if(n == 0 || n >= 8 || colon == host)
+            return -1;
+        memcpy(port, colon + 1, n);
+        port[n] = '\0';
+    }
+    else{
+        colon = path;
+        strcpy(port, "80");
+    }
+    memcpy(hostname, host, colon - host);
+    hostname[colon - host] = '\0';
+    return 0;
+}
+
+/*
+ * fwd_init - start an empty fwd req
+ */
+void fwd_init(FwdReq *fr)
+{
+    fr->fixed = NULL;
+    fr->fixedlen = 0;
+    fr->slices = NULL;
+    fr->nslices = fr->slicecap = 0;
+    fr->total = 2;
+}
+
+/*
+ * fwd_reqline - format the fwd req line and the hdrs the proxy always sets
+ * A keepalive req goes out as HTTP/1.1 so the server can be pooled.
+ */
+void fwd_reqline(FwdReq *fr, char *method, char *hostname, char *port,
+                 char *resource, int keepalive)
+{
+    const char *conn = keepalive ? conn_ka_hdr : conn_hdr;
+    const char *proxy_conn = keepalive ? proxy_conn_ka_hdr : proxy_conn_hdr;
+    const char *version = keepalive ? "HTTP/1.1" : "HTTP/1.0";
+    int n;
+
+    n = snprintf(NULL, 0, "%s %s %s\r\nHost: %s:%s\r\n%s%s%s",
+                 method, resource, version, hostname, port,
+                 user_agent_hdr, conn, proxy_conn);
+    fr->fixed = (char *)Malloc(n + 1);
+    fr->fixedlen = sprintf(fr->fixed, "%s %s %s\r\nHost: %s:%s\r\n%s%s%s",
+                           method, resource, version, hostname, port,
+                           user_agent_hdr, conn, proxy_conn);
+    fr->total += fr->fixedlen;
+}
+
+/*
+ * fwd_extra - append proxy-set hdrs, e.g. validators, to the fixed part
+ */
+void fwd_extra(FwdReq *fr, char *hdrs)
+{
+    size_t n = strlen(hdrs);
+
+    fr->fixed = (char *)Realloc(fr->fixed, fr->fixedlen + n + 1);
+    memcpy(fr->fixed + fr->fixedlen, hdrs, n + 1);
+    fr->fixedlen += n;
+    fr->total += n;
+}
+
+/*
+ * fwd_add - fwd base[off..off+len) unchanged; adjacent slices merge
+ */
+void fwd_add(FwdReq *fr, size_t off, size_t len)
+{
+    Slice *last = fr->nslices ? &fr->slices[fr->nslices - 1] : NULL;
+
+    fr->total += len;
+    if(last && last->off + last->len == off){
+        last->len += len;
+        return;
+    }
+    if(fr->nslices == fr->slicecap){
+        fr->slicecap = fr->slicecap ? 2 * fr->slicecap : 8;
+        fr->slices = (Slice *)Realloc(fr->slices, fr->slicecap * sizeof(Slice));
+    }
+    fr->slices[fr->nslices].off = off;
+    fr->slices[fr->nslices].len = len;
+    fr->nslices++;
+}
+
+/*
+ * fwd_iovec - iovecs for the whole fwd req, resolving slices against base
+ * iov needs fr->nslices + 2 entries. Returns the entry count.
+ */
+int fwd_iovec(FwdReq *fr, char *base, struct iovec *iov)
+{
+    int n = 0;
+
+    iov[n].iov_base = fr->fixed;
+    iov[n++].iov_len = fr->fixedlen;
+    for(int i = 0; i < fr->nslices; i++){
+        iov[n].iov_base = base + fr->slices[i].off;
+        iov[n++].iov_len = fr->slices[i].len;
+    }
+    // end of req
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    return n;
+}
+
+void fwd_free(FwdReq *fr)
+{
+    free(fr->fixed);
+    free(fr->slices);
+    fr->fixed = NULL;
+    fr->slices = NULL;
+}
+
+/*
+ * send_error - best-effort error resp; the conn is closed afterwards
+ */
+void send_error(int fd, char *status, char *msg)
+{
+    char buf[MAXLINE];
+    int n;
+
+    n = snprintf(buf, MAXLINE, "HTTP/1.0 %s %s\r\n"
+                 "Content-Type: text/plain\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n%s\n",
+                 status, msg, strlen(msg) + 1, msg);
+    if(write(fd, buf, n) < 0)
+        ;   // client is being dropped anyway
+}
+
+/*
+ * is_replaced_hdr - true for client hdrs, by HDR_* id, the proxy sets
+ * itself
+ * Client validators are dropped too: the proxy asks for a full resp it
+ * can cache, and sends its own validators when revalidating.
+ */
+int is_replaced_hdr(int id)
+{
+    return id == HDR_HOST ||
+           id == HDR_USER_AGENT ||
+           id == HDR_CONNECTION ||
+           id == HDR_PROXY_CONNECTION ||
+           id == HDR_KEEP_ALIVE ||
+           id == HDR_IF_NONE_MATCH ||
+           id == HDR_IF_MODIFIED_SINCE;
+}
+
+/*
+ * hdr_is - true if hdr line is a name: hdr, ignoring case
+ */
+int hdr_is(char *hdr, char *name)
+{
+    size_t len = strlen(name);
+    return !strncasecmp(hdr, name, len) && hdr[len] == ':';
+}
+
+/*
+ * hdr_value - value of a hdr line, past the colon and leading spaces
+ */
+char *hdr_value(char *hdr)
+{
+    char *p = strchr(hdr, ':');
+    if(!p)
+        return hdr + strlen(hdr);
+    for(p++; *p == ' ' || *p == '\t'; p++)
+        ;
+    return p;
+}
+
+/*
+ * is_hop_hdr - hop-by-hop resp hdrs the proxy drops and sets itself
+ */
+int is_hop_hdr(char *hdr)
+{
+    return hdr_is(hdr, "Connection") ||
+           hdr_is(hdr, "Proxy-Connection") ||
+           hdr_is(hdr, "Keep-Alive") ||
+           hdr_is(hdr, "Transfer-Encoding");
+}
+
+/*
+ * parse_resphdrs - classify a complete resp hdr block
+ * Fills in framing info; clen is -1 when there is no Content-Length.
+ * Only the status line goes through the head parser: the hdrs are
+ * scanned leniently for the few framing ones, with no cap on their
+ * number, so an odd or long resp head is still relayed. hdrs[len] must
+ * be a NUL; a NUL inside a hdr ends only that line. Returns the status
+ * code, or -1 on a malformed status line.
+ */
+int parse_resphdrs(char *hdrs, size_t len, RespInfo *ri)
+{
+    HttpHead h;
+    char *line, *eol, *v, *end = hdrs + len;
+    int status;
+
+    head_init(&h, 1);
+    if(head_startline(&h, hdrs, len) != HEAD_DONE)
+        return -1;
+    status = ri->status = h.status;
+    ri->clen = -1;
+    ri->chunked = 0;
+    // HTTP/1.1 servers keep the conn open unless told otherwise
+    ri->keepalive = (h.major == 1 && h.minor >= 1);
+    // the block may stop short of its blank line
+    for(line = hdrs + h.pos; line < end && *line != '\r' && *line != '\n'; line = eol + 1){
+        if(!(eol = memchr(line, '\n', end - line)))
+            break;
+        if(hdr_is(line, "Content-Length"))
+            ri->clen = strtol(hdr_value(line), NULL, 10);
+        else if(hdr_is(line, "Transfer-Encoding"))
+            ri->chunked = !strncasecmp(hdr_value(line), "chunked", 7);
+        else if(hdr_is(line, "Connection")){
+            v = hdr_value(line);
+            if(!strncasecmp(v, "close", 5))
+                ri->keepalive = 0;
+            else if(!strncasecmp(v, "keep-alive", 10))
+                ri->keepalive = 1;
+        }
+    }
+    // these never carry a body
+    ri->nobody = (status / 100 == 1 || status == 204 || status == 304);
+    if(ri->chunked)
+        ri->clen = -1;
+    return status;
+}
+
+/* just past the first CRLF in [p, end), or NULL; p may hold NULs */
+static char *next_crlf(char *p, char *end)
+{
+    char *cr;
+
+    while(p < end && (cr = memchr(p, '\r', end - p)) && cr + 1 < end){
+        if(cr[1] == '\n')
+            return cr + 2;
+        p = cr + 1;
+    }
+    return NULL;
+}
+
+/*
+ * strip_resp - prepare a raw close-delimited resp for the cache
+ * Drops hop-by-hop hdrs in place and reports where the hdr block ends.
+ * Returns the new length, or -1 if the hdr block is incomplete or a
+ * line in it has no CRLF.
+ */
+ssize_t strip_resp(char *resp, size_t len, size_t *hdrlen)
+{
+    char *line, *eol, *end;
+
+    for(end = resp; end + 4 <= resp + len && memcmp(end, "\r\n\r\n", 4); end++)
+        ;
+    if(end + 4 > resp + len)
+        return -1;
+    end += 2;
+    if(!(line = next_crlf(resp, end)))
+        return -1;
+    while(line < end){
+        if(!(eol = next_crlf(line, end)))
+            return -1;
+        if(is_hop_hdr(line)){
+            memmove(line, eol, resp + len - eol);
+            len -= eol - line;
+            end -= eol - line;
+        }
+        else
+            line = eol;
+    }
+    *hdrlen = end - resp;
+    return len;
+}
+
+/*
+ * parse_httpdate - seconds since the epoch of an IMF-fixdate such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT", or -1 if s is not one
+ */
+time_t parse_httpdate(char *s)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(s, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, &tm.tm_year,
+              &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    if(strlen(mon) != 3 || !(m = strstr(months, mon)) || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* seconds value of a "name=secs" Cache-Control directive at p, or -1 */
+static long directive_secs(char *p, char *name)
+{
+    size_t len = strlen(name);
+
+    if(strncasecmp(p, name, len) || p[len] != '=')
+        return -1;
+    return strtol(p + len + 1 + (p[len + 1] == '"'), NULL, 10);
+}
+
+/*
+ * parse_freshness - freshness and validators of a resp hdr block
+ * hdrs[0..hdrlen) is the status line and hdrs, each ending in CRLF;
+ * it need not be NUL-terminated. etag and lastmod point into it.
+ */
+void parse_freshness(char *hdrs, size_t hdrlen, Freshness *fr)
+{
+    char line[MAXLINE];
+    char *p, *eol, *end = hdrs + hdrlen;
+    long maxage = -1, smaxage = -1, age = 0, secs;
+    time_t now = time(NULL), expires = 0, lastmod = -1, date = -1;
+    int status, nocache = 0, has_expires = 0;
+
+    memset(fr, 0, sizeof(Freshness));
+    fr->swr = fr->sie = -1;
+    if(sscanf(hdrs, "HTTP/%*d.%*d %d", &status) != 1)
+        return;
+    // the statuses a cache may store by default, less those without a body
+    fr->cacheable = status == 200 || status == 203 || status == 300 ||
+                    status == 301 || status == 404 || status == 410;
+
+    for(p = hdrs; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        if(eol - p >= MAXLINE)
+            continue;
+        // NUL-terminated copy without the CRLF for the value parsers
+        memcpy(line, p, eol - p);
+        line[eol - p - (eol > p && eol[-1] == '\r')] = '\0';
+        if(hdr_is(line, "Cache-Control")){
+            for(char *d = hdr_value(line); *d; d += strcspn(d, ",")){
+                d += strspn(d, ", \t");
+                if(!strncasecmp(d, "no-store", 8) || !strncasecmp(d, "private", 7))
+                    fr->cacheable = 0;
+                else if(!strncasecmp(d, "no-cache", 8))
+                    nocache = 1;
+                else if(!strncasecmp(d, "must-revalidate", 15) ||
+                        !strncasecmp(d, "proxy-revalidate", 16))
+                    fr->mustrevalidate = 1;
+                else if((secs = directive_secs(d, "stale-while-revalidate")) >= 0)
+                    fr->swr = secs;
+                else if((secs = directive_secs(d, "stale-if-error")) >= 0)
+                    fr->sie = secs;
+                else if((secs = directive_secs(d, "s-maxage")) >= 0)
+                    smaxage = secs;
+                else if((secs = directive_secs(d, "max-age")) >= 0)
+                    maxage = secs;
+            }
+        }
+        else if(hdr_is(line, "Expires")){
+            // an invalid date means already expired
+            has_expires = 1;
+            expires = parse_httpdate(hdr_value(line));
+        }
+        else if(hdr_is(line, "Date"))
+            date = parse_httpdate(hdr_value(line));
+        else if(hdr_is(line, "Age"))
+            age = strtol(hdr_value(line), NULL, 10);
+        else if(hdr_is(line, "Last-Modified")){
+            lastmod = parse_httpdate(hdr_value(line));
+            fr->lastmod = p + (hdr_value(line) - line);
+            fr->lastmodlen = strlen(hdr_value(line));
+        }
+        else if(hdr_is(line, "ETag")){
+            fr->etag = p + (hdr_value(line) - line);
+            fr->etaglen = strlen(hdr_value(line));
+        }
+        // varies on something no req hdr shows
+        else if(hdr_is(line, "Vary") && strchr(hdr_value(line), '*'))
+            fr->cacheable = 0;
+    }
+
+    // a Date in the future is the server's clock, not ours
+    if(date < 0 || date > now)
+        date = now;
+    fr->date = date - (age > 0 ? age : 0);
+    fr->explicit = 1;
+    // no-cache allows storing, but every use must be revalidated
+    fr->mustrevalidate |= nocache;
+    if(nocache)
+        fr->lifetime = 0;
+    else if(smaxage >= 0)
+        fr->lifetime = smaxage;
+    else if(maxage >= 0)
+        fr->lifetime = maxage;
+    else if(has_expires)
+        fr->lifetime = expires > date ? expires - date : 0;
+    else{
+        fr->explicit = 0;
+        if(lastmod >= 0 && lastmod <= date)
+            fr->lifetime = (date - lastmod) * HEURISTIC_PERCENT / 100;
+        else
+            fr->lifetime = fr->etag ? 0 : DEFAULT_LIFETIME;
+        if(fr->lifetime > HEURISTIC_MAX)
+            fr->lifetime = HEURISTIC_MAX;
+    }
+}
+
+/*
+ * accepts_gzip - an Accept-Encoding value lets the proxy send gzip
+ * gzip, or failing that *, with no q value or a nonzero one counts.
+ * The value may end at CRLF rather than a NUL.
+ */
+int accepts_gzip(char *value)
+{
+    char *p, *end, *s;
+    int gzip = -1, star = 0;
+    double q;
+    size_t n;
+
+    for(p = value; *p && *p != '\r' && *p != '\n'; p = end + (*end == ',')){
+        p += strspn(p, " \t");
+        n = strcspn(p, ",; \t\r\n");
+        end = p + strcspn(p, ",\r\n");
+        // of the parameters only q matters
+        q = 1;
+        for(s = p + n; s < end; s++){
+            if((*s == 'q' || *s == 'Q') && s[1] == '='){
+                q = strtod(s + 2, NULL);
+                break;
+            }
+        }
+        if(n == 4 && !strncasecmp(p, "gzip", 4))
+            gzip = q > 0;
+        else if(n == 1 && *p == '*')
+            star = q > 0;
+    }
+    return gzip >= 0 ? gzip : star;
+}
+
+/*
+ * compressible - a resp with this hdr block is worth gzipping: a 200
+ * with a textual Content-Type that is not already encoded or partial
+ */
+int compressible(char *hdrs, size_t hdrlen)
+{
+    static char *types[] = {
+        "text/", "application/json", "application/javascript",
+        "application/x-javascript", "application/xml", "application/xhtml+xml",
+        "application/rss+xml", "application/atom+xml", "image/svg+xml", NULL
+    };
+    char *p, *eol, *v, *end = hdrs + hdrlen;
+    int status, text = 0;
+
+    if(sscanf(hdrs, "HTTP/%*d.%*d %d", &status) != 1 || status != 200)
+        return 0;
+    for(p = hdrs; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        if(hdr_is(p, "Content-Encoding") || hdr_is(p, "Content-Range"))
+            return 0;
+        if(hdr_is(p, "Content-Type")){
+            v = hdr_value(p);
+            for(int i = 0; types[i]; i++)
+                if(!strncasecmp(v, types[i], strlen(types[i])))
+                    text = 1;
+        }
+    }
+    return text;
+}
@@ -0,0 +1,142 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* Framing of a server resp, from its hdr block */
+typedef struct {
+    int status;
+    long clen;          // Content-Length, -1 if absent
+    int chunked;        // Transfer-Encoding: chunked
+    int keepalive;      // server will keep the conn open
+    int nobody;         // status never carries a body
+} RespInfo;
+
+/*
+ * Cache freshness of a resp, from its hdr block. Lifetime comes from
+ * s-maxage, max-age or Expires; without those it is a fraction of the
+ * time since Last-Modified, or a default when there is no validator.
+ */
+#define HEURISTIC_PERCENT 10    /* of Date - Last-Modified */
+#define HEURISTIC_MAX 86400     /* cap on a heuristic lifetime, secs */
+#define DEFAULT_LIFETIME 300    /* secs, with nothing to go on */
+
+typedef struct {
+    int cacheable;      // cacheable status, no no-store, private or Vary: *
+    int explicit;       // lifetime set by the server, not guessed
+    long lifetime;      // secs fresh after date
+    time_t date;        // resp generation time, less any Age
+    long swr;           // stale-while-revalidate secs, -1 if absent
+    long sie;           // stale-if-error secs, -1 if absent
+    int mustrevalidate; // no stale use at all
+    char *etag;         // validators inside the hdr block, or NULL
+    size_t etaglen;
+    char *lastmod;
+    size_t lastmodlen;
+} Freshness;
+
+/* Max bytes of client req hdrs before we answer 431 */
+#define MAX_REQHDRS_SIZE 65536
+
+/* Max bytes of a server resp hdr block the threaded mode relays */
+#define MAX_RESPHDRS_SIZE 65536
+
+/* A run of client hdr bytes, as an offset into the read buffer */
+typedef struct {
+    size_t off;
+    size_t len;
+} Slice;
+
+/*
+ * Incremental parser for a req or resp head: the start line and hdrs
+ * up to the blank line. It is handed the whole read buffer after
+ * every read and resumes at the first line it has not finished, so a
+ * head may arrive in any number of pieces. Results are slices of the
+ * buffer; nothing is copied or allocated. Hdr names the proxy acts on
+ * are recognized case-insensitively, 16 bytes at a time with SSE2.
+ */
+#define HEAD_MAX_HDRS 100
+
+/* Hdr ids; any other name is HDR_OTHER */
+#define HDR_OTHER               0
+#define HDR_HOST                1
+#define HDR_USER_AGENT          2
+#define HDR_CONNECTION          3
+#define HDR_PROXY_CONNECTION    4
+#define HDR_KEEP_ALIVE          5
+#define HDR_IF_NONE_MATCH       6
+#define HDR_IF_MODIFIED_SINCE   7
+#define HDR_ACCEPT_ENCODING     8
+#define HDR_CONTENT_LENGTH      9
+#define HDR_TRANSFER_ENCODING   10
+
+/* head_parse results */
+#define HEAD_DONE   1
+#define HEAD_MORE   0   // incomplete; call again with more bytes
+#define HEAD_BAD   -1   // malformed start or hdr line
+#define HEAD_FULL  -2   // over HEAD_MAX_HDRS hdrs
+
+typedef struct {
+    int id;
+    Slice name;
+    Slice value;        // without surrounding blanks
+    Slice line;         // name through line end, for fwd_add
+} Hdr;
+
+typedef struct {
+    int resp;           // status line rather than req line
+    int inhdrs;         // start line is parsed
+    int done;
+    size_t pos;         // start of the first unfinished line
+    size_t scan;        // bytes of it already searched
+    ssize_t colon;      // first colon seen in it, or -1
+    Slice method;       // req line
+    Slice target;
+    int status;         // status line
+    int major, minor;   // HTTP version
+    Hdr hdrs[HEAD_MAX_HDRS];
+    int nhdrs;
+} HttpHead;
+
+/*
+ * Fwd req under construction. Only the req line and the hdrs the proxy
+ * sets are formatted; client hdrs we keep are referenced in place and
+ * the whole req goes out with one writev.
+ */
+typedef struct {
+    char *fixed;        // req line, Host, User-Agent, Connection hdrs
+    size_t fixedlen;
+    Slice *slices;      // kept client hdrs
+    int nslices;
+    int slicecap;
+    size_t total;       // bytes in the whole req
+} FwdReq;
+
+/* Request parsing and fwd req helpers shared by both service modes */
+void head_init(HttpHead *h, int resp);
+int head_parse(HttpHead *h, char *buf, size_t len);
+int head_startline(HttpHead *h, char *buf, size_t len);
+int slice_copy(char *buf, Slice s, char *dst, size_t size);
+int parse_url(char *url, char *hostname, char *port, char *resource);
+int is_replaced_hdr(int id);
+void fwd_init(FwdReq *fr);
+void fwd_reqline(FwdReq *fr, char *method, char *hostname, char *port,
+                 char *resource, int keepalive);
+void fwd_add(FwdReq *fr, size_t off, size_t len);
+void fwd_extra(FwdReq *fr, char *hdrs);
+int fwd_iovec(FwdReq *fr, char *base, struct iovec *iov);
+void fwd_free(FwdReq *fr);
+void send_error(int fd, char *status, char *msg);
+
+/* Hdr line and resp helpers */
+int hdr_is(char *hdr, char *name);
+char *hdr_value(char *hdr);
+int is_hop_hdr(char *hdr);
+int parse_resphdrs(char *hdrs, size_t len, RespInfo *ri);
+ssize_t strip_resp(char *resp, size_t len, size_t *hdrlen);
+time_t parse_httpdate(char *s);
+void parse_freshness(char *hdrs, size_t hdrlen, Freshness *fr);
+int accepts_gzip(char *value);
+int compressible(char *hdrs, size_t hdrlen);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * key.c - cache keys: canonical urls and Vary variants
+ *
+ * Spellings of one url that any server treats alike share a key, so
+ * they share a cache entry too. Query params are kept in order, since
+ * servers may care about it; only the configured tracking params go.
+ */
+#include "key.h"
+
+static char *tracking[KEY_MAX_STRIP];  // a trailing * matches a prefix
+static int ntracking;
+
+/* Key under construction; full once something did not fit */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    int full;
+} KeyBuf;
+
+/*
+ * key_init - take the tracking params to drop from query strings, a
+ * comma-separated list such as "utm_*,fbclid", or NULL for none
+ */
+void key_init(char *strip)
+{
+    char *p, *save;
+
+    ntracking = 0;
+    if(!strip)
+        return;
+    // kept for the life of the process
+    strip = strdup(strip);
+    for(p = strtok_r(strip, ",", &save); p && ntracking < KEY_MAX_STRIP;
+        p = strtok_r(NULL, ",", &save))
+        tracking[ntracking++] = p;
+}
+
+static void put(KeyBuf *k, const char *s, size_t n)
+{
+    if(k->full || k->len + n >= k->size){
+        k->full = 1;
+        return;
+    }
+    memcpy(k->buf + k->len, s, n);
+    k->len += n;
+    k->buf[k->len] = '\0';
+}
+
+static int hexval(int c)
+{
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* RFC 3986 unreserved chars, which mean the same escaped or not */
+static int unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* s[0..n) with escaped unreserved chars decoded and other escapes in
+   uppercase hex */
+static void put_norm(KeyBuf *k, char *s, size_t n)
+{
+    char c, esc[4];
+    int hi, lo;
+
+    for(size_t i = 0; i < n; i++){
+        if(s[i] == '%' && i + 2 < n && (hi = hexval(s[i + 1])) >= 0 &&
+           (lo = hexval(s[i + 2])) >= 0){
+            c = hi << 4 | lo;
+            if(unreserved((unsigned char)c))
+                put(k, &c, 1);
+            else{
+                sprintf(esc, "%%%c%c", toupper(s[i + 1]), toupper(s[i + 2]));
+                put(k, esc, 3);
+            }
+            i += 2;
+        }
+        else
+            put(k, s + i, 1);
+    }
+}
+
+/* true if query param name[0..n) is one the keys leave out */
+static int tracked(char *name, size_t n)
+{
+    size_t len;
+
+    for(int i = 0; i < ntracking; i++){
+        len = strlen(tracking[i]);
+        if(len && tracking[i][len - 1] == '*'){
+            if(n >= len - 1 && !memcmp(name, tracking[i], len - 1))
+                return 1;
+        }
+        else if(n == len && !memcmp(name, tracking[i], n))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * key_canon - the canonical form of req url in key, of size bytes
+ * A url without a host, or whose canonical form does not fit, is
+ * keyed as it is.
+ */
+void key_canon(char *url, char *key, size_t size)
+{
+    KeyBuf k = { key, 0, size, 0 };
+    char *host = url, *scheme = "http", *p, *end, *colon = NULL, *q, *qend, *amp, *eq;
+    size_t schemelen = 4;
+    char c, port[8];
+    int first = 1;
+
+    key[0] = '\0';
+    // the scheme is optional, as in parse_url
+    if((p = strstr(url, "://")) && p > url && p - url < 8 && !memchr(url, '/', p - url)){
+        scheme = url;
+        schemelen = p - url;
+        host = p + 3;
+    }
+    end = host + strcspn(host, "/?#");
+    // a port colon comes after any IPv6 literal
+    for(p = host; p < end; p++){
+        if(*p == ':')
+            colon = p;
+        else if(*p == ']')
+            colon = NULL;
+    }
+    if((colon ? colon : end) == host){
+        snprintf(key, size, "%s", url);
+        return;
+    }
+
+    for(p = scheme; p < scheme + schemelen; p++){
+        c = tolower(*p);
+        put(&k, &c, 1);
+    }
+    put(&k, "://", 3);
+    for(p = host; p < (colon ? colon : end); p++){
+        c = tolower(*p);
+        put(&k, &c, 1);
+    }
+    // the default port, or an empty one, goes
+    if(colon && end > colon + 1){
+        for(p = colon + 1; p < end && isdigit((unsigned char)*p); p++)
+            ;
+        if(p < end || end - colon > 6)
+            put(&k, colon, end - colon);
+        else{
+            snprintf(port, sizeof(port), "%ld", strtol(colon + 1, NULL, 10));
+            if(strcmp(port, strncasecmp(k.buf, "https:", 6) ? "80" : "443")){
+                put(&k, ":", 1);
+                put(&k, port, strlen(port));
+            }
+        }
+    }
+
+    // path; an empty one is the root
+    q = end + strcspn(end, "?#");
+    if(*end != '/')
+        put(&k, "/", 1);
+    put_norm(&k, end, q - end);
+    // query, less tracking params and empty ones; no fragment
+    if(*q == '?'){
+        qend = q + strcspn(q, "#");
+        for(p = q + 1; p < qend; p = amp + 1){
+            if(!(amp = memchr(p, '&', qend - p)))
+                amp = qend;
+            if(!(eq = memchr(p, '=', amp - p)))
+                eq = amp;
+            if(amp > p && !tracked(p, eq - p)){
+                put(&k, first ? "?" : "&", 1);
+                put_norm(&k, p, amp - p);
+                first = 0;
+            }
+        }
+    }
+    if(k.full)
+        snprintf(key, size, "%s", url);
+}
+
+/*
+ * key_variant - append to url key the variant part for the req whose
+ * hdrs h parsed out of buf; names is a marker's comma-separated list.
+ * Repeated hdrs are joined with ", ". Returns -1, leaving key as it
+ * was, if the result does not fit in size bytes.
+ */
+int key_variant(char *key, size_t size, char *names, char *buf, HttpHead *h)
+{
+    KeyBuf k = { key, strlen(key), size, 0 };
+    size_t urllen = k.len, n;
+    char *name, *end;
+    int seen;
+    Hdr *hd;
+
+    put(&k, "\n", 1);
+    for(name = names; *name; name = end + (*end == ',')){
+        end = name + strcspn(name, ",");
+        n = end - name;
+        put(&k, name, n);
+        put(&k, ":", 1);
+        seen = 0;
+        for(int i = 0; h && i < h->nhdrs; i++){
+            hd = &h->hdrs[i];
+            if(hd->name.len != n || strncasecmp(buf + hd->name.off, name, n))
+                continue;
+            put(&k, seen ? ", " : " ", seen ? 2 : 1);
+            put(&k, buf + hd->value.off, hd->value.len);
+            seen = 1;
+        }
+        put(&k, "\r\n", 2);
+    }
+    if(k.full){
+        key[urllen] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * key_resolve - follow a Vary marker to this req's variant
+ * obj is what a lookup of key found. If it is a marker, it is dropped
+ * and key and *hash become the variant's, which is looked up instead.
+ * Returns the object to serve or revalidate, or NULL on a miss.
+ */
+CacheObject *key_resolve(CacheObject *obj, char *key, size_t size,
+                         unsigned long *hash, char *buf, HttpHead *h)
+{
+    int rc;
+
+    if(!obj || !obj->vary)
+        return obj;
+    rc = key_variant(key, size, obj->vary, buf, h);
+    cache_release(obj);
+    // too long to key; the fetch then goes uncached
+    if(rc < 0)
+        return NULL;
+    *hash = cache_hash(key);
+    return cache_lookup(key, *hash);
+}
+
+/*
+ * key_store - the key a resp fetched under key is stored under, in
+ * store of size bytes
+ * resp[0..hdrlen) is its hdr block. Without a Vary hdr that is the url
+ * part of key; with one, the variant for the req in buf and h. With
+ * compression on, Accept-Encoding is left out: the server only ever
+ * sends the proxy identity bodies. Returns -1 if there is no room.
+ */
+int key_store(char *key, char *store, size_t size, char *resp, size_t hdrlen,
+              char *buf, HttpHead *h)
+{
+    char names[MAXLINE];
+    char *p, *v, *eol, *end = resp + hdrlen;
+    size_t n = 0, len, t, urllen = strcspn(key, "\n");
+
+    for(p = resp; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        if(!hdr_is(p, "Vary"))
+            continue;
+        for(v = p + 5; v < eol; v += len + 1){
+            v += strspn(v, " \t");
+            len = strcspn(v, ",\r\n");
+            for(t = len; t && (v[t - 1] == ' ' || v[t - 1] == '\t'); t--)
+                ;
+            if(t && n + t + 2 < sizeof(names) &&
+               !(cache_compressing() && t == 15 && !strncasecmp(v, "accept-encoding", 15))){
+                if(n)
+                    names[n++] = ',';
+                for(size_t i = 0; i < t; i++)
+                    names[n++] = tolower(v[i]);
+            }
+            if(v[len] != ',')
+                break;
+        }
+    }
+    names[n] = '\0';
+    if(urllen >= size)
+        return -1;
+    memcpy(store, key, urllen);
+    store[urllen] = '\0';
+    return n ? key_variant(store, size, names, buf, h) : 0;
+}
+
+/*
+ * key_shares - whether the req in buf and h, made for key, would store
+ * resp under store too, so a resp fetched for another req may answer
+ * it; a Vary'd one may not if the req differs in the hdrs named
+ */
+int key_shares(char *store, char *key, char *resp, size_t hdrlen, char *buf,
+               HttpHead *h)
+{
+    char mine[MAXLINE];
+
+    return store && key_store(key, mine, sizeof(mine), resp, hdrlen, buf, h) == 0 &&
+           !strcmp(mine, store);
+}
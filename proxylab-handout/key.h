@@ -0,0 +1,34 @@
+#ifndef __KEY_H__
+#define __KEY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+/*
+ * Cache keys. A req url is keyed by its canonical form: lowercase
+ * scheme and host, no default port, "/" for an empty path, percent
+ * escapes of unreserved chars decoded and the rest in uppercase hex,
+ * no fragment, and none of the configured tracking params in the
+ * query. "host/a", "http://host/a" and "HTTP://Host:80/a" share one
+ * key.
+ *
+ * A resp with a Vary hdr is stored under a variant key: the canonical
+ * url, a LF, then "name: value\r\n" for each name it lists, with the
+ * req's value ("name:\r\n" if the req had none). The url's own key
+ * holds a marker naming the hdrs, so a lookup learns which of them
+ * pick the variant. The lines double as the hdrs a refresh sends.
+ */
+#define KEY_MAX_STRIP 32    /* tracking params -t may name */
+
+void key_init(char *strip);
+void key_canon(char *url, char *key, size_t size);
+int key_variant(char *key, size_t size, char *names, char *buf, HttpHead *h);
+CacheObject *key_resolve(CacheObject *obj, char *key, size_t size,
+                         unsigned long *hash, char *buf, HttpHead *h);
+int key_store(char *key, char *store, size_t size, char *resp, size_t hdrlen,
+              char *buf, HttpHead *h);
+int key_shares(char *store, char *key, char *resp, size_t hdrlen, char *buf,
+               HttpHead *h);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * pool.c - prethreaded worker pool
+ *
+ * An acceptor thread inserts connected fds into a bounded sbuf;
+ * workers remove and serve them. A manager thread doubles the pool
+ * while the queue stays at least half full and halves it again (never
+ * below the initial size) after the queue has been idle for a while.
+ * Workers are retired by queueing a -1 fd for each. Every listener
+ * group runs its own pool, and its threads inherit the group's core.
+ */
+#include "pool.h"
+#include "cache.h"
+
+volatile sig_atomic_t poolReportFlag = 0;
+
+static Pool *pools;     // pushed under pools_lock, never removed
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker(void *vargp);
+static void *manager(void *vargp);
+static void spawn_workers(Pool *p, int n);
+
+Pool *pool_init(int n, int qsize, void (*serve)(int))
+{
+    Pool *p = (Pool *)Malloc(sizeof(Pool));
+    pthread_t tid;
+
+    sbuf_init(&p->sbuf, qsize);
+    p->serve = serve;
+    p->minworkers = n;
+    p->nworkers = 0;
+    spawn_workers(p, n);
+    pthread_mutex_lock(&pools_lock);
+    p->next = pools;
+    pools = p;
+    pthread_mutex_unlock(&pools_lock);
+    Pthread_create(&tid, NULL, manager, p);
+    return p;
+}
+
+/* Blocks while the queue is full */
+void pool_submit(Pool *p, int connfd)
+{
+    sbuf_insert(&p->sbuf, connfd);
+}
+
+/*
+ * pool_report - one line per pool
+ */
+void pool_report(FILE *fp)
+{
+    unsigned long nremoved, waitsum, waitmax;
+    int count;
+    Pool *p;
+
+    pthread_mutex_lock(&pools_lock);
+    for(p = pools; p; p = p->next){
+        P(&p->sbuf.mutex);
+        nremoved = p->sbuf.nremoved;
+        waitsum = p->sbuf.waitsum;
+        waitmax = p->sbuf.waitmax;
+        count = p->sbuf.count;
+        V(&p->sbuf.mutex);
+        fprintf(fp, "pool: workers %d queued %d/%d served %lu "
+                "wait avg %luus max %luus\n",
+                p->nworkers, count, p->sbuf.n, nremoved,
+                nremoved ? waitsum / nremoved / 1000 : 0, waitmax / 1000);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+static void spawn_workers(Pool *p, int n)
+{
+    pthread_t tid;
+    for(int i = 0; i < n; i++)
+        Pthread_create(&tid, NULL, worker, p);
+    p->nworkers += n;
+}
+
+static void *worker(void *vargp)
+{
+    Pool *p = (Pool *)vargp;
+    int connfd;
+
+    Pthread_detach(Pthread_self());
+    // -1 means retire
+    while((connfd = sbuf_remove(&p->sbuf)) >= 0)
+        p->serve(connfd);
+    return NULL;
+}
+
+static void *manager(void *vargp)
+{
+    Pool *p = (Pool *)vargp;
+    int queued, idle = 0, n;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        usleep(POOL_TICK_US);
+        queued = sbuf_count(&p->sbuf);
+        if(queued >= p->sbuf.n / 2 && p->nworkers < MAX_WORKERS){
+            // backlog; double the pool
+            n = p->nworkers;
+            if(p->nworkers + n > MAX_WORKERS)
+                n = MAX_WORKERS - p->nworkers;
+            spawn_workers(p, n);
+            idle = 0;
+        }
+        else if(queued == 0 && p->nworkers > p->minworkers){
+            // idle long enough; halve the pool
+            if(++idle >= POOL_IDLE_TICKS){
+                n = p->nworkers / 2;
+                if(p->nworkers - n < p->minworkers)
+                    n = p->nworkers - p->minworkers;
+                for(int i = 0; i < n; i++)
+                    sbuf_insert(&p->sbuf, -1);
+                p->nworkers -= n;
+                idle = 0;
+            }
+        }
+        else
+            idle = 0;
+
+        // one manager takes the flag and reports for all pools
+        if(poolReportFlag && __atomic_exchange_n(&poolReportFlag, 0, __ATOMIC_RELAXED)){
+            pool_report(stderr);
+            cache_report(stderr);
+        }
+    }
+    return NULL;
+}
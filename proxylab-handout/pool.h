@@ -0,0 +1,30 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+/* Worker pool limits and manager tuning */
+#define DEF_WORKERS 8
+#define DEF_QUEUE 64
+#define MAX_WORKERS 512
+#define POOL_TICK_US 100000     /* manager period */
+#define POOL_IDLE_TICKS 20      /* empty ticks before shrinking */
+
+/* Set from a signal handler; the pool manager or an event loop prints stats */
+extern volatile sig_atomic_t poolReportFlag;
+
+/* One acceptor's workers; each listener group has its own */
+typedef struct Pool {
+    sbuf_t sbuf;
+    void (*serve)(int);
+    int minworkers;
+    int nworkers;       // only touched by the manager after init
+    struct Pool *next;  // all pools, for the report
+} Pool;
+
+Pool *pool_init(int nworkers, int qsize, void (*serve)(int));
+void pool_submit(Pool *p, int connfd);
+void pool_report(FILE *fp);
+
+#endif
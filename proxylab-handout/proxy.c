@@ -1,24 +1,183 @@
 #include <stdio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "cache.h"
+#include "disk.h"
+#include "http.h"
+#include "key.h"
+#include "event.h"
+#include "flight.h"
+#include "pool.h"
+#include "refresh.h"
+#include "resolve.h"
+#include "stats.h"
+#include "upstream.h"
+#include "zcopy.h"
+#include "cpu.h"
 
-/* Constant req headers */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *conn_hdr = "Connection: close\r\n";
-static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+#define USAGE "usage: %s [-p lru|clock] [-a all|tinylfu] [-d cachedir] [-s snapfile] [-z] [-t params] [-l nlisten] [-e nloops [-b epoll|uring] | -w nworkers -q qsize] <port>\n"
 
 volatile sig_atomic_t exitFlag = 0;
 
-/* Threaded service */
-void *run_thread(void *);
+/* Client side of background refreshes */
+static int devnull = -1;
 
-/* Thread exit */
-void *end_thread(int *, int *);
+/* Idle persistent client conns are closed after this long */
+#define KEEPALIVE_SECS 5
+
+/* The cache snapshot is rewritten this often, and on SIGINT/SIGTERM */
+#define SNAPSHOT_SECS 60
+
+/* SO_REUSEPORT listener groups; each has its own socket and core */
+#define MAX_LISTENERS 64
+
+/* A listener group of the threaded mode: acceptor plus worker pool */
+typedef struct {
+    int listenfd;
+    int cpu;            // core slot, or -1 to run unpinned
+    int nworkers;
+    int qsize;
+} Group;
+
+/* relay_resp results */
+#define RELAY_NORESP    -2  // server sent nothing; safe to retry
+#define RELAY_FAIL      -1  // transfer broke midway
+#define RELAY_CLIENT_KA  1  // client conn can carry another req
+#define RELAY_SERVER_KA  2  // server conn can go back to the pool
+#define RELAY_NOTMOD     4  // revalidation got 304; nothing was sent
+#define RELAY_STALE      8  // server error a stale copy may hide
+
+/* follow_flight result when the client must fetch on its own */
+#define FOLLOW_RETRY    -1
+
+/* One upstream fetch, led by a client req or a background refresh */
+typedef struct {
+    char *url;
+    unsigned long hash;
+    char *hostname;
+    char *port;
+    FwdReq *fr;         // slices point into base
+    char *base;
+    HttpHead *head;     // req hdrs in base, for a Vary'd resp
+    int client11;       // client speaks HTTP/1.1
+    int keepalive;      // client conn may persist
+    int gzip;           // client accepts gzip
+    Flight *f;          // the flight this fetch leads
+    CacheObject *stale; // expired copy, or NULL
+} Fetch;
+
+/* Resp copy being collected for the cache and followers */
+typedef struct {
+    char *buf;          // MAX_OBJECT_SIZE bytes of the flight
+    Flight *flight;     // followers stream from buf as it fills
+    Fetch *ft;          // the fetch, whose req picks a Vary'd resp's key
+    DiskSlot *disk;     // too big for RAM; body streams to disk instead
+    CacheObject *stale; // being revalidated; a 304 refreshes it
+    size_t len;
+    size_t hdrlen;      // hdr block length, without blank line
+    int framed;         // hdrs carry Content-Length
+    int overflow;       // too big to cache
+    uint64_t firstbyte; // when the status line came in, or 0
+} ObjBuf;
+
+/* Client req hdrs, read in place; FwdReq slices point into it */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t start;     // when the req line came in, or 0
+    HttpHead head;      // parse of buf so far
+} HdrBuf;
+
+/* Service run by pool workers */
+void serve_client(int clientfd);
+int serve_request(rio_t *rio_client, int clientfd, HdrBuf *hb);
+int handle_request(rio_t *rio_client, int clientfd, HdrBuf *hb, FwdReq *fr);
+int handle_miss(int clientfd, HdrBuf *hb, FwdReq *fr, char *url, char *key,
+                unsigned long hash, CacheObject *stale, int keepalive, int gzip);
+ssize_t read_hdrline(rio_t *rio_client, HdrBuf *hb);
+int read_head(rio_t *rio_client, HdrBuf *hb);
+int client_keepalive(HdrBuf *hb, int keepalive);
+int peek_plainhead(rio_t *rio_client);
+int answer_hit(int clientfd, char *key, CacheObject *obj, int keepalive, int gzip,
+               int nobody);
+int fetch_object(int clientfd, Fetch *ft);
+void refresh_url(char *key, CacheObject *obj);
+int send_hit(int clientfd, CacheObject *obj, int keepalive, int gzip, int nobody);
+int send_disk(int clientfd, DiskRef *ref, int keepalive, int nobody);
+int send_stats(int clientfd, char *url, int keepalive);
+int follow_flight(int clientfd, Flight *f, int keepalive, char *key, HdrBuf *hb);
+int relay_resp(rio_t *rio_server, int clientfd, int client11, int keepalive, ObjBuf *ob);
+int relay_head(rio_t *rio_server, int clientfd, int client11, int keepalive,
+               ObjBuf *ob, char *hdrs, size_t hdrslen);
+int relay_body(rio_t *rio_server, int clientfd, long len, ObjBuf *ob);
+void obj_append(ObjBuf *ob, char *buf, size_t n);
+void obj_overflow(ObjBuf *ob);
+void *snapshot_thread(void *vargp);
+void *group_thread(void *vargp);
+void serve_group(Group *g);
+
+/*
+ * snapshot_thread - save the cache every SNAPSHOT_SECS, and once more
+ * on SIGINT or SIGTERM before exiting
+ */
+void *snapshot_thread(void *vargp)
+{
+    struct timespec ts = { SNAPSHOT_SECS, 0 };
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(Pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTERM);
+    while(1){
+        if((sig = sigtimedwait(&mask, NULL, &ts)) < 0 && errno == EINTR)
+            continue;   // USR1 landed here
+        cache_save((char *)vargp);
+        if(sig > 0)
+            exit(0);
+    }
+    return NULL;
+}
+
+/*
+ * serve_group - accept on the group's socket and feed its own pool
+ * Pinned first, so the pool's threads inherit the core. Never returns.
+ */
+void serve_group(Group *g)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    Pool *pool;
+    int connfd;
+
+    if(g->cpu >= 0 && cpu_pin(g->cpu) < 0)
+        unix_error("cpu_pin error");
+    pool = pool_init(g->nworkers, g->qsize, serve_client);
+    while(1){
+        clientlen = sizeof(clientaddr);
+        if((connfd = Accept(g->listenfd, (SA *) &clientaddr, &clientlen)) < 0)
+            continue;
+        pool_submit(pool, connfd);
+    }
+}
+
+void *group_thread(void *vargp)
+{
+    Pthread_detach(Pthread_self());
+    serve_group((Group *)vargp);
+    return NULL;
+}
 
 void sig_handler(int sig){
     exitFlag = 1;
 }
 
+void usr1_handler(int sig){
+    poolReportFlag = 1;
+}
+
 int main(int argc, char **argv)
 {
     // ignore SIGPIPE
@@ -28,169 +187,1032 @@ int main(int argc, char **argv)
     // action.sa_handler = sig_handler;
     // sigaction(SIGTERM, &action, NULL);
 
-    // proxy cache
-    cache_init();
-
     int port;
-    int listenfd;
-    int *connfdp;
-    struct sockaddr_storage clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
+    int listenfds[MAX_LISTENERS];
+    int nlisten = 0;
+    int ngroups;
+    int opt;
+    int nloops = 0;
+    int nworkers = DEF_WORKERS;
+    int qsize = DEF_QUEUE;
+    int policy = CACHE_CLOCK;
+    int admit = CACHE_ADMIT_TINYLFU;
+    int compress = 0;
+    int backend = EV_EPOLL;
+    char *diskdir = NULL;
+    char *snapfile = NULL;
+    char *tracking = NULL;
+    sigset_t mask;
     pthread_t tid;
+    Group groups[MAX_LISTENERS];
 
     // check command line
-    if(argc != 2){
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while((opt = getopt(argc, argv, "e:b:w:q:p:a:d:s:zt:l:")) != -1){
+        switch(opt){
+        case 'e':
+            // epoll mode with this many loop threads
+            nloops = atoi(optarg);
+            if(nloops < 1){
+                fprintf(stderr, "Loop count must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            // what the event loops wait on
+            if(!strcmp(optarg, "epoll"))
+                backend = EV_EPOLL;
+            else if(!strcmp(optarg, "uring"))
+                backend = EV_URING;
+            else{
+                fprintf(stderr, "Backend must be epoll or uring\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            // initial (and minimum) worker count
+            nworkers = atoi(optarg);
+            if(nworkers < 1 || nworkers > MAX_WORKERS){
+                fprintf(stderr, "Worker count must be in 1..%d\n", MAX_WORKERS);
+                exit(1);
+            }
+            break;
+        case 'q':
+            // connection queue slots
+            qsize = atoi(optarg);
+            if(qsize < 1){
+                fprintf(stderr, "Queue size must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'p':
+            // cache replacement policy
+            if(!strcmp(optarg, "lru"))
+                policy = CACHE_LRU;
+            else if(!strcmp(optarg, "clock"))
+                policy = CACHE_CLOCK;
+            else{
+                fprintf(stderr, "Policy must be lru or clock\n");
+                exit(1);
+            }
+            break;
+        case 'a':
+            // cache admission policy
+            if(!strcmp(optarg, "all"))
+                admit = CACHE_ADMIT_ALL;
+            else if(!strcmp(optarg, "tinylfu"))
+                admit = CACHE_ADMIT_TINYLFU;
+            else{
+                fprintf(stderr, "Admission must be all or tinylfu\n");
+                exit(1);
+            }
+            break;
+        case 'd':
+            // disk tier segment files go here
+            diskdir = optarg;
+            break;
+        case 's':
+            // warm restart from, and periodic saves to, this file
+            snapfile = optarg;
+            break;
+        case 'z':
+            // store text bodies gzipped
+            compress = 1;
+            break;
+        case 't':
+            // query params left out of cache keys, e.g. "utm_*,fbclid"
+            tracking = optarg;
+            break;
+        case 'l':
+            // SO_REUSEPORT listeners, one group pinned per core
+            nlisten = atoi(optarg);
+            if(nlisten < 1 || nlisten > MAX_LISTENERS){
+                fprintf(stderr, "Listener count must be in 1..%d\n", MAX_LISTENERS);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            exit(1);
+        }
+    }
+    if(optind != argc - 1){
+        fprintf(stderr, USAGE, argv[0]);
         exit(1);
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
     if(port < 0 || port > 65535){
         fprintf(stderr, "Port number out of range\n");
         exit(1);
     }
-    listenfd = Open_listenfd(argv[1]);
+    // without -l, one plain listener and no pinning as before
+    ngroups = nlisten ? nlisten : 1;
+    for(int i = 0; i < ngroups; i++)
+        if((listenfds[i] = nlisten ? Open_reuseport_listenfd(argv[optind]) :
+                                     Open_listenfd(argv[optind])) < 0)
+            exit(1);
+
+    // only the snapshot thread takes these, so they must be blocked
+    // before any other thread starts
+    if(snapfile){
+        Sigemptyset(&mask);
+        Sigaddset(&mask, SIGINT);
+        Sigaddset(&mask, SIGTERM);
+        Sigprocmask(SIG_BLOCK, &mask, NULL);
+    }
+
+    // per-thread metrics are taken from here on
+    stats_init();
+
+    // proxy cache, in-flight misses, resolver and server conn pool
+    cache_init(policy, admit, compress);
+    key_init(tracking);
+    if(snapfile && cache_load(snapfile) < 0)
+        fprintf(stderr, "Ignoring bad snapshot %s\n", snapfile);
+    if(diskdir && disk_init(diskdir) < 0)
+        exit(1);
+    flight_init();
+    resolve_init();
+    upstream_init();
+    devnull = Open("/dev/null", O_WRONLY, 0);
+    refresh_init(refresh_url);
+
+    // kill -USR1 prints pool and cache stats
+    Signal(SIGUSR1, usr1_handler);
+    if(snapfile)
+        Pthread_create(&tid, NULL, snapshot_thread, snapfile);
+
+    // event-driven mode; never returns
+    if(nloops > 0)
+        event_run(listenfds, ngroups, nloops, nlisten > 0, backend);
+
+    // hand conns to each group's worker pool; group 0 runs here
+    for(int i = 0; i < ngroups; i++){
+        groups[i].listenfd = listenfds[i];
+        groups[i].cpu = nlisten ? i : -1;
+        groups[i].nworkers = nworkers;
+        groups[i].qsize = qsize;
+    }
+    for(int i = 1; i < ngroups; i++)
+        Pthread_create(&tid, NULL, group_thread, &groups[i]);
+    serve_group(&groups[0]);
 
-    // spawn a thread on request
-    while(1){
-        connfdp = (int *)Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, run_thread, connfdp);
-        // if(exitFlag){
-        //     cache_deinit();
-        //     return 0;
-        // }
-    }
-    
     cache_deinit();
     return 0;
 }
 
-void *run_thread(void *vargp)
+void serve_client(int clientfd)
 {
-    // pick up fd and free heap space
-    int clientfd = *((int *)vargp);
-    Pthread_detach(Pthread_self());
-    free(vargp);
-    // not connected to server yet
-    int serverfd = -1;
+    rio_t rio_client;
+    HdrBuf hb;
+    struct timeval tv = { KEEPALIVE_SECS, 0 };
+    int one = 1;
 
-    char req[MAXBUF];
-    char req_fwd[MAXBUF];
-    char resp[MAXBUF];
-    char object[MAX_OBJECT_SIZE];
+    // an idle persistent client only holds a worker this long
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // hdrs and body go out in separate writes; don't let the body
+    // wait on the client's delayed ACK of the hdrs
+    setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    Rio_readinitb(&rio_client, clientfd);
+    hb.cap = MAXBUF;
+    hb.buf = (char *)Malloc(hb.cap);
+    while(serve_request(&rio_client, clientfd, &hb))
+        ;
+    free(hb.buf);
+    Close(clientfd);
+}
+
+/*
+ * serve_request - serve one req on a client conn
+ * Returns 1 if the conn can carry another req, 0 if it must close.
+ */
+int serve_request(rio_t *rio_client, int clientfd, HdrBuf *hb)
+{
+    FwdReq fr;
+    int rc;
+
+    fwd_init(&fr);
+    hb->start = 0;
+    rc = handle_request(rio_client, clientfd, hb, &fr);
+    if(hb->start)
+        stats_time(STAGE_TOTAL, hb->start);
+    fwd_free(&fr);
+    return rc;
+}
+
+/*
+ * read_hdrline - append one whole line from the client to hb
+ * Grows hb rather than splitting long lines. Returns the line length,
+ * 0 on EOF, -1 on error, -2 once hdrs pass MAX_REQHDRS_SIZE.
+ */
+ssize_t read_hdrline(rio_t *rio_client, HdrBuf *hb)
+{
+    size_t start = hb->len;
+    ssize_t n;
+
+    do{
+        if(hb->cap - hb->len < 2){
+            if(hb->cap >= MAX_REQHDRS_SIZE)
+                return -2;
+            hb->cap *= 2;
+            hb->buf = (char *)Realloc(hb->buf, hb->cap);
+        }
+        if((n = rio_readlineb(rio_client, hb->buf + hb->len, hb->cap - hb->len)) <= 0)
+            return n;
+        hb->len += n;
+    } while(hb->buf[hb->len - 1] != '\n');
+    return hb->len - start;
+}
+
+/*
+ * handle_request - read a req head from the client and serve it
+ * A fresh RAM hit is answered from the req line alone, and the hdrs
+ * are drained after the resp is out; everything else reads the whole
+ * head first. Returns 1 if the conn can carry another req, 0 if it
+ * must close.
+ */
+int handle_request(rio_t *rio_client, int clientfd, HdrBuf *hb, FwdReq *fr)
+{
+    HttpHead *head = &hb->head;
+    char key[MAXLINE];
+    char *url;
+    unsigned long hash = 0;
+    int keepalive, gzip = 0, looked = 0, get, nobody, rc;
+    ssize_t n;
+    uint64_t t;
+    CacheObject *obj = NULL, *stale = NULL;
+    DiskRef dr;
+    Hdr *h;
+
+    // receive req line
+    hb->len = 0;
+    head_init(head, 0);
+    while((rc = head_startline(head, hb->buf, hb->len)) == HEAD_MORE){
+        if((n = read_hdrline(rio_client, hb)) <= 0){
+            if(n == -2)
+                send_error(clientfd, "414", "URI Too Long");
+            return 0;
+        }
+        if(!hb->start)
+            hb->start = stats_now();
+    }
+    if(rc < 0 || head->method.len >= 8){
+        send_error(clientfd, "400", "Bad Request");
+        return 0;
+    }
+    if(head->target.len >= MAXLINE){
+        send_error(clientfd, "414", "URI Too Long");
+        return 0;
+    }
+    // terminate the url in place, over the blank after it
+    url = hb->buf + head->target.off;
+    url[head->target.len] = '\0';
+    // HTTP/1.1 clients persist unless they say otherwise
+    keepalive = head->major == 1 && head->minor >= 1;
+    key_canon(url, key, sizeof(key));
 
+    // cache hit on the req line alone; a gzipped object waits for
+    // Accept-Encoding, a 1.0 client may ask for keep-alive in a hdr,
+    // and the hit promises keep-alive, so a Connection hdr or a head
+    // not all in yet sees the whole head read first
+    if(keepalive && head->method.len == 3 &&
+       !strncasecmp(hb->buf + head->method.off, "GET", 3) && !stats_is_path(url) &&
+       peek_plainhead(rio_client)){
+        t = stats_time(STAGE_PARSE, hb->start);
+        stats_count(CNT_REQUESTS, 1);
+        hash = cache_hash(key);
+        obj = cache_lookup(key, hash);
+        stats_time(STAGE_LOOKUP, t);
+        looked = 1;
+        // a Vary marker needs the hdrs too
+        if(obj && !obj->vary && !obj->rawlen && cache_servable(obj, STALE_REVALIDATE)){
+            if(answer_hit(clientfd, key, obj, keepalive, 0, 0) < 0 ||
+               read_head(rio_client, hb) != HEAD_DONE)
+                return 0;
+            return keepalive;
+        }
+    }
+
+    // read the rest of the head in place; kept hdrs are fwd as slices
+    // of hb
+    if((rc = read_head(rio_client, hb)) != HEAD_DONE){
+        if(rc == HEAD_FULL)
+            send_error(clientfd, "431", "Request Header Fields Too Large");
+        else if(rc == HEAD_BAD)
+            send_error(clientfd, "400", "Bad Request");
+        if(obj)
+            cache_release(obj);
+        return 0;
+    }
+    // hb->buf may have moved
+    url = hb->buf + head->target.off;
+    keepalive = client_keepalive(hb, keepalive);
+    // only GET is answered from the cache, and HEAD with the hdrs alone
+    get = head->method.len == 3 && !strncasecmp(hb->buf + head->method.off, "GET", 3);
+    nobody = head->method.len == 4 && !strncasecmp(hb->buf + head->method.off, "HEAD", 4);
+    for(int i = 0; i < head->nhdrs; i++){
+        h = &head->hdrs[i];
+        // a compressing cache asks the server for identity bodies and
+        // encodes them itself
+        if(h->id == HDR_ACCEPT_ENCODING){
+            gzip = accepts_gzip(hb->buf + h->value.off);
+            if(cache_compressing())
+                continue;
+        }
+        // skip hdrs the proxy sets; fwd other hdrs unchanged
+        if(!is_replaced_hdr(h->id))
+            fwd_add(fr, h->line.off, h->line.len);
+    }
+    if(!looked){
+        t = stats_time(STAGE_PARSE, hb->start);
+        stats_count(CNT_REQUESTS, 1);
+        // the proxy's own metrics page
+        if(stats_is_path(url))
+            return send_stats(clientfd, url, keepalive) == 0 && keepalive;
+        hash = cache_hash(key);
+        if(get || nobody)
+            obj = cache_lookup(key, hash);
+        stats_time(STAGE_LOOKUP, t);
+    }
+    // a Vary marker leads to this req's variant
+    if((obj = key_resolve(obj, key, sizeof(key), &hash, hb->buf, head))){
+        if(cache_servable(obj, STALE_REVALIDATE))
+            return answer_hit(clientfd, key, obj, keepalive, gzip, nobody) == 0 && keepalive;
+        // revalidate, keeping the copy in case the server fails
+        stale = obj;
+    }
+    // disk tier hit; hot RAM-sized objects move up
+    if(!stale && (get || nobody) && disk_lookup(key, hash, &dr) == 0){
+        if(time(NULL) < cache_expiry(dr.data, dr.hdrlen)){
+            stats_count(CNT_DISK_HITS, 1);
+            rc = send_disk(clientfd, &dr, keepalive, nobody);
+            if(dr.hot)
+                cache_add(key, hash, dr.data, dr.len, dr.hdrlen, dr.framed);
+            disk_release(&dr);
+            return rc == 0 && keepalive;
+        }
+        disk_release(&dr);
+    }
+    return handle_miss(clientfd, hb, fr, url, key, hash, stale, keepalive, gzip);
+}
+
+/*
+ * handle_miss - fetch a url no cache tier could answer, leading a
+ * flight or following one
+ * Only a miss needs the url parts, so they live in this frame rather
+ * than handle_request's. The server gets url as the client sent it;
+ * the flight and the cache go by key. Drops the stale ref. Returns as
+ * handle_request does.
+ */
+int handle_miss(int clientfd, HdrBuf *hb, FwdReq *fr, char *url, char *key,
+                unsigned long hash, CacheObject *stale, int keepalive, int gzip)
+{
     char method[8];
-    char url[MAXLINE];
-    char version[16];
-    char protocol[8];
     char hostname[MAXLINE];
     char port[8];
     char resource[MAXLINE];
-    char *tmp;
+    int leader, rc;
+    Flight *f;
+    Fetch ft;
 
-    size_t objectlen, len;
-    rio_t rio_client, rio_server;
+    // only GET goes upstream; a HEAD the cache could not answer too
+    slice_copy(hb->buf, hb->head.method, method, sizeof(method));
+    if(strcasecmp(method, "GET")){
+        send_error(clientfd, "501", "Not Implemented");
+        if(stale)
+            cache_release(stale);
+        return 0;
+    }
+    if(parse_url(url, hostname, port, resource) < 0){
+        if(stale)
+            cache_release(stale);
+        return 0;
+    }
+    stats_count(CNT_MISSES, 1);
 
-    // receive req line
-    Rio_readinitb(&rio_client, clientfd);
-    if(Rio_readlineb(&rio_client, req, MAXBUF) < 0)
-        return end_thread(&clientfd, &serverfd);
-    // split req line
-    if(sscanf(req, "%s %s %s", method, url, version) != 3)
-        return end_thread(&clientfd, &serverfd);
-
-    // cache hit
-    if((len = cache_lookup(url, object)) > 0){;
-        rio_writen(clientfd, object, len);
-        return end_thread(&clientfd, &serverfd);
-    }
-    
-    // cache miss; continue
-    // ignore other methods than GET
-    if(strcasecmp(method, "GET"))
-        return end_thread(&clientfd, &serverfd);
-    // parse URL
-    if(strstr(url, "://")){
-        // match off leading "http://"
-		if(sscanf(url, "%[^:]://%[^/]%s", protocol, hostname, resource) != 3){
-            return end_thread(&clientfd, &serverfd);
+    // share a running fetch of the same url, or lead a new one
+    f = flight_join(key, hash, &leader);
+    if(!leader){
+        // the leader revalidates for everyone
+        if(stale)
+            cache_release(stale);
+        stale = NULL;
+        rc = follow_flight(clientfd, f, keepalive, key, hb);
+        flight_release(f);
+        if(rc != FOLLOW_RETRY)
+            return rc;
+        // the leader gave up before sending anything, or got a
+        // variant other than ours; fetch alone
+        f = flight_new(key, hash);
+    }
+
+    fwd_reqline(fr, method, hostname, port, resource, 1);
+    ft.url = key;
+    ft.hash = hash;
+    ft.hostname = hostname;
+    ft.port = port;
+    ft.fr = fr;
+    ft.base = hb->buf;
+    ft.head = &hb->head;
+    ft.client11 = hb->head.major == 1 && hb->head.minor >= 1;
+    ft.keepalive = keepalive;
+    ft.gzip = gzip;
+    ft.f = f;
+    ft.stale = stale;
+    rc = fetch_object(clientfd, &ft);
+    if(stale)
+        cache_release(stale);
+    return rc;
+}
+
+/*
+ * read_head - read and parse the rest of the req head into hb
+ * Returns HEAD_DONE, HEAD_BAD, HEAD_FULL (also once the hdrs pass
+ * MAX_REQHDRS_SIZE), or 0 on EOF or a read error.
+ */
+int read_head(rio_t *rio_client, HdrBuf *hb)
+{
+    ssize_t n;
+    int rc;
+
+    while((rc = head_parse(&hb->head, hb->buf, hb->len)) == HEAD_MORE)
+        if((n = read_hdrline(rio_client, hb)) <= 0)
+            return n == -2 ? HEAD_FULL : 0;
+    return rc;
+}
+
+/*
+ * client_keepalive - keepalive as amended by the client's Connection
+ * or Proxy-Connection hdr
+ */
+int client_keepalive(HdrBuf *hb, int keepalive)
+{
+    Hdr *h;
+    char *v;
+
+    for(int i = 0; i < hb->head.nhdrs; i++){
+        h = &hb->head.hdrs[i];
+        if(h->id != HDR_CONNECTION && h->id != HDR_PROXY_CONNECTION)
+            continue;
+        v = hb->buf + h->value.off;
+        if(!strncasecmp(v, "close", 5))
+            keepalive = 0;
+        else if(!strncasecmp(v, "keep-alive", 10))
+            keepalive = 1;
+    }
+    return keepalive;
+}
+
+/*
+ * peek_plainhead - true if the rest of the req head is already in
+ * rio's buffer and has no Connection or Proxy-Connection hdr
+ * Then an HTTP/1.1 client conn persists, whatever the hdrs say, and a
+ * hit sent before they are read can say so.
+ */
+int peek_plainhead(rio_t *rio_client)
+{
+    char *p = rio_client->rio_bufptr, *end = p + rio_client->rio_cnt, *eol;
+
+    for(; p < end && (eol = memchr(p, '\n', end - p)); p = eol + 1){
+        if(*p == '\r' || *p == '\n')
+            return 1;
+        if(hdr_is(p, "Connection") || hdr_is(p, "Proxy-Connection"))
+            return 0;
+    }
+    return 0;
+}
+
+/*
+ * answer_hit - send a servable RAM hit and drop its ref
+ * An expired one is refreshed off the req path. nobody answers a HEAD.
+ * Returns 0, or -1 if the send failed.
+ */
+int answer_hit(int clientfd, char *key, CacheObject *obj, int keepalive, int gzip,
+               int nobody)
+{
+    int rc;
+
+    if(cache_fresh(obj))
+        stats_count(CNT_HITS, 1);
+    else{
+        stats_count(CNT_STALE_HITS, 1);
+        refresh_queue(key, obj);
+    }
+    rc = send_hit(clientfd, obj, keepalive, gzip, nobody);
+    cache_release(obj);
+    return rc;
+}
+
+/*
+ * fetch_object - fetch a url for the client and the flight it leads
+ * ft->fr holds the req line; validators of a stale copy are added
+ * here. A 304 to them, or a server failure within the stale copy's
+ * stale-if-error window, is answered from the stale copy. A Vary'd
+ * resp is stored under the variant key for ft->head. Drops the flight
+ * ref. Returns 1 if the client conn can carry another req, 0 if it
+ * must close.
+ */
+int fetch_object(int clientfd, Fetch *ft)
+{
+    char key[MAXLINE];
+    int serverfd = -1, reused, rc, iovcnt;
+    size_t n;
+    Flight *f = ft->f;
+    CacheObject *stale = ft->stale;
+    struct iovec *iov;
+    rio_t rio_server;
+    ObjBuf ob;
+
+    if(stale && stale->cond)
+        fwd_extra(ft->fr, stale->cond);
+    iov = (struct iovec *)Malloc((ft->fr->nslices + 2) * sizeof(struct iovec));
+
+    // fwd req to a pooled or new server conn; a pooled conn may have
+    // been closed by the server meanwhile, so retry once on a fresh one
+    ob.disk = NULL;
+    ob.len = 0;
+    ob.overflow = 0;
+    ob.firstbyte = 0;
+    do{
+        if((serverfd = upstream_get(ft->hostname, ft->port, &reused)) < 0){
+            rc = RELAY_NORESP;
+            break;
+        }
+        ob.len = 0;
+        ob.overflow = 0;
+        ob.buf = f->buf;
+        ob.flight = f;
+        ob.disk = NULL;
+        ob.stale = stale;
+        ob.ft = ft;
+        ob.firstbyte = 0;
+        Rio_readinitb(&rio_server, serverfd);
+        // rio_writev consumes iov, so rebuild it per attempt
+        iovcnt = fwd_iovec(ft->fr, ft->base, iov);
+        if(rio_writev(serverfd, iov, iovcnt) != ft->fr->total)
+            rc = RELAY_NORESP;
+        else
+            rc = relay_resp(&rio_server, clientfd, ft->client11, ft->keepalive, &ob);
+        if(rc == RELAY_NORESP){
+            Close(serverfd);
+            serverfd = -1;
         }
+    } while(rc == RELAY_NORESP && reused);
+    free(iov);
+
+    if(ob.disk){
+        if(rc == RELAY_NORESP || rc == RELAY_FAIL ||
+           key_store(ft->url, key, sizeof(key), disk_slotdata(ob.disk), ob.hdrlen,
+                     ft->base, ft->head) < 0)
+            disk_abort(ob.disk);
+        else
+            disk_commit(ob.disk, key, cache_hash(key), ob.hdrlen, ob.framed);
+    }
+    // nothing went out, so the last good copy can stand in
+    if(rc == RELAY_NORESP && stale && cache_servable(stale, STALE_ERROR))
+        rc = RELAY_STALE;
+    if(ob.firstbyte && rc != RELAY_NORESP && rc != RELAY_FAIL)
+        stats_time(STAGE_TRANSFER, ob.firstbyte);
+    if(rc == RELAY_NORESP || rc == RELAY_FAIL){
+        stats_count(CNT_ERRORS, 1);
+        flight_finish(f, FL_FAILED);
+        flight_release(f);
+        if(serverfd >= 0)
+            Close(serverfd);
+        return 0;
+    }
+    if(rc & (RELAY_NOTMOD | RELAY_STALE)){
+        stats_count(rc & RELAY_NOTMOD ? CNT_NOT_MODIFIED : CNT_STALE_HITS, 1);
+        // followers and the client get the stored copy; followers
+        // stream it as plain bytes, so a gzipped one is inflated
+        if((n = cache_copy(stale, f->buf))){
+            flight_hdrs(f, stale->hdrlen, stale->framed,
+                        key_store(ft->url, key, sizeof(key), f->buf, stale->hdrlen,
+                                  ft->base, ft->head) == 0 ? key : NULL);
+            flight_publish(f, n);
+        }
+        flight_finish(f, n ? FL_DONE : FL_FAILED);
+        rc = (rc & RELAY_SERVER_KA) |
+             (send_hit(clientfd, stale, ft->keepalive, ft->gzip, 0) == 0 && ft->keepalive ?
+              RELAY_CLIENT_KA : 0);
+    }
+    else{
+        // only complete objects are cached; insert before the flight ends
+        // so a miss arriving in between finds the cache, not a refetch
+        if(!ob.overflow && ob.len > 0 &&
+           key_store(ft->url, key, sizeof(key), ob.buf, ob.hdrlen, ft->base, ft->head) == 0)
+            cache_add(key, cache_hash(key), ob.buf, ob.len, ob.hdrlen, ob.framed);
+        // an unframed resp is shared only now that it is known to fit
+        if(!ob.overflow && !ob.framed)
+            flight_publish(f, ob.len);
+        flight_finish(f, ob.overflow ? FL_FAILED : FL_DONE);
+    }
+    flight_release(f);
+    // server conn is clean for the next req
+    if(rc & RELAY_SERVER_KA)
+        upstream_put(ft->hostname, ft->port, serverfd);
+    else if(serverfd >= 0)
+        Close(serverfd);
+    return (rc & RELAY_CLIENT_KA) != 0;
+}
+
+/*
+ * refresh_url - revalidate a stale object off the req path
+ * Run by the refresh threads. key is the object's cache key; a
+ * variant's Vary lines go out as the req hdrs that picked it. The
+ * resp goes to /dev/null; the cache and any reqs following the flight
+ * keep it.
+ */
+void refresh_url(char *key, CacheObject *obj)
+{
+    char url[MAXLINE];
+    char hostname[MAXLINE];
+    char port[8];
+    char resource[MAXLINE];
+    char req[2 * MAXLINE];
+    size_t urllen = strcspn(key, "\n");
+    HttpHead head;
+    FwdReq fr;
+    Fetch ft;
+    int leader, n;
+    Hdr *h;
+
+    // another refresh may have beaten us to it
+    if(cache_fresh(obj) || urllen >= MAXLINE)
+        return;
+    memcpy(url, key, urllen);
+    url[urllen] = '\0';
+    if(parse_url(url, hostname, port, resource) < 0)
+        return;
+    // the variant's hdrs parsed as a req of their own
+    n = snprintf(req, sizeof(req), "GET / HTTP/1.1\r\n%s\r\n", key[urllen] ? key + urllen + 1 : "");
+    head_init(&head, 0);
+    if(n >= sizeof(req) || head_parse(&head, req, n) != HEAD_DONE)
+        return;
+    ft.hash = cache_hash(key);
+    ft.f = flight_join(key, ft.hash, &leader);
+    if(!leader){
+        flight_release(ft.f);
+        return;
+    }
+    fwd_init(&fr);
+    fwd_reqline(&fr, "GET", hostname, port, resource, 1);
+    // a hdr the req lacked is keyed as empty and not sent
+    for(int i = 0; i < head.nhdrs; i++){
+        h = &head.hdrs[i];
+        if(h->value.len && !is_replaced_hdr(h->id))
+            fwd_add(&fr, h->line.off, h->line.len);
+    }
+    ft.url = key;
+    ft.hostname = hostname;
+    ft.port = port;
+    ft.fr = &fr;
+    ft.base = req;
+    ft.head = &head;
+    ft.client11 = 1;
+    ft.keepalive = 1;
+    ft.gzip = 0;
+    ft.stale = obj;
+    fetch_object(devnull, &ft);
+    fwd_free(&fr);
+}
+
+/*
+ * send_hit - write a cached object with this client's conn hdrs
+ * A gzipped object goes out as stored if the client accepts gzip, and
+ * inflated otherwise. nobody stops after the hdrs, for a HEAD.
+ */
+int send_hit(int clientfd, CacheObject *obj, int keepalive, int gzip, int nobody)
+{
+    char hdrs[32 + CACHE_HITHDRS_MAX];
+    char *body = obj->data + obj->hdrlen, *plain = NULL;
+    struct iovec iov[3];
+    size_t n, bodylen = obj->len - obj->hdrlen;
+    int rc = -1;
+
+    n = sprintf(hdrs, "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+    // chunked or close-delimited resps were cached unframed
+    n += cache_hithdrs(obj, gzip, hdrs + n);
+    // the body starts with the blank line ending the hdrs
+    if(nobody)
+        bodylen = 2;
+    else if(obj->rawlen && !gzip && !(body = plain = cache_inflate(obj, &bodylen)))
+        return -1;
+    // one writev, so hdrs and body share packets
+    iov[0].iov_base = obj->data;
+    iov[0].iov_len = obj->hdrlen;
+    iov[1].iov_base = hdrs;
+    iov[1].iov_len = n;
+    iov[2].iov_base = body;
+    iov[2].iov_len = bodylen;
+    if(rio_writev(clientfd, iov, 3) == obj->hdrlen + n + bodylen){
+        stats_count(CNT_HIT_BYTES, obj->hdrlen + n + bodylen);
+        rc = 0;
     }
-	else{
-		if(sscanf(url, "%[^/]%s", hostname, resource) != 2){
-            return end_thread(&clientfd, &serverfd);
+    free(plain);
+    return rc;
+}
+
+/*
+ * send_disk - write a disk tier object; the body goes by sendfile()
+ * nobody stops after the hdrs, for a HEAD.
+ */
+int send_disk(int clientfd, DiskRef *ref, int keepalive, int nobody)
+{
+    char hdrs[96];
+    size_t pos;
+    ssize_t n;
+
+    n = sprintf(hdrs, "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+    if(!ref->framed)
+        n += sprintf(hdrs + n, "Content-Length: %zu\r\n",
+                     ref->len - ref->hdrlen - 2);
+    if(nobody)
+        n += sprintf(hdrs + n, "\r\n");
+    if(rio_writen(clientfd, ref->data, ref->hdrlen) != ref->hdrlen ||
+       rio_writen(clientfd, hdrs, n) != n)
+        return -1;
+    if(nobody){
+        stats_count(CNT_HIT_BYTES, ref->hdrlen + n);
+        return 0;
+    }
+    for(pos = ref->hdrlen; pos < ref->len; ){
+        if((n = disk_sendfile(clientfd, ref, &pos)) < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+    }
+    stats_count(CNT_HIT_BYTES, ref->len + strlen(hdrs));
+    return 0;
+}
+
+/*
+ * send_stats - write the metrics page
+ */
+int send_stats(int clientfd, char *url, int keepalive)
+{
+    char buf[MAXBUF];
+    size_t n;
+
+    if((n = stats_reply(url, buf, MAXBUF, keepalive)) == 0)
+        return -1;
+    return rio_writen(clientfd, buf, n) == n ? 0 : -1;
+}
+
+/*
+ * follow_flight - stream another req's fetch of the same url
+ * Returns 1 if the conn can carry another req, 0 if it must close, or
+ * FOLLOW_RETRY if the fetch failed before anything was sent or got a
+ * variant other than the one the req in hb, made for key, picks.
+ */
+int follow_flight(int clientfd, Flight *f, int keepalive, char *key, HdrBuf *hb)
+{
+    char hdrs[64];
+    size_t sent = 0, len;
+    int state, n;
+
+    while(1){
+        state = flight_wait(f, sent, &len, 1);
+        if(sent == 0){
+            if(state == FL_FAILED || len == 0 ||
+               !key_shares(f->store, key, f->buf, f->hdrlen, hb->buf, &hb->head))
+                return FOLLOW_RETRY;
+            n = sprintf(hdrs, "Connection: %s\r\n", keepalive ? "keep-alive" : "close");
+            if(!f->framed && state == FL_DONE)
+                n += sprintf(hdrs + n, "Content-Length: %zu\r\n", len - f->hdrlen - 2);
+            if(rio_writen(clientfd, f->buf, f->hdrlen) != f->hdrlen ||
+               rio_writen(clientfd, hdrs, n) != n)
+                return 0;
+            sent = f->hdrlen;
         }
+        if(state == FL_FAILED)
+            return 0;   // cut short; short of its Content-Length
+        if(rio_writen(clientfd, f->buf + sent, len - sent) != len - sent)
+            return 0;
+        sent = len;
+        if(state == FL_DONE)
+            return keepalive;
+    }
+}
+
+/*
+ * obj_append - append resp bytes to the flight buffer
+ * Followers of a framed resp see the hdrs once the blank line is in,
+ * then every chunk. An unframed one could still overflow and leave
+ * them no way to tell the body was cut, so fetch_object publishes it
+ * whole at the end.
+ */
+void obj_append(ObjBuf *ob, char *buf, size_t n)
+{
+    if(ob->overflow)
+        return;
+    if(ob->len + n > MAX_OBJECT_SIZE){
+        obj_overflow(ob);
+        return;
     }
-    // pull out port number if present
-    tmp = strstr(hostname, ":");
-	if (tmp) {
-		*tmp = '\0';
-		strcpy(port, tmp + 1);
-	}
-	else
-		strcpy(port, "80");
-
-    // build fwd req
-    // req line
-    strcpy(req_fwd, method);
-    strcat(req_fwd, " ");
-    strcat(req_fwd, resource);
-    strcat(req_fwd, " ");
-    strcat(req_fwd, "HTTP/1.0\r\n");
-    // Host hdr
-    strcat(req_fwd, "Host: ");
-    strcat(req_fwd, hostname);
-    strcat(req_fwd, ":");
-    strcat(req_fwd, port);
-    strcat(req_fwd, "\r\n");
-    // User-Agent, Connection, Proxy-Connection hdr
-    strcat(req_fwd, user_agent_hdr);
-    strcat(req_fwd, conn_hdr);
-    strcat(req_fwd, proxy_conn_hdr);
-    // read following hdrs
-    while(Rio_readlineb(&rio_client, req, MAXBUF) > 0){
-        // end of req
-        if(!strcmp(req, "\r\n")){
-            strcat(req_fwd, req);
+    memcpy(ob->buf + ob->len, buf, n);
+    ob->len += n;
+    if(ob->len > ob->hdrlen && ob->framed)
+        flight_publish(ob->flight, ob->len);
+}
+
+/* too big to cache or share; followers that haven't started refetch */
+void obj_overflow(ObjBuf *ob)
+{
+    ob->overflow = 1;
+    flight_finish(ob->flight, FL_FAILED);
+}
+
+/*
+ * relay_resp - relay one resp from server to client
+ * Hop-by-hop hdrs are replaced by our own Connection hdr. Chunked
+ * bodies go out as-is to HTTP/1.1 clients and decoded to HTTP/1.0
+ * clients; the cache copy in ob is always decoded. Returns
+ * RELAY_NORESP if the server sent nothing, RELAY_FAIL on a broken
+ * transfer, else a mask of RELAY_CLIENT_KA and RELAY_SERVER_KA.
+ */
+int relay_resp(rio_t *rio_server, int clientfd, int client11, int keepalive, ObjBuf *ob)
+{
+    char *line, *hdrs;
+    size_t hdrslen = 0, cap = MAXBUF;
+    ssize_t n;
+    int rc;
+    uint64_t sent = stats_now();
+
+    // status line and hdrs, copied once straight out of rio's buffer
+    if((n = rio_getlineb(rio_server, &line)) <= 0)
+        return RELAY_NORESP;
+    ob->firstbyte = stats_time(STAGE_FIRSTBYTE, sent);
+    hdrs = (char *)Malloc(cap);
+    do{
+        // grow for long hdrs such as big cookies, leaving room for
+        // the hdrs we add
+        while(hdrslen + n + 64 >= cap){
+            if(cap >= MAX_RESPHDRS_SIZE){
+                free(hdrs);
+                return RELAY_FAIL;
+            }
+            cap *= 2;
+            hdrs = (char *)Realloc(hdrs, cap);
+        }
+        memcpy(hdrs + hdrslen, line, n);
+        hdrslen += n;
+        // a blank line, not the tail of a line rio split up
+        if(n == 2 && !memcmp(line, "\r\n", 2) && (hdrslen == 2 || hdrs[hdrslen - 3] == '\n'))
             break;
+    } while((n = rio_getlineb(rio_server, &line)) > 0);
+    rc = n <= 0 ? RELAY_FAIL :
+         relay_head(rio_server, clientfd, client11, keepalive, ob, hdrs, hdrslen);
+    free(hdrs);
+    return rc;
+}
+
+/*
+ * relay_head - relay the resp whose hdr block, up to and including
+ * its blank line, is hdrs[0..hdrslen); hdrs has 64 bytes spare for
+ * the hdrs we add. Returns as relay_resp does.
+ */
+int relay_head(rio_t *rio_server, int clientfd, int client11, int keepalive,
+               ObjBuf *ob, char *hdrs, size_t hdrslen)
+{
+    char key[MAXLINE];
+    char *line, crlf[2];
+    ssize_t n;
+    long size;
+    RespInfo ri;
+    int te_out, rc;
+
+    hdrs[hdrslen] = '\0';
+    if(parse_resphdrs(hdrs, hdrslen, &ri) < 0)
+        return RELAY_FAIL;
+    stats_count(CNT_SERVER_BYTES, hdrslen);
+    // our revalidation came back unchanged; the stale copy is good again
+    if(ob->stale && ob->stale->cond && ri.status == 304){
+        cache_refresh(ob->stale, hdrs, hdrslen);
+        return ri.keepalive ? RELAY_NOTMOD | RELAY_SERVER_KA : RELAY_NOTMOD;
+    }
+    // a server error the stale copy may hide; the body is left unread
+    if(ob->stale && ri.status >= 500 && cache_servable(ob->stale, STALE_ERROR))
+        return RELAY_STALE;
+    if(ri.nobody)
+        ri.clen = 0;
+
+    // persist with the client only if the body end is known to it
+    te_out = ri.chunked && client11;
+    if(ri.clen < 0 && !te_out)
+        keepalive = 0;
+
+    // hdrs out, minus hop-by-hop ones
+    if(strip_resp(hdrs, hdrslen, &ob->hdrlen) < 0)
+        return RELAY_FAIL;
+    hdrslen = ob->hdrlen;
+    ob->framed = ri.clen >= 0;
+    // Content-Length tells up front if it can't be cached in RAM;
+    // the disk tier takes it if there is room
+    if(ri.clen > MAX_OBJECT_SIZE){
+        obj_overflow(ob);
+        if(cache_expiry(hdrs, hdrslen) >= 0 &&
+           (ob->disk = disk_reserve(hdrslen + 2 + ri.clen))){
+            disk_append(ob->disk, hdrs, hdrslen);
+            disk_append(ob->disk, "\r\n", 2);
         }
-        // skip already written hdrs
-        else if(strstr(req, "Host:") ||
-                strstr(req, "User-Agent:") ||
-                strstr(req, "Connection:") ||
-                strstr(req, "Proxy-Connection:"))
-            continue;
-        // fwd other hdrs unchanged
-        else
-            strcat(req_fwd, req);
-    }
-
-    // connect and fwd req to server
-    if((serverfd = Open_clientfd(hostname, port)) < 0)
-        return end_thread(&clientfd, &serverfd);
-    rio_writen(serverfd, req_fwd, strlen(req_fwd));
-
-    // receive and fwd from server to client
-    Rio_readinitb(&rio_server, serverfd);
-    memset(object, 0, MAX_OBJECT_SIZE);
-    objectlen = 0;
-    while((len = Rio_readnb(&rio_server, resp, MAXBUF)) > 0){
-        rio_writen(clientfd, resp, len);
-        if(objectlen + len <= MAX_OBJECT_SIZE){
-            memcpy(object+objectlen, resp, len);
-            objectlen += len;
+    }
+    flight_hdrs(ob->flight, ob->hdrlen, ob->framed,
+                key_store(ob->ft->url, key, sizeof(key), hdrs, hdrslen, ob->ft->base,
+                          ob->ft->head) == 0 ? key : NULL);
+    obj_append(ob, hdrs, hdrslen);
+    obj_append(ob, "\r\n", 2);
+    n = hdrslen;
+    if(te_out)
+        n += sprintf(hdrs + n, "Transfer-Encoding: chunked\r\n");
+    n += sprintf(hdrs + n, "Connection: %s\r\n\r\n", keepalive ? "keep-alive" : "close");
+    if(rio_writen(clientfd, hdrs, n) != n)
+        return RELAY_FAIL;
+
+    rc = keepalive ? RELAY_CLIENT_KA : 0;
+    if(ri.clen >= 0){
+        // Content-Length body
+        if(relay_body(rio_server, clientfd, ri.clen, ob) < 0)
+            return RELAY_FAIL;
+        return ri.keepalive ? rc | RELAY_SERVER_KA : rc;
+    }
+    if(ri.chunked){
+        // chunk size line, data, CRLF; last chunk has size 0
+        while(1){
+            // a whole line ends in '\n', which stops strtol
+            if((n = rio_getlineb(rio_server, &line)) <= 0 || line[n - 1] != '\n')
+                return RELAY_FAIL;
+            if(te_out && rio_writen(clientfd, line, n) != n)
+                return RELAY_FAIL;
+            if((size = strtol(line, NULL, 16)) <= 0)
+                break;
+            if(relay_body(rio_server, clientfd, size, ob) < 0)
+                return RELAY_FAIL;
+            // CRLF closing the chunk data
+            if(rio_readnb(rio_server, crlf, 2) != 2)
+                return RELAY_FAIL;
+            if(te_out && rio_writen(clientfd, crlf, 2) != 2)
+                return RELAY_FAIL;
         }
+        // trailers up to the blank line
+        do{
+            if((n = rio_getlineb(rio_server, &line)) <= 0)
+                return RELAY_FAIL;
+            if(te_out && rio_writen(clientfd, line, n) != n)
+                return RELAY_FAIL;
+        } while(n != 2 || memcmp(line, "\r\n", 2));
+        return ri.keepalive ? rc | RELAY_SERVER_KA : rc;
     }
-    if(objectlen <= MAX_OBJECT_SIZE)
-        cache_add(url, object, objectlen);
-    return end_thread(&clientfd, &serverfd);
+    // close-delimited body
+    return relay_body(rio_server, clientfd, -1, ob) < 0 ? RELAY_FAIL : rc;
 }
 
-void *end_thread(int *clientfd, int *serverfd)
+/*
+ * relay_body - relay len body bytes, or up to EOF if len < 0
+ * Bytes are copied while the resp may still be cached. Once ob has
+ * overflowed nobody will keep them, so the rest is spliced through a
+ * kernel pipe and never enters user space.
+ */
+int relay_body(rio_t *rio_server, int clientfd, long len, ObjBuf *ob)
 {
-    // close open fds
-    if(*serverfd >= 0)
-        Close(*serverfd);
-    Close(*clientfd);
-    return NULL;
-}
\ No newline at end of file
+    char resp[MAXBUF];
+    ssize_t n;
+
+    while(len != 0 && (!ob->overflow || ob->disk)){
+        n = rio_readnb(rio_server, resp, (len < 0 || len > MAXBUF) ? MAXBUF : len);
+        if(n < 0 || (n == 0 && len > 0))
+            return -1;
+        if(n == 0)
+            return 0;   // EOF
+        stats_count(CNT_SERVER_BYTES, n);
+        if(rio_writen(clientfd, resp, n) != n)
+            return -1;
+        if(!ob->disk)
+            obj_append(ob, resp, n);
+        else if(disk_append(ob->disk, resp, n) < 0){
+            disk_abort(ob->disk);
+            ob->disk = NULL;
+        }
+        if(len > 0)
+            len -= n;
+    }
+    if(len == 0)
+        return 0;
+
+    // whatever rio already buffered goes out first
+    n = rio_server->rio_cnt;
+    if(len > 0 && n > len)
+        n = len;
+    if(n > 0){
+        stats_count(CNT_SERVER_BYTES, n);
+        if(rio_writen(clientfd, rio_server->rio_bufptr, n) != n)
+            return -1;
+        rio_server->rio_bufptr += n;
+        rio_server->rio_cnt -= n;
+        if(len > 0 && (len -= n) == 0)
+            return 0;
+    }
+    if((n = zc_relay(rio_server->rio_fd, clientfd, len)) < 0)
+        return -1;
+    stats_count(CNT_SERVER_BYTES, n);
+    return 0;
+}
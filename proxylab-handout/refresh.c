@@ -0,0 +1,82 @@
+/*
+ * refresh.c - background refresh of stale cached objects
+ *
+ * A hit on an object just past its expiry is answered from the stale
+ * copy right away and the url is queued here. A few refresher threads
+ * run the conditional fetch, so no client waits on the server round
+ * trip. A url already queued is not queued twice.
+ */
+#include "refresh.h"
+
+static Refresh *qhead, *qtail;
+static int qlen;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static void (*fetch_fn)(char *url, CacheObject *obj);
+
+static void *refresher(void *vargp);
+
+void refresh_init(void (*fetch)(char *url, CacheObject *obj))
+{
+    pthread_t tid;
+
+    fetch_fn = fetch;
+    qhead = qtail = NULL;
+    qlen = 0;
+    for(int i = 0; i < REFRESH_THREADS; i++)
+        Pthread_create(&tid, NULL, refresher, NULL);
+}
+
+/*
+ * refresh_queue - refresh url in the background; takes its own pin on obj
+ */
+void refresh_queue(char *url, CacheObject *obj)
+{
+    Refresh *r;
+
+    pthread_mutex_lock(&lock);
+    // hits keep coming while the refresh waits, so most are dups
+    for(r = qhead; r; r = r->next)
+        if(!strcmp(r->url, url))
+            break;
+    if(r || qlen == REFRESH_QUEUE){
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    r = (Refresh *)Malloc(sizeof(Refresh));
+    r->url = strdup(url);
+    r->obj = obj;
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    r->next = NULL;
+    if(qtail)
+        qtail->next = r;
+    else
+        qhead = r;
+    qtail = r;
+    qlen++;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *refresher(void *vargp)
+{
+    Refresh *r;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(!qhead)
+            pthread_cond_wait(&queued, &lock);
+        r = qhead;
+        if(!(qhead = r->next))
+            qtail = NULL;
+        qlen--;
+        pthread_mutex_unlock(&lock);
+
+        fetch_fn(r->url, r->obj);
+        cache_release(r->obj);
+        free(r->url);
+        free(r);
+    }
+    return NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Background revalidation for stale-while-revalidate hits */
+#define REFRESH_THREADS 2
+#define REFRESH_QUEUE 64        /* pending refreshes; more are dropped */
+
+typedef struct Refresh {
+    char *url;
+    CacheObject *obj;           // pinned stale copy
+    struct Refresh *next;
+} Refresh;
+
+void refresh_init(void (*fetch)(char *url, CacheObject *obj));
+void refresh_queue(char *url, CacheObject *obj);
+
+#endif
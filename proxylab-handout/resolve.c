@@ -0,0 +1,275 @@
+/*
+ * resolve.c - cached, asynchronous name resolution for server conns
+ *
+ * Misses look up (host, port) in a table of recent getaddrinfo()
+ * results. Absent or expired entries are queued for a small pool of
+ * resolver threads, so the blocking call never runs on a worker or an
+ * event loop; callers wait on the entry (threads) or get an eventfd
+ * kicked (loops). The addrs are then raced: a new connect starts every
+ * CONNECT_STAGGER_MS until one succeeds, so a dead first addr costs a
+ * short delay instead of a full connect timeout.
+ */
+#include <poll.h>
+#include "resolve.h"
+#include "stats.h"
+
+static Resolv *buckets[RESOLVE_BUCKETS];
+static Resolv *qhead, *qtail;   // lookups for the resolver threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;     // lookup ended
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;   // queue not empty
+
+static void *resolver(void *vargp);
+
+static unsigned bucket_of(char *host, char *port)
+{
+    unsigned h = 5381;
+    for(char *p = host; *p; p++)
+        h = h * 33 + (unsigned char)tolower(*p);
+    for(char *p = port; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    return h % RESOLVE_BUCKETS;
+}
+
+/* drop a ref; caller holds lock */
+static void put_locked(Resolv *r)
+{
+    if(--r->refcnt > 0)
+        return;
+    if(r->addrs)
+        freeaddrinfo(r->addrs);
+    free(r->host);
+    free(r->port);
+    free(r);
+}
+
+void resolve_init()
+{
+    pthread_t tid;
+
+    memset(buckets, 0, sizeof(buckets));
+    qhead = qtail = NULL;
+    for(int i = 0; i < RESOLVE_THREADS; i++)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * resolve_lookup - a ref to the entry for (host, port)
+ * A fresh entry may still be RS_PENDING; then efd, if not -1, is
+ * kicked once it ends. Otherwise wait with resolve_wait.
+ */
+Resolv *resolve_lookup(char *host, char *port, int efd)
+{
+    Resolv **pp, *r;
+    ResolvWaiter *w;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&lock);
+    for(pp = &buckets[bucket_of(host, port)]; (r = *pp); pp = &r->next)
+        if(!strcasecmp(r->host, host) && !strcmp(r->port, port))
+            break;
+    if(r && r->state != RS_PENDING && now >= r->expires){
+        // stale; holders keep the old list, the table gets a new one
+        *pp = r->next;
+        put_locked(r);
+        r = NULL;
+    }
+    if(!r){
+        r = (Resolv *)Malloc(sizeof(Resolv));
+        r->host = strdup(host);
+        r->port = strdup(port);
+        r->addrs = NULL;
+        r->state = RS_PENDING;
+        r->expires = 0;
+        r->refcnt = 2;  // table and queue
+        r->waiters = NULL;
+        r->next = buckets[bucket_of(host, port)];
+        buckets[bucket_of(host, port)] = r;
+        r->qnext = NULL;
+        if(qtail)
+            qtail->qnext = r;
+        else
+            qhead = r;
+        qtail = r;
+        pthread_cond_signal(&queued);
+    }
+    r->refcnt++;
+    if(r->state == RS_PENDING && efd >= 0){
+        w = (ResolvWaiter *)Malloc(sizeof(ResolvWaiter));
+        w->fd = efd;
+        w->next = r->waiters;
+        r->waiters = w;
+    }
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+/*
+ * resolve_wait - state of the lookup
+ * If block is set, first waits until it is no longer RS_PENDING.
+ */
+int resolve_wait(Resolv *r, int block)
+{
+    int state;
+
+    pthread_mutex_lock(&lock);
+    while(block && r->state == RS_PENDING)
+        pthread_cond_wait(&done, &lock);
+    state = r->state;
+    pthread_mutex_unlock(&lock);
+    return state;
+}
+
+/* stop kicking efd, e.g. because its conn is closing */
+void resolve_unwatch(Resolv *r, int efd)
+{
+    ResolvWaiter **pp, *w = NULL;
+
+    pthread_mutex_lock(&lock);
+    for(pp = &r->waiters; *pp; pp = &(*pp)->next){
+        if((*pp)->fd == efd){
+            w = *pp;
+            *pp = w->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    free(w);
+}
+
+void resolve_release(Resolv *r)
+{
+    pthread_mutex_lock(&lock);
+    put_locked(r);
+    pthread_mutex_unlock(&lock);
+}
+
+static void *resolver(void *vargp)
+{
+    struct addrinfo hints, *addrs;
+    ResolvWaiter *w;
+    uint64_t one = 1;
+    Resolv *r;
+    int rc;
+
+    Pthread_detach(Pthread_self());
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(!qhead)
+            pthread_cond_wait(&queued, &lock);
+        r = qhead;
+        if(!(qhead = r->qnext))
+            qtail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        // host and port are immutable, so no lock is needed here
+        if((rc = getaddrinfo(r->host, r->port, &hints, &addrs)) != 0){
+            gai_error(rc, "getaddrinfo error");
+            addrs = NULL;
+        }
+
+        pthread_mutex_lock(&lock);
+        r->addrs = addrs;
+        r->state = addrs ? RS_READY : RS_FAILED;
+        r->expires = time(NULL) + (addrs ? RESOLVE_TTL : RESOLVE_NEG_TTL);
+        while((w = r->waiters)){
+            if(write(w->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                unix_error("resolve kick error");
+            r->waiters = w->next;
+            free(w);
+        }
+        pthread_cond_broadcast(&done);
+        put_locked(r);  // the queue's ref
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/*
+ * connect_start - begin a non-blocking connect to ai
+ * Returns the socket, connected or in progress, or -1.
+ */
+int connect_start(struct addrinfo *ai)
+{
+    int fd;
+
+    if((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                    ai->ai_protocol)) < 0)
+        return -1;
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+        return fd;
+    close(fd);
+    return -1;
+}
+
+/*
+ * connect_race - connect to the first addr that answers
+ * Returns a blocking connected socket, or -1 if all addrs failed.
+ */
+static int connect_race(struct addrinfo *ai)
+{
+    struct pollfd pfds[CONNECT_RACE];
+    int n = 0, fd = -1, err, flags;
+    socklen_t errlen;
+
+    while(fd < 0 && (ai || n > 0)){
+        // start the next addr when a slot is free
+        if(ai && n < CONNECT_RACE){
+            if((pfds[n].fd = connect_start(ai)) >= 0){
+                pfds[n].events = POLLOUT;
+                n++;
+            }
+            ai = ai->ai_next;
+            if(n == 0)
+                continue;
+        }
+        if(poll(pfds, n, ai ? CONNECT_STAGGER_MS : -1) < 0){
+            if(errno == EINTR)
+                continue;
+            unix_error("poll error");
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            if(!pfds[i].revents)
+                continue;
+            errlen = sizeof(err);
+            if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && !err){
+                fd = pfds[i].fd;
+                pfds[i] = pfds[--n];
+                break;
+            }
+            // refused or unreachable; its slot goes to the next addr
+            close(pfds[i].fd);
+            pfds[i--] = pfds[--n];
+        }
+    }
+    // losers
+    for(int i = 0; i < n; i++)
+        close(pfds[i].fd);
+    if(fd >= 0){
+        flags = fcntl(fd, F_GETFL, 0);
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    return fd;
+}
+
+/*
+ * resolve_open - blocking connect to host:port through the cache
+ */
+int resolve_open(char *host, char *port)
+{
+    uint64_t t = stats_now();
+    Resolv *r = resolve_lookup(host, port, -1);
+    int fd = -1;
+
+    if(resolve_wait(r, 1) == RS_READY){
+        t = stats_time(STAGE_DNS, t);
+        if((fd = connect_race(r->addrs)) >= 0)
+            stats_time(STAGE_CONNECT, t);
+    }
+    resolve_release(r);
+    return fd;
+}
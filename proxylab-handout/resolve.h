@@ -0,0 +1,51 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include "csapp.h"
+
+/* Resolved addr cache, keyed by (host, port) */
+#define RESOLVE_BUCKETS 64
+#define RESOLVE_THREADS 4       /* getaddrinfo() runs only on these */
+#define RESOLVE_TTL 60          /* secs a good answer is reused */
+#define RESOLVE_NEG_TTL 5       /* secs a failed lookup is remembered */
+
+/* Connect racing: a new addr joins every CONNECT_STAGGER_MS */
+#define CONNECT_RACE 4          /* connects in flight at once */
+#define CONNECT_STAGGER_MS 250
+
+/* Resolv states */
+#define RS_PENDING 0
+#define RS_READY   1
+#define RS_FAILED  2
+
+typedef struct ResolvWaiter {
+    int fd;                     // eventfd kicked when the lookup ends
+    struct ResolvWaiter *next;
+} ResolvWaiter;
+
+/*
+ * One lookup result. addrs never changes once the state leaves
+ * RS_PENDING; an expired entry is replaced in the table, not updated,
+ * so holders of a ref keep a consistent list.
+ */
+typedef struct Resolv {
+    char *host;
+    char *port;
+    struct addrinfo *addrs;     // NULL unless RS_READY
+    int state;
+    time_t expires;
+    int refcnt;                 // table, queue and callers
+    ResolvWaiter *waiters;      // event-mode callers
+    struct Resolv *next;        // table chain
+    struct Resolv *qnext;       // resolver queue
+} Resolv;
+
+void resolve_init();
+Resolv *resolve_lookup(char *host, char *port, int efd);
+int resolve_wait(Resolv *r, int block);
+void resolve_unwatch(Resolv *r, int efd);
+void resolve_release(Resolv *r);
+int resolve_open(char *host, char *port);
+int connect_start(struct addrinfo *ai);
+
+#endif
@@ -0,0 +1,74 @@
+#include "sbuf.h"
+
+static unsigned long elapsed_ns(struct timespec *from)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000000000UL + now.tv_nsec - from->tv_nsec;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(SbufItem));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->count = 0;
+    sp->nremoved = sp->waitsum = sp->waitmax = 0;
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+/* Insert fd onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int fd)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    SbufItem *item = &sp->buf[(++sp->rear)%(sp->n)];
+    item->fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &item->stamp);
+    sp->count++;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* Remove and return the first fd from buffer sp */
+int sbuf_remove(sbuf_t *sp)
+{
+    int fd;
+    unsigned long wait;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    SbufItem *item = &sp->buf[(++sp->front)%(sp->n)];
+    fd = item->fd;
+    sp->count--;
+    // negative fds are control messages, not conns
+    if(fd >= 0){
+        wait = elapsed_ns(&item->stamp);
+        sp->nremoved++;
+        sp->waitsum += wait;
+        if(wait > sp->waitmax)
+            sp->waitmax = wait;
+    }
+    V(&sp->mutex);
+    V(&sp->slots);
+    return fd;
+}
+
+/* Number of queued fds; a snapshot only */
+int sbuf_count(sbuf_t *sp)
+{
+    int count;
+    P(&sp->mutex);
+    count = sp->count;
+    V(&sp->mutex);
+    return count;
+}
@@ -0,0 +1,33 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* Bounded FIFO of connected fds, stamped with their enqueue time */
+typedef struct {
+    int fd;
+    struct timespec stamp;
+} SbufItem;
+
+typedef struct {
+    SbufItem *buf;          // buffer array
+    int n;                  // max number of slots
+    int front;              // buf[(front+1)%n] is first item
+    int rear;               // buf[rear%n] is last item
+    sem_t mutex;            // protects buf and stats
+    sem_t slots;            // counts available slots
+    sem_t items;            // counts available items
+    int count;              // items currently queued
+    /* queue wait stats */
+    unsigned long nremoved;
+    unsigned long waitsum;  // ns
+    unsigned long waitmax;  // ns
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int fd);
+int sbuf_remove(sbuf_t *sp);
+int sbuf_count(sbuf_t *sp);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * stats.c - lock-free metrics and the /__proxy/stats page
+ *
+ * Each thread that records a sample gets its own Stats block on first
+ * use, so counters and latency histograms are bumped without locks or
+ * contended cache lines. The page sums the blocks on
+ * demand and reports counters, cache totals and per-stage latency
+ * percentiles as text or, with "?format=json", as JSON.
+ */
+#include <stdarg.h>
+#include "stats.h"
+#include "cache.h"
+
+static Stats *blocks;           // every block ever made; never shrinks
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;       // its destructor frees a block for reuse
+static __thread Stats *mine;
+static time_t started;
+
+static const char *stage_names[NSTAGES] = {
+    "parse", "lookup", "dns", "connect", "firstbyte", "transfer", "total"
+};
+static const char *counter_names[NCOUNTERS] = {
+    "requests", "hits", "stale_hits", "disk_hits", "misses",
+    "not_modified", "errors", "hit_bytes", "server_bytes",
+    "loop_syscalls"
+};
+
+/* Bounded appender for the page */
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} Out;
+
+static void thread_exit(void *p)
+{
+    __atomic_store_n(&((Stats *)p)->inuse, 0, __ATOMIC_RELEASE);
+}
+
+void stats_init()
+{
+    pthread_key_create(&key, thread_exit);
+    started = time(NULL);
+}
+
+/* this thread's block; a retired thread's block is reused first */
+static Stats *my_stats()
+{
+    Stats *s;
+
+    if(mine)
+        return mine;
+    pthread_mutex_lock(&lock);
+    for(s = blocks; s; s = s->next)
+        if(!__atomic_load_n(&s->inuse, __ATOMIC_ACQUIRE))
+            break;
+    if(!s){
+        s = (Stats *)Calloc(1, sizeof(Stats));
+        s->next = blocks;
+        blocks = s;
+    }
+    s->inuse = 1;
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(key, s);
+    return mine = s;
+}
+
+/* one writer per block, so a plain load and store is enough */
+static inline void bump(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int hist_index(uint64_t v)
+{
+    int shift;
+
+    if(v >= 1ULL << HIST_MAX_BITS)
+        v = (1ULL << HIST_MAX_BITS) - 1;
+    if(v < HIST_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* highest value that lands in bucket i */
+static uint64_t hist_value(int i)
+{
+    int shift;
+
+    if(i < HIST_SUB)
+        return i;
+    shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * stats_now - monotonic clock in usecs
+ */
+uint64_t stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * stats_time - record the time since since under stage; returns now
+ * so consecutive stages can be chained
+ */
+uint64_t stats_time(int stage, uint64_t since)
+{
+    Stats *s = my_stats();
+    uint64_t now = stats_now();
+    uint64_t v = now > since ? now - since : 0;
+
+    bump(&s->hist[stage][hist_index(v)], 1);
+    bump(&s->sum[stage], v);
+    return now;
+}
+
+void stats_count(int counter, uint64_t n)
+{
+    bump(&my_stats()->counts[counter], n);
+}
+
+/*
+ * stats_is_path - url is the metrics page, asked of the proxy itself
+ */
+int stats_is_path(char *url)
+{
+    size_t n = strlen(STATS_PATH);
+
+    return !strncmp(url, STATS_PATH, n) && (url[n] == '\0' || url[n] == '?');
+}
+
+static void out(Out *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if(o->len >= o->size)
+        return;
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->len, o->size - o->len, fmt, ap);
+    va_end(ap);
+    o->len = n < 0 ? o->size : o->len + n;
+}
+
+/* smallest bucket value at or above fraction q of count samples */
+static uint64_t percentile(uint64_t *h, uint64_t count, double q)
+{
+    uint64_t want = (uint64_t)(q * count + 0.999999), seen = 0;
+
+    if(want == 0)
+        want = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++)
+        if((seen += h[i]) >= want)
+            return hist_value(i);
+    return 0;
+}
+
+/*
+ * format_stats - sum every block and write the page body
+ */
+static void format_stats(Out *o, int json)
+{
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *qnames[] = { "p50", "p90", "p99", "p999" };
+    uint64_t counts[NCOUNTERS] = { 0 }, sum[NSTAGES] = { 0 }, n[NSTAGES] = { 0 };
+    uint64_t (*hist)[HIST_BUCKETS], max;
+    CacheTotals ct;
+    Stats *s;
+
+    hist = Calloc(NSTAGES, sizeof(*hist));
+    pthread_mutex_lock(&lock);
+    for(s = blocks; s; s = s->next){
+        for(int i = 0; i < NCOUNTERS; i++)
+            counts[i] += __atomic_load_n(&s->counts[i], __ATOMIC_RELAXED);
+        for(int i = 0; i < NSTAGES; i++){
+            sum[i] += __atomic_load_n(&s->sum[i], __ATOMIC_RELAXED);
+            for(int j = 0; j < HIST_BUCKETS; j++)
+                hist[i][j] += __atomic_load_n(&s->hist[i][j], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    for(int i = 0; i < NSTAGES; i++)
+        for(int j = 0; j < HIST_BUCKETS; j++)
+            n[i] += hist[i][j];
+    cache_totals(&ct);
+
+    if(json){
+        out(o, "{\"uptime_secs\":%ld,\"counters\":{", (long)(time(NULL) - started));
+        for(int i = 0; i < NCOUNTERS; i++)
+            out(o, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+                (unsigned long long)counts[i]);
+        out(o, "},\"cache\":{\"hits\":%lu,\"misses\":%lu,\"evictions\":%lu,"
+            "\"rejects\":%lu,\"used\":%zu,\"size\":%zu},\"stages_usecs\":{",
+            ct.hits, ct.misses, ct.evictions, ct.rejects, ct.used, ct.size);
+    }
+    else{
+        out(o, "uptime_secs %ld\n", (long)(time(NULL) - started));
+        for(int i = 0; i < NCOUNTERS; i++)
+            out(o, "%s %llu\n", counter_names[i], (unsigned long long)counts[i]);
+        out(o, "cache_hits %lu\ncache_misses %lu\ncache_evictions %lu\n"
+            "cache_rejects %lu\ncache_used %zu\ncache_size %zu\n",
+            ct.hits, ct.misses, ct.evictions, ct.rejects, ct.used, ct.size);
+        out(o, "\n%-10s %10s %10s %10s %10s %10s %10s %10s\n", "usecs",
+            "count", "mean", "p50", "p90", "p99", "p999", "max");
+    }
+    for(int i = 0; i < NSTAGES; i++){
+        max = 0;
+        for(int j = HIST_BUCKETS - 1; j >= 0; j--){
+            if(hist[i][j]){
+                max = hist_value(j);
+                break;
+            }
+        }
+        if(json)
+            out(o, "%s\"%s\":{\"count\":%llu,\"mean\":%llu", i ? "," : "",
+                stage_names[i], (unsigned long long)n[i],
+                (unsigned long long)(n[i] ? sum[i] / n[i] : 0));
+        else
+            out(o, "%-10s %10llu %10llu", stage_names[i], (unsigned long long)n[i],
+                (unsigned long long)(n[i] ? sum[i] / n[i] : 0));
+        for(int q = 0; q < 4; q++){
+            uint64_t v = n[i] ? percentile(hist[i], n[i], qs[q]) : 0;
+            if(json)
+                out(o, ",\"%s\":%llu", qnames[q], (unsigned long long)v);
+            else
+                out(o, " %10llu", (unsigned long long)v);
+        }
+        if(json)
+            out(o, ",\"max\":%llu}", (unsigned long long)max);
+        else
+            out(o, " %10llu\n", (unsigned long long)max);
+    }
+    if(json)
+        out(o, "}}\n");
+    free(hist);
+}
+
+/*
+ * stats_reply - build the whole resp for the metrics page in buf
+ * Returns its length, or 0 if it does not fit in size bytes.
+ */
+size_t stats_reply(char *url, char *buf, size_t size, int keepalive)
+{
+    char body[MAXBUF / 2];
+    Out o = { body, sizeof(body), 0 };
+    int json = strstr(url, "format=json") != NULL;
+    size_t n;
+
+    format_stats(&o, json);
+    if(o.len >= o.size)
+        o.len = o.size - 1;
+    n = snprintf(buf, size, "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Cache-Control: no-store\r\n"
+                 "Connection: %s\r\n\r\n",
+                 json ? "application/json" : "text/plain", o.len,
+                 keepalive ? "keep-alive" : "close");
+    if(n >= size || o.len > size - n)
+        return 0;
+    memcpy(buf + n, body, o.len);
+    return n + o.len;
+}
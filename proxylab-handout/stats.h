@@ -0,0 +1,66 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+/* Reserved path, on reqs sent to the proxy itself, for the metrics page */
+#define STATS_PATH "/__proxy/stats"
+
+/* Req stages timed into histograms */
+#define STAGE_PARSE     0   // req line in to cache lookup
+#define STAGE_LOOKUP    1   // RAM cache lookup
+#define STAGE_DNS       2   // server name resolution
+#define STAGE_CONNECT   3   // server connect race
+#define STAGE_FIRSTBYTE 4   // fwd req sent to first resp byte
+#define STAGE_TRANSFER  5   // first resp byte to end of resp
+#define STAGE_TOTAL     6   // req line in to conn done with the req
+#define NSTAGES 7
+
+/* Event counters */
+#define CNT_REQUESTS    0
+#define CNT_HITS        1   // fresh RAM hits
+#define CNT_STALE_HITS  2   // stale copies served, during a refresh or error
+#define CNT_DISK_HITS   3
+#define CNT_MISSES      4   // reqs that led or followed a fetch
+#define CNT_NOT_MODIFIED 5  // revalidations answered 304
+#define CNT_ERRORS      6   // fetches that failed
+#define CNT_HIT_BYTES   7   // sent to clients from RAM or disk
+#define CNT_SERVER_BYTES 8  // read from servers
+#define CNT_SYSCALLS    9   // accept, socket I/O and wait syscalls of event loops
+#define NCOUNTERS 10
+
+/*
+ * Latency histograms are HDR-style log-linear: values below
+ * 2 * HIST_SUB usecs are exact, and each power of two above that is
+ * split into HIST_SUB buckets, so any sample is known to within
+ * 1 / HIST_SUB (about 6%). Samples at or over HIST_MAX_BITS are
+ * clamped into the top bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36    /* ~19 hours in usecs */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+ * Per-thread block. Only its owner thread writes it, with relaxed
+ * atomic loads and stores and no read-modify-write, so recording a
+ * sample costs no lock and no bus lock; a report sums all blocks. A
+ * block outlives its thread and is handed to the next new thread, so
+ * its counts are never lost.
+ */
+typedef struct Stats {
+    uint64_t counts[NCOUNTERS];
+    uint64_t hist[NSTAGES][HIST_BUCKETS];
+    uint64_t sum[NSTAGES];      // usecs, for the mean
+    int inuse;                  // owned by a live thread
+    struct Stats *next;
+} Stats;
+
+void stats_init();
+uint64_t stats_now();
+uint64_t stats_time(int stage, uint64_t since);
+void stats_count(int counter, uint64_t n);
+int stats_is_path(char *url);
+size_t stats_reply(char *url, char *buf, size_t size, int keepalive);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * upstream.c - pool of idle persistent server conns
+ *
+ * After a complete resp on a keep-alive server conn, the fd is parked
+ * here under its (host, port). A later miss for the same server takes
+ * it back instead of paying a TCP handshake again.
+ */
+#include "upstream.h"
+#include "resolve.h"
+
+static IdleConn *buckets[UPSTREAM_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned bucket_of(char *host, char *port)
+{
+    unsigned h = 5381;
+    for(char *p = host; *p; p++)
+        h = h * 33 + (unsigned char)tolower(*p);
+    for(char *p = port; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    return h % UPSTREAM_BUCKETS;
+}
+
+static int same_server(IdleConn *ic, char *host, char *port)
+{
+    return !strcasecmp(ic->host, host) && !strcmp(ic->port, port);
+}
+
+/* still open with nothing unread? */
+static int conn_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void free_idle(IdleConn *ic)
+{
+    close(ic->fd);
+    free(ic->host);
+    free(ic->port);
+    free(ic);
+}
+
+void upstream_init()
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+/*
+ * upstream_get - an idle pooled conn to host:port, or a new one
+ * *reused tells the caller a failure may just mean the server closed
+ * the idle conn, so retrying on a fresh conn is safe. Under the lock
+ * expired conns are dropped by age alone; only the conn taken is
+ * probed, after unlocking.
+ */
+int upstream_get(char *host, char *port, int *reused)
+{
+    IdleConn **pp, *ic, *dead, *found;
+    time_t now = time(NULL);
+    int fd;
+
+    do{
+        dead = found = NULL;
+        pthread_mutex_lock(&lock);
+        pp = &buckets[bucket_of(host, port)];
+        while((ic = *pp)){
+            if(now - ic->since > UPSTREAM_IDLE_SECS){
+                *pp = ic->next;
+                ic->next = dead;
+                dead = ic;
+                continue;
+            }
+            if(same_server(ic, host, port)){
+                *pp = ic->next;
+                found = ic;
+                break;
+            }
+            pp = &ic->next;
+        }
+        pthread_mutex_unlock(&lock);
+
+        // close outside the lock
+        while(dead){
+            ic = dead;
+            dead = ic->next;
+            free_idle(ic);
+        }
+        if(found && conn_alive(found->fd)){
+            fd = found->fd;
+            free(found->host);
+            free(found->port);
+            free(found);
+            *reused = 1;
+            return fd;
+        }
+        // closed by the server meanwhile; try the next one
+        if(found)
+            free_idle(found);
+    } while(found);
+
+    *reused = 0;
+    return resolve_open(host, port);
+}
+
+/*
+ * upstream_put - park a conn whose last resp was fully read
+ */
+void upstream_put(char *host, char *port, int fd)
+{
+    IdleConn *ic, **pp;
+    int n = 0;
+
+    pthread_mutex_lock(&lock);
+    pp = &buckets[bucket_of(host, port)];
+    for(ic = *pp; ic; ic = ic->next)
+        if(same_server(ic, host, port))
+            n++;
+    if(n >= UPSTREAM_MAX_IDLE){
+        pthread_mutex_unlock(&lock);
+        Close(fd);
+        return;
+    }
+    ic = (IdleConn *)Malloc(sizeof(IdleConn));
+    ic->host = strdup(host);
+    ic->port = strdup(port);
+    ic->fd = fd;
+    ic->since = time(NULL);
+    ic->next = *pp;
+    *pp = ic;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,23 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* Idle server conn pool, keyed by (host, port) */
+#define UPSTREAM_BUCKETS 64
+#define UPSTREAM_MAX_IDLE 8     /* idle conns kept per (host, port) */
+#define UPSTREAM_IDLE_SECS 30   /* idle conns older than this are closed */
+
+typedef struct IdleConn {
+    char *host;
+    char *port;
+    int fd;
+    time_t since;
+    struct IdleConn *next;
+} IdleConn;
+
+void upstream_init();
+int upstream_get(char *host, char *port, int *reused);
+void upstream_put(char *host, char *port, int fd);
+
+#endif
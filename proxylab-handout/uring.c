@@ -0,0 +1,128 @@
+/*
+ * uring.c - io_uring setup, submission and completion rings
+ *
+ * The SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP) and
+ * the SQE array has its own. The kernel reads the SQ tail and writes
+ * the CQ tail, so those are loaded and stored with acquire/release
+ * ordering; every other field of a ring is ours alone.
+ */
+#include <sys/syscall.h>
+#include "uring.h"
+
+/*
+ * uring_init - set up a ring with room for entries SQEs
+ * Returns -1 with errno set if io_uring is missing, disabled, or too
+ * old; the caller then stays on epoll.
+ */
+int uring_init(Uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    char *ring;
+
+    memset(&p, 0, sizeof(p));
+    // fewer interrupts; completions are reaped on the next enter anyway
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0){
+        memset(&p, 0, sizeof(p));
+        if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+            return -1;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) ||
+       !(p.features & IORING_FEAT_LINKED_FILE)){
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if(r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+        r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->ring == MAP_FAILED){
+        close(r->fd);
+        return -1;
+    }
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        munmap(r->ring, r->ring_size);
+        close(r->fd);
+        return -1;
+    }
+    ring = (char *)r->ring;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    r->queued = 0;
+    return 0;
+}
+
+void uring_free(Uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->fd);
+}
+
+/*
+ * uring_sqe - the next free SQE, zeroed
+ * A full SQ ring is handed to the kernel first.
+ */
+struct io_uring_sqe *uring_sqe(Uring *r)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while(r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+        if(uring_enter(r, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            unix_error("io_uring_enter error");
+    idx = r->tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    // the kernel only looks at the tail on enter, after the caller
+    // has filled the SQE in
+    __atomic_store_n(r->sq_tail, ++r->tail, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+/*
+ * uring_enter - submit queued SQEs and wait for at least wait CQEs
+ * Returns -1 with errno set on failure, EINTR included.
+ */
+int uring_enter(Uring *r, unsigned wait)
+{
+    int n;
+
+    n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(n < 0)
+        return -1;
+    r->queued -= n;
+    return n;
+}
+
+/* the oldest unseen CQE, or NULL */
+struct io_uring_cqe *uring_peek(Uring *r)
+{
+    unsigned head = *r->cq_head;
+
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/* give the CQE from uring_peek back to the kernel */
+void uring_seen(Uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
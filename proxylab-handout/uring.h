@@ -0,0 +1,37 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include "csapp.h"
+
+/*
+ * Minimal io_uring over the raw syscalls, without liburing. SQEs are
+ * filled in user space and reach the kernel with the next
+ * uring_enter(), which also waits for completions, so one syscall
+ * carries a whole batch of accepts, polls, recvs and sends. Needs
+ * Linux 6.0 or later for multishot accept and cancel-all.
+ */
+#define URING_ENTRIES 1024
+
+typedef struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned tail;          // local SQ tail, published by uring_sqe
+    unsigned queued;        // SQEs the kernel has not consumed yet
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+} Uring;
+
+int uring_init(Uring *r, unsigned entries);
+void uring_free(Uring *r);
+struct io_uring_sqe *uring_sqe(Uring *r);
+int uring_enter(Uring *r, unsigned wait);
+struct io_uring_cqe *uring_peek(Uring *r);
+void uring_seen(Uring *r);
+
+#endif
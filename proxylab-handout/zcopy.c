@@ -0,0 +1,94 @@
+/*
+ * zcopy.c - splice()-based relay for resps the cache will never hold
+ *
+ * Bytes go socket -> pipe -> socket without entering user space. The
+ * blocking zc_relay() is for worker threads and keeps one pipe per
+ * thread; the epoll loop owns a pipe per conn and drives the
+ * non-blocking zc_splice_in/out halves itself.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include "zcopy.h"
+
+static __thread int tpipe[2] = { -1, -1 };
+
+/*
+ * zc_pipe - non-blocking pipe sized for ZC_CHUNK transfers
+ */
+int zc_pipe(int pipefd[2])
+{
+    if(pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+    // best effort; the default 64KB pipe works too
+    fcntl(pipefd[1], F_SETPIPE_SZ, ZC_CHUNK);
+    return 0;
+}
+
+ssize_t zc_splice_in(int from, int pipe_w, size_t len)
+{
+    return splice(from, NULL, pipe_w, NULL, len,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+}
+
+ssize_t zc_splice_out(int pipe_r, int to, size_t len)
+{
+    return splice(pipe_r, NULL, to, NULL, len,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+}
+
+/* push n bytes sitting in this thread's pipe out to a blocking socket */
+static int drain_pipe(int to, size_t n)
+{
+    ssize_t rc;
+
+    while(n > 0){
+        rc = splice(tpipe[0], NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(rc < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        n -= rc;
+    }
+    return 0;
+}
+
+/*
+ * zc_relay - move len bytes, or until EOF if len < 0, from one blocking
+ * socket to another. Returns the bytes moved, or -1 on error or on EOF
+ * before len bytes.
+ */
+ssize_t zc_relay(int from, int to, long len)
+{
+    size_t total = 0, want;
+    ssize_t n;
+
+    if(tpipe[0] < 0 && zc_pipe(tpipe) < 0)
+        return -1;
+    while(len < 0 || total < len){
+        want = (len < 0 || len - total > ZC_CHUNK) ? ZC_CHUNK : len - total;
+        // blocking socket in; the pipe is empty here so it never fills
+        n = splice(from, NULL, tpipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(n == 0)
+            break;  // EOF
+        if(drain_pipe(to, n) < 0){
+            // a half-drained pipe would leak bytes into the next relay
+            close(tpipe[0]);
+            close(tpipe[1]);
+            tpipe[0] = tpipe[1] = -1;
+            return -1;
+        }
+        total += n;
+    }
+    if(len >= 0 && total < len)
+        return -1;
+    return total;
+}
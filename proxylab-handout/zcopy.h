@@ -0,0 +1,18 @@
+#ifndef __ZCOPY_H__
+#define __ZCOPY_H__
+
+#include <sys/types.h>
+
+/* Bytes moved per splice() call; also the pipe size we ask for */
+#define ZC_CHUNK (256 * 1024)
+
+/*
+ * Zero-copy relay between sockets through a kernel pipe. Kept apart
+ * from csapp.h since splice() needs _GNU_SOURCE.
+ */
+int zc_pipe(int pipefd[2]);
+ssize_t zc_relay(int from, int to, long len);
+ssize_t zc_splice_in(int from, int pipe_w, size_t len);
+ssize_t zc_splice_out(int pipe_r, int to, size_t len);
+
+#endif